@@ -13,7 +13,7 @@ script=$(basename "$0")
 common_build_parse_args "$@"
 
 case "$mode" in
-build|callgrind|check|cross|debug|fast_feedback)
+bench|build|callgrind|check|cross|debug|fast_feedback)
     ;;
 install|test|test_all|uninstall|valgrind)
     ;;
@@ -71,6 +71,16 @@ LDFLAGS="$LDFLAGS $(pkg-config xi --libs)"
 LDFLAGS="$LDFLAGS $(pkg-config libmagic --libs)"
 LDFLAGS="$LDFLAGS -lm"
 
+# CLIPSIM_XCB=1 builds the clipboard watcher on XCB instead of Xlib.
+test_exclude='(^|/)tests/'
+if [ "${CLIPSIM_XCB:-0}" = 1 ]; then
+    CPPFLAGS="$CPPFLAGS -DCLIPSIM_XCB=1"
+    CPPFLAGS="$CPPFLAGS $(pkg-config xcb xcb-xfixes --cflags)"
+    LDFLAGS="$LDFLAGS $(pkg-config xcb xcb-xfixes --libs)"
+else
+    test_exclude="$test_exclude|(^|/)clipboard_xcb\.c$"
+fi
+
 case "$mode" in
 fast_feedback)
     ;;
@@ -93,14 +103,14 @@ callgrind)
 check)
     common_build_run_analyzers build
     ;;
-build)
+build|bench)
     CFLAGS="$CFLAGS -O2 -flto -march=native -ftree-vectorize"
     ;;
 cross)
     common_build_cross_all
     CFLAGS="$CFLAGS -O2"
     ;;
-build|callgrind|check|cross|debug|fast_feedback|install|test|test_all|uninstall|valgrind)
+bench|build|callgrind|check|cross|debug|fast_feedback|install|test|test_all|uninstall|valgrind)
     ;;
 *)
     common_build_unknown_mode
@@ -152,7 +162,7 @@ install)
     exit
     ;;
 test)
-    TEST_EXCLUDE_PATTERN='(^|/)tests/' \
+    TEST_EXCLUDE_PATTERN="$test_exclude" \
         common_test "$target"
     if command -v bash >/dev/null 2>&1; then
         tests/test.bash
@@ -173,9 +183,29 @@ build|callgrind|cross|debug|valgrind)
     $CC $CPPFLAGS $CFLAGS -o ${exe} main.c $LDFLAGS
     trace_off
     ;;
+bench)
+    trace_on
+    $CC $CPPFLAGS $CFLAGS -o ${exe} main.c $LDFLAGS
+    $CC $CPPFLAGS $CFLAGS -o bin/bench tests/bench.c $LDFLAGS
+    trace_off
+    ;;
 esac
 
 case "$mode" in
+bench)
+    # One line of key=value pairs per measurement on stdout.
+    # Daemon startup is only measured when $DISPLAY is set.
+    bench_dir=$(mktemp -d)
+    for entries in ${BENCH_ENTRIES:-128 1024 8192}; do
+        for images in ${BENCH_IMAGES:-0 10}; do
+            TMPDIR="$bench_dir" bin/bench "$entries" \
+                "${BENCH_MIN_SIZE:-16}" "${BENCH_MAX_SIZE:-16384}" \
+                "$images" "${BENCH_RUNS:-5}" "$dir/$exe" 2>/dev/null
+        done
+    done
+    rm -rf "$bench_dir"
+    exit
+    ;;
 valgrind)
     vg_flags="--error-exitcode=1 --errors-for-leak-kinds=all"
     vg_flags="$vg_flags --leak-check=full --show-leak-kinds=all"
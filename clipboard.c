@@ -13,6 +13,7 @@
 
 #include "clipsim.h"
 #include "history.c"
+#include "incoming.c"
 
 #if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
 #define TESTING_clipboard 1
@@ -44,9 +45,19 @@ static Atom TEXT;
 static Atom image_png;
 static Atom TARGETS;
 
-static void clipboard_incremental_case(char **, ulong *);
+/* Formats clipsim saves, most preferred first. */
+static Atom *clipboard_formats[] = {
+    &UTF8_STRING, &image_png, &STRING, &TEXT,
+};
+
+static int32 clipboard_incremental_case(int32, char **, ulong *, int64 *);
 static Atom clipboard_check_target(Atom);
-static int32 clipboard_get_clipboard(char **, ulong *, bool *);
+static bool clipboard_wait_event(Window, int32, XEvent *,
+                                 struct timespec, int32);
+static int32 clipboard_debounce(int32, int32);
+static bool clipboard_offered_targets(uint32 *);
+static int32 clipboard_convert(Atom, char **, ulong *, int64 *);
+static int32 clipboard_get_clipboard(char **, ulong *, int64 *);
 
 static noreturn int clipboard_daemon_watch(void);
 
@@ -54,11 +65,11 @@ int32
 clipboard_daemon_watch(void) {
     DEBUG_PRINT("void")
     ulong color;
-    char *CLIPSIM_SIGNAL_NUMBER;
-    char *CLIPSIM_SIGNAL_PROGRAM;
-    int32 signal_number = 0;
+    char *signal_program;
+    int32 signal_number;
     int32 xfixes_event_base;
     int32 xfixes_error_base;
+    int32 debounce = CLIPBOARD_DEBOUNCE_MIN_MS;
 
     if ((display = XOpenDisplay(NULL)) == NULL) {
         error("Error opening X display.");
@@ -70,33 +81,7 @@ clipboard_daemon_watch(void) {
         exit(EXIT_FAILURE);
     }
 
-    GETENV(CLIPSIM_SIGNAL_PROGRAM);
-    if (CLIPSIM_SIGNAL_PROGRAM == NULL) {
-        error("CLIPSIM_SIGNAL_PROGRAM is not defined.\n");
-    }
-
-    GETENV(CLIPSIM_SIGNAL_NUMBER);
-    if (CLIPSIM_SIGNAL_NUMBER == NULL) {
-        error("CLIPSIM_SIGNAL_NUMBER is not defined.\n");
-    }
-    if (CLIPSIM_SIGNAL_PROGRAM && CLIPSIM_SIGNAL_NUMBER) {
-        if ((signal_number = atoi(CLIPSIM_SIGNAL_NUMBER)) <= 0) {
-            error("Invalid CLIPSIM_SIGNAL_NUMBER environment variable: %s.\n",
-                  CLIPSIM_SIGNAL_NUMBER);
-            if (CLIPSIM_SIGNAL_PROGRAM) {
-                error("%s will not be signaled.\n", CLIPSIM_SIGNAL_PROGRAM);
-            }
-
-            CLIPSIM_SIGNAL_NUMBER = NULL;
-            CLIPSIM_SIGNAL_PROGRAM = NULL;
-        }
-#if defined(SIGRTMIN)
-        signal_number += SIGRTMIN;
-#endif
-    } else {
-        CLIPSIM_SIGNAL_NUMBER = NULL;
-        CLIPSIM_SIGNAL_PROGRAM = NULL;
-    }
+    signal_program = watch_signal_program(&signal_number);
 
     CLIPBOARD = XInternAtom(display, "CLIPBOARD", False);
     XSEL_DATA = XInternAtom(display, "XSEL_DATA", False);
@@ -121,8 +106,9 @@ clipboard_daemon_watch(void) {
         XEvent xevent;
         char *save = NULL;
         ulong length;
-        bool incr;
+        int64 capacity;
         int32 clipboard_result;
+        int32 coalesced;
 
         (void)XNextEvent(display, &xevent);
         if (DEBUGGING) {
@@ -136,168 +122,228 @@ clipboard_daemon_watch(void) {
         if (xevent.type != (xfixes_event_base + XFixesSelectionNotify)) {
             continue;
         }
-        sleep_ms(10);
 
-        if (CLIPSIM_SIGNAL_PROGRAM) {
-            send_signal(CLIPSIM_SIGNAL_PROGRAM, signal_number);
-        }
+        coalesced = clipboard_debounce(xevent.type, debounce);
+        debounce = watch_debounce(debounce, coalesced);
 
-        clipboard_result = clipboard_get_clipboard(&save, &length, &incr);
+        if (signal_program) {
+            send_signal(signal_program, signal_number);
+        }
 
-        xpthread_mutex_lock(&lock);
+        clipboard_result = clipboard_get_clipboard(&save, &length, &capacity);
 
-        switch (clipboard_result) {
-        case CLIPBOARD_TEXT:
-            history_append(save, (int32)length, incr);
-            break;
-        case CLIPBOARD_IMAGE:
-            history_append(save, (int32)length, incr);
-            break;
-        case CLIPBOARD_OTHER:
-            error("Unsupported format."
-                  " Clipsim only works with UTF-8 and images.\n");
-            break;
-        case CLIPBOARD_LARGE:
-            error("Buffer is too large."
-                  " This data won't be saved to history.\n");
-            break;
-        case CLIPBOARD_ERROR:
-            error("Empty clipboard detected. Recovering last entry...\n");
-            history_recover(-1);
-            break;
-        default:
-            error("Unhandled result from clipboard_get_clipboard.\n");
-            exit(EXIT_FAILURE);
-        }
-        xpthread_mutex_unlock(&lock);
+        incoming_store(clipboard_result, save, length, capacity, coalesced);
     }
 }
 
+/* Asks the owner for its TARGETS once and converts the best format in
+ * it, falling back to the others it offers.  Owners that do not answer
+ * TARGETS get the formats tried one by one, in order of preference.
+ * CLIPBOARD_ERROR, which recovers the last entry, is only returned when
+ * there is no owner. */
 int32
-clipboard_get_clipboard(char **save, ulong *length, bool *incr) {
+clipboard_get_clipboard(char **save, ulong *length, int64 *capacity) {
     DEBUG_PRINT("%p, %p", (void *)save, (void *)length)
+    uint32 offered = ~0u;
+
+    *capacity = 0;
+
+    if (XGetSelectionOwner(display, CLIPBOARD) == None) {
+        return CLIPBOARD_ERROR;
+    }
+
+    if (clipboard_offered_targets(&offered) && (offered == 0)) {
+        return CLIPBOARD_OTHER;
+    }
+
+    for (int32 i = 0; i < LENGTH(clipboard_formats); i += 1) {
+        int32 result;
+
+        if (!(offered & (1u << i))) {
+            continue;
+        }
+        result = clipboard_convert(*clipboard_formats[i],
+                                   save, length, capacity);
+        if (result != CLIPBOARD_ERROR) {
+            return result;
+        }
+    }
+
+    /* The owner may have gone away while being asked. */
+    if (XGetSelectionOwner(display, CLIPBOARD) == None) {
+        return CLIPBOARD_ERROR;
+    }
+    return CLIPBOARD_OTHER;
+}
+
+/* Returns false, leaving *offered alone, if the owner did not answer
+ * TARGETS.  Otherwise bit i of *offered is set when it offers
+ * clipboard_formats[i]. */
+bool
+clipboard_offered_targets(uint32 *offered) {
+    DEBUG_PRINT("%p", (void *)offered)
     int32 actual_format_return;
     ulong nitems_return;
     ulong bytes_after_return;
     Atom actual_type_return;
+    Atom *targets;
 
-    *incr = false;
-
-    if (clipboard_check_target(UTF8_STRING)) {
-        XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
-                           AnyPropertyType, &actual_type_return,
-                           &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **)save);
-        if (actual_type_return == INCR) {
-            XFree(*save);
-            clipboard_incremental_case(save, length);
-            if ((*length <= 0) || (*length >= ENTRY_MAX_LENGTH)) {
-                return CLIPBOARD_LARGE;
-            }
-            *incr = true;
-            return CLIPBOARD_TEXT;
-        }
-
-        *length = nitems_return;
-        return CLIPBOARD_TEXT;
+    if (!clipboard_check_target(TARGETS)) {
+        return false;
     }
-    if (clipboard_check_target(image_png)) {
-        XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
-                           AnyPropertyType, &actual_type_return,
+    if (XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
+                           XA_ATOM, &actual_type_return,
                            &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **)save);
-        if (actual_type_return == INCR) {
-            XFree(*save);
-            clipboard_incremental_case(save, length);
-            if ((*length <= 0) || (*length >= ENTRY_MAX_LENGTH)) {
-                return CLIPBOARD_LARGE;
-            }
-            *incr = true;
-            return CLIPBOARD_IMAGE;
+                           &bytes_after_return, (uchar **)&targets)
+        != Success) {
+        return false;
+    }
+    if ((actual_type_return != XA_ATOM) || (actual_format_return != 32)) {
+        if (targets) {
+            XFree(targets);
         }
-
-        *length = nitems_return;
-        return CLIPBOARD_IMAGE;
+        return false;
     }
-    if (clipboard_check_target(STRING)) {
-        XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
-                           AnyPropertyType, &actual_type_return,
-                           &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **)save);
-        if (actual_type_return == INCR) {
-            XFree(*save);
-            clipboard_incremental_case(save, length);
-            if ((*length <= 0) || (*length >= ENTRY_MAX_LENGTH)) {
-                return CLIPBOARD_LARGE;
+
+    *offered = 0;
+    for (ulong i = 0; i < nitems_return; i += 1) {
+        for (int32 j = 0; j < LENGTH(clipboard_formats); j += 1) {
+            if (targets[i] == *clipboard_formats[j]) {
+                *offered |= 1u << j;
+                break;
             }
-            *incr = true;
-            return CLIPBOARD_TEXT;
         }
+    }
+    XFree(targets);
+    return true;
+}
 
-        *length = nitems_return;
-        return CLIPBOARD_TEXT;
+/* Fetches the selection converted to target.  *capacity is set to the
+ * size of *save when it was allocated by the INCR receiver, and stays 0
+ * when it is freed with XFree. */
+int32
+clipboard_convert(Atom target, char **save, ulong *length, int64 *capacity) {
+    DEBUG_PRINT("%lu, %p, %p", target, (void *)save, (void *)length)
+    int32 actual_format_return;
+    ulong nitems_return;
+    ulong bytes_after_return;
+    Atom actual_type_return;
+    int32 kind = CLIPBOARD_TEXT;
+
+    if (target == image_png) {
+        kind = CLIPBOARD_IMAGE;
     }
-    if (clipboard_check_target(TEXT)) {
-        XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
-                           AnyPropertyType, &actual_type_return,
-                           &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **)save);
-        if (actual_type_return == INCR) {
-            XFree(*save);
-            clipboard_incremental_case(save, length);
-            if ((*length <= 0) || (*length >= ENTRY_MAX_LENGTH)) {
-                return CLIPBOARD_LARGE;
-            }
-            *incr = true;
-            return CLIPBOARD_TEXT;
-        }
 
-        *length = nitems_return;
-        return CLIPBOARD_TEXT;
+    if (!clipboard_check_target(target)) {
+        return CLIPBOARD_ERROR;
     }
-    if (clipboard_check_target(TARGETS)) {
-        return CLIPBOARD_OTHER;
+
+    XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
+                       AnyPropertyType, &actual_type_return,
+                       &actual_format_return, &nitems_return,
+                       &bytes_after_return, (uchar **)save);
+    if (actual_type_return == INCR) {
+        XFree(*save);
+        return clipboard_incremental_case(kind, save, length, capacity);
     }
 
-    return CLIPBOARD_ERROR;
+    *length = nitems_return;
+    return kind;
 }
 
 Atom
 clipboard_check_target(Atom target) {
-    int32 retries = 50;
     DEBUG_PRINT("%lu", target)
-
     XEvent xevent;
+    struct timespec start;
 
+    time_monotonic_precise(&start);
     XConvertSelection(display, CLIPBOARD, target, XSEL_DATA, window, CurrentTime);
+    XFlush(display);
+
+    while (clipboard_wait_event(window, SelectionNotify, &xevent,
+                                start, CLIPBOARD_CONVERT_TIMEOUT_MS)) {
+        /* A late answer to an earlier conversion is not ours. */
+        if ((xevent.xselection.selection == CLIPBOARD)
+            && (xevent.xselection.target == target)) {
+            return xevent.xselection.property;
+        }
+    }
+    return 0;
+}
+
+/* Takes the next event of type for target, sleeping on the connection
+ * until one arrives or timeout_ms have passed since start.  Xlib reads
+ * whatever is on the socket when checking the queue, so poll only has to
+ * wake us up for new data. */
+bool
+clipboard_wait_event(Window target, int32 type, XEvent *xevent,
+                     struct timespec start, int32 timeout_ms) {
+    struct pollfd connection;
+
+    connection.fd = ConnectionNumber(display);
+    connection.events = POLLIN;
 
     while (true) {
-        if (XCheckTypedWindowEvent(display, window, SelectionNotify, &xevent)) {
-            if (xevent.xselection.selection == CLIPBOARD) {
-                return xevent.xselection.property;
+        struct timespec now;
+        int32 remaining;
+
+        if (XCheckTypedWindowEvent(display, target, type, xevent)) {
+            return true;
+        }
+
+        time_monotonic_precise(&now);
+        remaining = timeout_ms - (int32)(timediff(start, now)*1000.0);
+        if (remaining <= 0) {
+            return false;
+        }
+
+        if (poll(&connection, 1, remaining) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            error("Error polling X connection: %s.\n", strerror(errno));
+            return false;
         }
-        retries -= 1;
-        if (retries <= 0) {
-            return 0;
+    }
+}
+
+/* Merges the owner changes of type that follow one just received, and
+ * returns how many there were. */
+int32
+clipboard_debounce(int32 type, int32 debounce) {
+    DEBUG_PRINT("%d, %d", type, debounce)
+    XEvent xevent;
+    struct timespec first;
+    struct timespec last;
+    int32 coalesced = 0;
+
+    time_monotonic_precise(&first);
+    last = first;
+
+    while (clipboard_wait_event(root, type, &xevent, last, debounce)) {
+        coalesced += 1;
+        time_monotonic_precise(&last);
+        if ((timediff(first, last)*1000.0) >= CLIPBOARD_BURST_MAX_MS) {
+            break;
         }
-        sleep_ms(10);
     }
+    return coalesced;
 }
 
-void
-clipboard_incremental_case(char **save, ulong *length) {
-    DEBUG_PRINT("%p, %p", (void *)save, (void *)length)
+/* Receives an INCR transfer, one property change per chunk, waiting on
+ * the connection for each. */
+int32
+clipboard_incremental_case(int32 kind, char **save,
+                           ulong *length, int64 *capacity) {
+    DEBUG_PRINT("%d, %p, %p", kind, (void *)save, (void *)length)
     int32 actual_format_return;
     ulong nitems_return;
     ulong bytes_after_return;
     Atom actual_type_return;
-    char *buffer;
-    bool exceeded = false;
-    ulong current_size = 0;
-    char *final_buffer;
+    Incoming incoming;
 
-    final_buffer = malloc2(ENTRY_MAX_LENGTH);
+    incoming_start(&incoming, kind);
 
     XSelectInput(display, window, PropertyChangeMask);
     XDeleteProperty(display, window, XSEL_DATA);
@@ -305,67 +351,46 @@ clipboard_incremental_case(char **save, ulong *length) {
 
     while (true) {
         XEvent event;
+        struct timespec start;
+        char *chunk;
         bool got_event = false;
-        int32 retries = 100;
 
-        while (true) {
-            if (XCheckTypedWindowEvent(display, window, PropertyNotify, &event)) {
-                if ((event.xproperty.state == PropertyNewValue) && (event.xproperty.atom == XSEL_DATA)) {
-                    got_event = true;
-                    break;
-                }
-            }
-            retries -= 1;
-            if (retries <= 0) {
+        time_monotonic_precise(&start);
+        while (clipboard_wait_event(window, PropertyNotify, &event,
+                                    start, CLIPBOARD_INCR_TIMEOUT_MS)) {
+            if ((event.xproperty.state == PropertyNewValue)
+                && (event.xproperty.atom == XSEL_DATA)) {
+                got_event = true;
                 break;
             }
-            sleep_ms(10);
         }
 
         if (!got_event) {
-            exceeded = true;
+            incoming.failed = true;
             break;
         }
 
         XGetWindowProperty(display, window, XSEL_DATA, 0, LONG_MAX / 4, False,
                            AnyPropertyType, &actual_type_return,
                            &actual_format_return, &nitems_return,
-                           &bytes_after_return, (uchar **)&buffer);
+                           &bytes_after_return, (uchar **)&chunk);
 
         if (nitems_return == 0) {
-            XFree(buffer);
+            XFree(chunk);
             XDeleteProperty(display, window, XSEL_DATA);
             break;
         }
 
-        if (!exceeded) {
-            if ((current_size + nitems_return) >= ENTRY_MAX_LENGTH) {
-                exceeded = true;
-            } else {
-                memcpy64(final_buffer + current_size, buffer,
-                         (int64)nitems_return);
-                current_size += nitems_return;
-            }
-        }
+        incoming_chunk(&incoming, chunk, (int64)nitems_return);
 
-        XFree(buffer);
+        XFree(chunk);
         XDeleteProperty(display, window, XSEL_DATA);
         XFlush(display);
     }
     XSelectInput(display, window, NoEventMask);
     XFlush(display);
 
-    if (exceeded) {
-        free2(final_buffer, ENTRY_MAX_LENGTH);
-        *save = NULL;
-        *length = 0;
-    } else {
-        final_buffer[current_size] = '\0';
-        *save = final_buffer;
-        *length = current_size;
-    }
-
-    return;
+    return incoming_finish(&incoming, save, length, capacity);
 }
 
 #if TESTING_clipboard
@@ -408,12 +433,14 @@ main(void) {
             ulong len = 0;
             char *res_save = NULL;
             int32 res_clip;
-            bool incr;
+            int64 capacity;
 
             CLIPBOARD = XInternAtom(display, "CLIPBOARD", False);
             XSEL_DATA = XInternAtom(display, "XSEL_DATA", False);
             INCR = XInternAtom(display, "INCR", False);
             UTF8_STRING = XInternAtom(display, "UTF8_STRING", False);
+            STRING = XInternAtom(display, "STRING", False);
+            TEXT = XInternAtom(display, "TEXT", False);
             image_png = XInternAtom(display, "image/png", False);
             TARGETS = XInternAtom(display, "TARGETS", False);
 
@@ -421,6 +448,60 @@ main(void) {
             color = BlackPixel(display, DefaultScreen(display));
             window = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, color, color);
 
+            {
+                XEvent mock_event;
+                Atom offered[] = {TARGETS, STRING, image_png, UTF8_STRING};
+                uint32 formats;
+
+                XChangeProperty(display, window, XSEL_DATA, XA_ATOM, 32,
+                                PropModeReplace, (uchar *)offered,
+                                LENGTH(offered));
+
+                mock_event.type = SelectionNotify;
+                mock_event.xselection.requestor = window;
+                mock_event.xselection.selection = CLIPBOARD;
+                mock_event.xselection.target = TARGETS;
+                mock_event.xselection.property = XSEL_DATA;
+                XPutBackEvent(display, &mock_event);
+
+                ASSERT(clipboard_offered_targets(&formats));
+                ASSERT_EQUAL(formats, 0x7);
+
+                XChangeProperty(display, window, XSEL_DATA, XA_ATOM, 32,
+                                PropModeReplace, (uchar *)offered, 2);
+                XPutBackEvent(display, &mock_event);
+
+                ASSERT(clipboard_offered_targets(&formats));
+                ASSERT_EQUAL(formats, 0x4);
+
+                XChangeProperty(display, window, XSEL_DATA, XA_ATOM, 32,
+                                PropModeReplace, (uchar *)offered, 1);
+                XPutBackEvent(display, &mock_event);
+
+                ASSERT(clipboard_offered_targets(&formats));
+                ASSERT_EQUAL(formats, 0);
+            }
+
+            {
+                XEvent mock_event = {0};
+                int32 event_base;
+                int32 error_base;
+
+                if (XFixesQueryExtension(display, &event_base, &error_base)) {
+                    mock_event.type = event_base + XFixesSelectionNotify;
+                    mock_event.xany.window = root;
+                    for (int32 i = 0; i < 3; i += 1) {
+                        XPutBackEvent(display, &mock_event);
+                    }
+                    ASSERT_EQUAL(clipboard_debounce(mock_event.type,
+                                                    CLIPBOARD_DEBOUNCE_MIN_MS),
+                                 3);
+                    ASSERT_EQUAL(clipboard_debounce(mock_event.type,
+                                                    CLIPBOARD_DEBOUNCE_MIN_MS),
+                                 0);
+                }
+            }
+
             XChangeProperty(display, window, XSEL_DATA, UTF8_STRING, 8,
                             PropModeReplace, (uchar *)test_str, 9);
 
@@ -435,6 +516,12 @@ main(void) {
                 mock_event.xselection.property = UTF8_STRING;
                 XPutBackEvent(display, &mock_event);
 
+                /* An answer to TARGETS arriving after its timeout, in
+                 * front of the one being waited for. */
+                mock_event.xselection.target = TARGETS;
+                mock_event.xselection.property = XSEL_DATA;
+                XPutBackEvent(display, &mock_event);
+
                 tgt = clipboard_check_target(UTF8_STRING);
                 ASSERT_EQUAL(tgt, UTF8_STRING);
             }
@@ -449,7 +536,9 @@ main(void) {
                 mock_event2.xselection.property = UTF8_STRING;
                 XPutBackEvent(display, &mock_event2);
 
-                res_clip = clipboard_get_clipboard(&res_save, &len, &incr);
+                capacity = 0;
+                res_clip = clipboard_convert(UTF8_STRING,
+                                             &res_save, &len, &capacity);
                 ASSERT_EQUAL(res_clip, CLIPBOARD_TEXT);
                 ASSERT_MORE(len, 0);
 
@@ -496,11 +585,13 @@ main(void) {
                     exit(0);
                 } else {
                     sleep_ms(100);
-                    clipboard_incremental_case(&large_save, &large_len);
+                    res_clip = clipboard_incremental_case(CLIPBOARD_TEXT,
+                                                          &large_save,
+                                                          &large_len,
+                                                          &capacity);
+                    ASSERT_EQUAL(res_clip, CLIPBOARD_LARGE);
                     ASSERT_EQUAL(large_len, 0);
-                    if (large_save != NULL) {
-                        free2(large_save, ENTRY_MAX_LENGTH);
-                    }
+                    ASSERT_NULL(large_save);
                     wait(NULL);
                 }
             }
@@ -539,12 +630,15 @@ main(void) {
                     exit(0);
                 } else {
                     sleep_ms(100);
-                    clipboard_incremental_case(&small_save, &small_len);
+                    res_clip = clipboard_incremental_case(CLIPBOARD_TEXT,
+                                                          &small_save,
+                                                          &small_len,
+                                                          &capacity);
+                    ASSERT_EQUAL(res_clip, CLIPBOARD_TEXT);
                     ASSERT_EQUAL(small_len, 15);
+                    ASSERT_EQUAL(capacity, INCOMING_CAPACITY);
                     ASSERT_EQUAL(memcmp64(small_save, "small_incr_test", 15), 0);
-                    if (small_save != NULL) {
-                        free2(small_save, ENTRY_MAX_LENGTH);
-                    }
+                    free2(small_save, capacity);
                     wait(NULL);
                 }
             }
@@ -0,0 +1,626 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(CLIPBOARD_XCB_C)
+#define CLIPBOARD_XCB_C
+
+#include "cbase.h"
+
+#include <xcb/xcb.h>
+#include <xcb/xfixes.h>
+
+#include "clipsim.h"
+#include "history.c"
+#include "incoming.c"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_clipboard_xcb 1
+#elif !defined(TESTING_clipboard_xcb)
+#define TESTING_clipboard_xcb 0
+#endif
+
+/* The clipboard watcher of clipboard.c on XCB, built instead of it with
+ * CLIPSIM_XCB.  Requests that do not depend on each other are sent
+ * together and their replies collected after: the atoms are interned in
+ * one round trip, the owner is asked for along with its TARGETS, and
+ * properties are read and deleted by the same request, which for INCR
+ * lets the owner send the next chunk while the last one is copied.  XCB
+ * is thread safe, so the daemon does not need XInitThreads. */
+
+enum {
+    ATOM_CLIPBOARD = 0,
+    ATOM_XSEL_DATA,
+    ATOM_INCR,
+    ATOM_TARGETS,
+    /* Formats clipsim saves, most preferred first. */
+    ATOM_UTF8_STRING,
+    ATOM_IMAGE_PNG,
+    ATOM_STRING,
+    ATOM_TEXT,
+    ATOM_LAST,
+};
+
+static char *clipboard_atom_names[ATOM_LAST] = {
+    [ATOM_CLIPBOARD] = "CLIPBOARD",
+    [ATOM_XSEL_DATA] = "XSEL_DATA",
+    [ATOM_INCR] = "INCR",
+    [ATOM_TARGETS] = "TARGETS",
+    [ATOM_UTF8_STRING] = "UTF8_STRING",
+    [ATOM_IMAGE_PNG] = "image/png",
+    [ATOM_STRING] = "STRING",
+    [ATOM_TEXT] = "TEXT",
+};
+
+static xcb_connection_t *clipboard_connection;
+static xcb_window_t clipboard_window;
+static xcb_window_t clipboard_root;
+static xcb_atom_t clipboard_atoms[ATOM_LAST];
+static uint8 clipboard_owner_notify;
+
+/* Owner changes that came while waiting for something else. */
+static int32 clipboard_pending = 0;
+
+static bool clipboard_xcb_open(void);
+static xcb_generic_event_t *clipboard_xcb_wait(uint8, struct timespec, int32);
+static int32 clipboard_xcb_debounce(int32);
+static xcb_atom_t clipboard_xcb_selection(xcb_atom_t, struct timespec);
+static int32 clipboard_xcb_get_clipboard(char **, ulong *, int64 *);
+static bool clipboard_xcb_offered_targets(uint32 *);
+static xcb_window_t clipboard_xcb_owner(void);
+static int32 clipboard_xcb_convert(int32, char **, ulong *, int64 *);
+static void clipboard_xcb_incremental_case(Incoming *);
+
+static noreturn int clipboard_daemon_watch(void);
+
+int32
+clipboard_daemon_watch(void) {
+    DEBUG_PRINT("void")
+    char *signal_program;
+    int32 signal_number;
+    int32 debounce = CLIPBOARD_DEBOUNCE_MIN_MS;
+
+    if (!clipboard_xcb_open()) {
+        exit(EXIT_FAILURE);
+    }
+
+    signal_program = watch_signal_program(&signal_number);
+
+    while (true) {
+        char *save;
+        ulong length;
+        int64 capacity;
+        int32 clipboard_result;
+        int32 coalesced;
+
+        if (clipboard_pending > 0) {
+            clipboard_pending -= 1;
+        } else {
+            xcb_generic_event_t *event;
+            uint8 type;
+
+            if ((event = xcb_wait_for_event(clipboard_connection)) == NULL) {
+                error("Lost connection to the X server.\n");
+                exit(EXIT_FAILURE);
+            }
+            type = (uint8)(event->response_type & 0x7f);
+            free(event);
+
+            if (DEBUGGING) {
+                error("X event: %d\n", type);
+            }
+            if (type != clipboard_owner_notify) {
+                continue;
+            }
+        }
+
+        coalesced = clipboard_pending + clipboard_xcb_debounce(debounce);
+        clipboard_pending = 0;
+        debounce = watch_debounce(debounce, coalesced);
+
+        if (signal_program) {
+            send_signal(signal_program, signal_number);
+        }
+
+        clipboard_result = clipboard_xcb_get_clipboard(&save, &length,
+                                                       &capacity);
+
+        incoming_store(clipboard_result, save, length, capacity, coalesced);
+    }
+}
+
+bool
+clipboard_xcb_open(void) {
+    DEBUG_PRINT("void")
+    xcb_intern_atom_cookie_t cookies[ATOM_LAST];
+    xcb_xfixes_query_version_cookie_t version_cookie;
+    xcb_xfixes_query_version_reply_t *version;
+    const xcb_query_extension_reply_t *xfixes;
+    xcb_screen_iterator_t screens;
+    int screen;
+    uint32 event_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+
+    clipboard_connection = xcb_connect(NULL, &screen);
+    if (xcb_connection_has_error(clipboard_connection)) {
+        error("Error opening X display.\n");
+        xcb_disconnect(clipboard_connection);
+        clipboard_connection = NULL;
+        return false;
+    }
+
+    screens = xcb_setup_roots_iterator(xcb_get_setup(clipboard_connection));
+    for (int32 i = 0; i < screen; i += 1) {
+        xcb_screen_next(&screens);
+    }
+    clipboard_root = screens.data->root;
+
+    xcb_prefetch_extension_data(clipboard_connection, &xcb_xfixes_id);
+    for (int32 i = 0; i < ATOM_LAST; i += 1) {
+        cookies[i] = xcb_intern_atom(clipboard_connection, 0,
+                                     (uint16)strlen32(clipboard_atom_names[i]),
+                                     clipboard_atom_names[i]);
+    }
+
+    xfixes = xcb_get_extension_data(clipboard_connection, &xcb_xfixes_id);
+    if ((xfixes == NULL) || !xfixes->present) {
+        error("XFixes extension not available.\n");
+        return false;
+    }
+    clipboard_owner_notify
+        = (uint8)(xfixes->first_event + XCB_XFIXES_SELECTION_NOTIFY);
+    version_cookie = xcb_xfixes_query_version(clipboard_connection,
+                                              XCB_XFIXES_MAJOR_VERSION,
+                                              XCB_XFIXES_MINOR_VERSION);
+
+    for (int32 i = 0; i < ATOM_LAST; i += 1) {
+        xcb_intern_atom_reply_t *reply;
+
+        reply = xcb_intern_atom_reply(clipboard_connection, cookies[i], NULL);
+        if (reply == NULL) {
+            error("Error interning %s.\n", clipboard_atom_names[i]);
+            return false;
+        }
+        clipboard_atoms[i] = reply->atom;
+        free(reply);
+    }
+
+    version = xcb_xfixes_query_version_reply(clipboard_connection,
+                                             version_cookie, NULL);
+    if (version == NULL) {
+        error("Error querying the XFixes version.\n");
+        return false;
+    }
+    free(version);
+
+    /* Property changes are only waited for during INCR transfers, and
+     * dropped otherwise. */
+    clipboard_window = xcb_generate_id(clipboard_connection);
+    xcb_create_window(clipboard_connection, XCB_COPY_FROM_PARENT,
+                      clipboard_window, clipboard_root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, screens.data->root_visual,
+                      XCB_CW_EVENT_MASK, &event_mask);
+
+    xcb_xfixes_select_selection_input(
+        clipboard_connection, clipboard_root, clipboard_atoms[ATOM_CLIPBOARD],
+        XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER
+            | XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_WINDOW_DESTROY
+            | XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_CLIENT_CLOSE);
+    xcb_flush(clipboard_connection);
+    return true;
+}
+
+/* Returns the next event of type, to be freed by the caller, sleeping on
+ * the connection until it comes or timeout_ms have passed since start.
+ * Owner changes that come meanwhile are counted in clipboard_pending, and
+ * any other event is dropped. */
+xcb_generic_event_t *
+clipboard_xcb_wait(uint8 type, struct timespec start, int32 timeout_ms) {
+    struct pollfd connection;
+
+    connection.fd = xcb_get_file_descriptor(clipboard_connection);
+    connection.events = POLLIN;
+
+    while (true) {
+        xcb_generic_event_t *event;
+        struct timespec now;
+        int32 remaining;
+
+        while ((event = xcb_poll_for_event(clipboard_connection)) != NULL) {
+            uint8 event_type = (uint8)(event->response_type & 0x7f);
+
+            if (event_type == type) {
+                return event;
+            }
+            if (event_type == clipboard_owner_notify) {
+                clipboard_pending += 1;
+            }
+            free(event);
+        }
+        if (xcb_connection_has_error(clipboard_connection)) {
+            error("Lost connection to the X server.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        time_monotonic_precise(&now);
+        remaining = timeout_ms - (int32)(timediff(start, now)*1000.0);
+        if (remaining <= 0) {
+            return NULL;
+        }
+
+        if (poll(&connection, 1, remaining) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("Error polling X connection: %s.\n", strerror(errno));
+            return NULL;
+        }
+    }
+}
+
+/* Merges the owner changes that follow one just received, and returns how
+ * many there were. */
+int32
+clipboard_xcb_debounce(int32 debounce) {
+    DEBUG_PRINT("%d", debounce)
+    xcb_generic_event_t *event;
+    struct timespec first;
+    struct timespec last;
+    int32 coalesced = 0;
+
+    time_monotonic_precise(&first);
+    last = first;
+
+    while ((event = clipboard_xcb_wait(clipboard_owner_notify,
+                                       last, debounce)) != NULL) {
+        free(event);
+        coalesced += 1;
+        time_monotonic_precise(&last);
+        if ((timediff(first, last)*1000.0) >= CLIPBOARD_BURST_MAX_MS) {
+            break;
+        }
+    }
+    return coalesced;
+}
+
+/* Waits for the answer to the conversion to target sent at start, and
+ * returns the property it was stored in, or XCB_NONE if it was refused.
+ * Late answers to earlier conversions are dropped. */
+xcb_atom_t
+clipboard_xcb_selection(xcb_atom_t target, struct timespec start) {
+    xcb_generic_event_t *event;
+
+    while ((event = clipboard_xcb_wait(XCB_SELECTION_NOTIFY, start,
+                                       CLIPBOARD_CONVERT_TIMEOUT_MS))
+           != NULL) {
+        xcb_selection_notify_event_t *notify = (void *)event;
+        xcb_atom_t property = notify->property;
+        xcb_atom_t selection = notify->selection;
+        xcb_atom_t answered = notify->target;
+
+        free(event);
+        if ((selection == clipboard_atoms[ATOM_CLIPBOARD])
+            && (answered == target)) {
+            return property;
+        }
+    }
+    return XCB_NONE;
+}
+
+/* Asks for the owner and its TARGETS in one go, and converts the best
+ * format offered, falling back to the others it offers.  Owners that do
+ * not answer TARGETS get the formats tried one by one, in order of
+ * preference.  CLIPBOARD_ERROR is only returned when there is no owner. */
+int32
+clipboard_xcb_get_clipboard(char **save, ulong *length, int64 *capacity) {
+    DEBUG_PRINT("%p, %p", (void *)save, (void *)length)
+    xcb_get_selection_owner_cookie_t owner_cookie;
+    xcb_get_selection_owner_reply_t *owner_reply;
+    xcb_window_t owner = XCB_NONE;
+    xcb_atom_t property;
+    uint32 offered = ~0u;
+    struct timespec start;
+
+    *save = NULL;
+    *length = 0;
+    *capacity = 0;
+
+    /* Without an owner the server refuses the conversion itself, so the
+     * answer to it comes right away either way. */
+    time_monotonic_precise(&start);
+    owner_cookie = xcb_get_selection_owner(clipboard_connection,
+                                           clipboard_atoms[ATOM_CLIPBOARD]);
+    xcb_convert_selection(clipboard_connection, clipboard_window,
+                          clipboard_atoms[ATOM_CLIPBOARD],
+                          clipboard_atoms[ATOM_TARGETS],
+                          clipboard_atoms[ATOM_XSEL_DATA], XCB_CURRENT_TIME);
+    xcb_flush(clipboard_connection);
+
+    owner_reply = xcb_get_selection_owner_reply(clipboard_connection,
+                                                owner_cookie, NULL);
+    if (owner_reply) {
+        owner = owner_reply->owner;
+        free(owner_reply);
+    }
+
+    property = clipboard_xcb_selection(clipboard_atoms[ATOM_TARGETS], start);
+    if (owner == XCB_NONE) {
+        return CLIPBOARD_ERROR;
+    }
+
+    if ((property != XCB_NONE) && clipboard_xcb_offered_targets(&offered)
+        && (offered == 0)) {
+        return CLIPBOARD_OTHER;
+    }
+
+    for (int32 i = ATOM_UTF8_STRING; i < ATOM_LAST; i += 1) {
+        int32 result;
+
+        if (!(offered & (1u << (i - ATOM_UTF8_STRING)))) {
+            continue;
+        }
+        if ((result = clipboard_xcb_convert(i, save, length, capacity))
+            != CLIPBOARD_ERROR) {
+            return result;
+        }
+    }
+
+    /* The owner may have gone away while being asked. */
+    if (clipboard_xcb_owner() == XCB_NONE) {
+        return CLIPBOARD_ERROR;
+    }
+    return CLIPBOARD_OTHER;
+}
+
+xcb_window_t
+clipboard_xcb_owner(void) {
+    xcb_get_selection_owner_reply_t *reply;
+    xcb_window_t owner = XCB_NONE;
+
+    reply = xcb_get_selection_owner_reply(
+        clipboard_connection,
+        xcb_get_selection_owner(clipboard_connection,
+                                clipboard_atoms[ATOM_CLIPBOARD]),
+        NULL);
+    if (reply) {
+        owner = reply->owner;
+        free(reply);
+    }
+    return owner;
+}
+
+/* Reads the TARGETS stored in XSEL_DATA.  Returns false, leaving *offered
+ * alone, if they are not a list of atoms.  Otherwise bit i of *offered is
+ * set when the format clipboard_atoms[ATOM_UTF8_STRING + i] is offered. */
+bool
+clipboard_xcb_offered_targets(uint32 *offered) {
+    DEBUG_PRINT("%p", (void *)offered)
+    xcb_get_property_reply_t *reply;
+    xcb_atom_t *targets;
+    int32 ntargets;
+
+    reply = xcb_get_property_reply(
+        clipboard_connection,
+        xcb_get_property(clipboard_connection, 1, clipboard_window,
+                         clipboard_atoms[ATOM_XSEL_DATA], XCB_ATOM_ATOM,
+                         0, UINT32_MAX / 4),
+        NULL);
+    if (reply == NULL) {
+        return false;
+    }
+    if ((reply->type != XCB_ATOM_ATOM) || (reply->format != 32)) {
+        free(reply);
+        return false;
+    }
+
+    targets = xcb_get_property_value(reply);
+    ntargets = xcb_get_property_value_length(reply) / (int32)sizeof(*targets);
+    *offered = 0;
+    for (int32 i = 0; i < ntargets; i += 1) {
+        for (int32 j = ATOM_UTF8_STRING; j < ATOM_LAST; j += 1) {
+            if (targets[i] == clipboard_atoms[j]) {
+                *offered |= 1u << (j - ATOM_UTF8_STRING);
+                break;
+            }
+        }
+    }
+    free(reply);
+    return true;
+}
+
+/* Fetches the selection converted to the format clipboard_atoms[format],
+ * always into memory of our own, so *capacity is set whenever *save is. */
+int32
+clipboard_xcb_convert(int32 format, char **save,
+                      ulong *length, int64 *capacity) {
+    DEBUG_PRINT("%s, %p, %p",
+                clipboard_atom_names[format], (void *)save, (void *)length)
+    xcb_get_property_reply_t *reply;
+    Incoming incoming;
+    struct timespec start;
+    int32 kind = CLIPBOARD_TEXT;
+    int32 n;
+
+    if (format == ATOM_IMAGE_PNG) {
+        kind = CLIPBOARD_IMAGE;
+    }
+
+    time_monotonic_precise(&start);
+    xcb_convert_selection(clipboard_connection, clipboard_window,
+                          clipboard_atoms[ATOM_CLIPBOARD],
+                          clipboard_atoms[format],
+                          clipboard_atoms[ATOM_XSEL_DATA], XCB_CURRENT_TIME);
+    xcb_flush(clipboard_connection);
+
+    if (clipboard_xcb_selection(clipboard_atoms[format], start) == XCB_NONE) {
+        return CLIPBOARD_ERROR;
+    }
+
+    reply = xcb_get_property_reply(
+        clipboard_connection,
+        xcb_get_property(clipboard_connection, 1, clipboard_window,
+                         clipboard_atoms[ATOM_XSEL_DATA],
+                         XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX / 4),
+        NULL);
+    if (reply == NULL) {
+        return CLIPBOARD_ERROR;
+    }
+
+    incoming_start(&incoming, kind);
+    if (reply->type == clipboard_atoms[ATOM_INCR]) {
+        /* Deleting the INCR property was the go ahead for the first
+         * chunk. */
+        free(reply);
+        clipboard_xcb_incremental_case(&incoming);
+        return incoming_finish(&incoming, save, length, capacity);
+    }
+
+    /* Nothing in this format, the next one offered is tried. */
+    if ((n = xcb_get_property_value_length(reply)) <= 0) {
+        free(reply);
+        return CLIPBOARD_ERROR;
+    }
+    incoming_chunk(&incoming, xcb_get_property_value(reply), n);
+    free(reply);
+    return incoming_finish(&incoming, save, length, capacity);
+}
+
+/* Receives an INCR transfer, one property change per chunk, waiting on
+ * the connection for each. */
+void
+clipboard_xcb_incremental_case(Incoming *incoming) {
+    DEBUG_PRINT("%p", (void *)incoming)
+
+    while (true) {
+        xcb_generic_event_t *event;
+        xcb_get_property_reply_t *reply;
+        struct timespec start;
+        int32 n;
+
+        time_monotonic_precise(&start);
+        while ((event = clipboard_xcb_wait(XCB_PROPERTY_NOTIFY, start,
+                                           CLIPBOARD_INCR_TIMEOUT_MS))
+               != NULL) {
+            xcb_property_notify_event_t *notify = (void *)event;
+
+            if ((notify->state == XCB_PROPERTY_NEW_VALUE)
+                && (notify->atom == clipboard_atoms[ATOM_XSEL_DATA])) {
+                break;
+            }
+            free(event);
+        }
+        if (event == NULL) {
+            incoming->failed = true;
+            return;
+        }
+        free(event);
+
+        reply = xcb_get_property_reply(
+            clipboard_connection,
+            xcb_get_property(clipboard_connection, 1, clipboard_window,
+                             clipboard_atoms[ATOM_XSEL_DATA],
+                             XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX / 4),
+            NULL);
+        if (reply == NULL) {
+            incoming->failed = true;
+            return;
+        }
+
+        if ((n = xcb_get_property_value_length(reply)) <= 0) {
+            free(reply);
+            return;
+        }
+        incoming_chunk(incoming, xcb_get_property_value(reply), n);
+        free(reply);
+    }
+}
+
+#if TESTING_clipboard_xcb
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+#include "clipsim.c"
+
+int
+main(void) {
+    (void)clipboard_daemon_watch;
+
+    if (!clipboard_xcb_open()) {
+        exit(EXIT_SUCCESS);
+    }
+
+    for (int32 i = 0; i < ATOM_LAST; i += 1) {
+        ASSERT_NOT_EQUAL(clipboard_atoms[i], XCB_NONE);
+        for (int32 j = 0; j < i; j += 1) {
+            ASSERT_NOT_EQUAL(clipboard_atoms[i], clipboard_atoms[j]);
+        }
+    }
+
+    {
+        xcb_atom_t offered[] = {
+            clipboard_atoms[ATOM_TARGETS], clipboard_atoms[ATOM_STRING],
+            clipboard_atoms[ATOM_IMAGE_PNG], clipboard_atoms[ATOM_UTF8_STRING],
+        };
+        uint32 formats;
+
+        xcb_change_property(clipboard_connection, XCB_PROP_MODE_REPLACE,
+                            clipboard_window, clipboard_atoms[ATOM_XSEL_DATA],
+                            XCB_ATOM_ATOM, 32, LENGTH(offered), offered);
+        ASSERT(clipboard_xcb_offered_targets(&formats));
+        ASSERT_EQUAL(formats, 0x7);
+
+        xcb_change_property(clipboard_connection, XCB_PROP_MODE_REPLACE,
+                            clipboard_window, clipboard_atoms[ATOM_XSEL_DATA],
+                            XCB_ATOM_ATOM, 32, 2, offered);
+        ASSERT(clipboard_xcb_offered_targets(&formats));
+        ASSERT_EQUAL(formats, 0x4);
+
+        xcb_change_property(clipboard_connection, XCB_PROP_MODE_REPLACE,
+                            clipboard_window, clipboard_atoms[ATOM_XSEL_DATA],
+                            XCB_ATOM_ATOM, 32, 1, offered);
+        ASSERT(clipboard_xcb_offered_targets(&formats));
+        ASSERT_EQUAL(formats, 0);
+
+        xcb_change_property(clipboard_connection, XCB_PROP_MODE_REPLACE,
+                            clipboard_window, clipboard_atoms[ATOM_XSEL_DATA],
+                            clipboard_atoms[ATOM_UTF8_STRING], 8, 4, "text");
+        ASSERT(!clipboard_xcb_offered_targets(&formats));
+    }
+
+    /* Owner changes of a selection of our own, so that the clipboard of
+     * whoever runs the tests is left alone. */
+    {
+        xcb_intern_atom_reply_t *reply;
+        xcb_generic_event_t *event;
+        xcb_atom_t selection;
+        struct timespec start;
+
+        reply = xcb_intern_atom_reply(
+            clipboard_connection,
+            xcb_intern_atom(clipboard_connection, 0, 12, "CLIPSIM_TEST"),
+            NULL);
+        ASSERT(reply != NULL);
+        selection = reply->atom;
+        free(reply);
+
+        xcb_xfixes_select_selection_input(
+            clipboard_connection, clipboard_root, selection,
+            XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER);
+        for (int32 i = 0; i < 3; i += 1) {
+            xcb_set_selection_owner(clipboard_connection, clipboard_window,
+                                    selection, XCB_CURRENT_TIME);
+        }
+        xcb_flush(clipboard_connection);
+
+        time_monotonic_precise(&start);
+        event = clipboard_xcb_wait(clipboard_owner_notify, start, 1000);
+        ASSERT(event != NULL);
+        free(event);
+        ASSERT_EQUAL(clipboard_xcb_debounce(100), 2);
+        ASSERT_EQUAL(clipboard_xcb_debounce(CLIPBOARD_DEBOUNCE_MIN_MS), 0);
+    }
+
+    xcb_disconnect(clipboard_connection);
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* CLIPBOARD_XCB_C */
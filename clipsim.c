@@ -44,6 +44,57 @@ reopen_magic(void) {
     return;
 }
 
+/* Reads which program the clipboard watcher signals on every change, and
+ * with which signal.  Returns NULL when it should not signal anything. */
+char *
+watch_signal_program(int32 *signal_number) {
+    char *CLIPSIM_SIGNAL_NUMBER;
+    char *CLIPSIM_SIGNAL_PROGRAM;
+
+    *signal_number = 0;
+
+    GETENV(CLIPSIM_SIGNAL_PROGRAM);
+    if (CLIPSIM_SIGNAL_PROGRAM == NULL) {
+        error("CLIPSIM_SIGNAL_PROGRAM is not defined.\n");
+    }
+
+    GETENV(CLIPSIM_SIGNAL_NUMBER);
+    if (CLIPSIM_SIGNAL_NUMBER == NULL) {
+        error("CLIPSIM_SIGNAL_NUMBER is not defined.\n");
+    }
+    if ((CLIPSIM_SIGNAL_PROGRAM == NULL) || (CLIPSIM_SIGNAL_NUMBER == NULL)) {
+        return NULL;
+    }
+
+    if ((*signal_number = atoi(CLIPSIM_SIGNAL_NUMBER)) <= 0) {
+        error("Invalid CLIPSIM_SIGNAL_NUMBER environment variable: %s.\n",
+              CLIPSIM_SIGNAL_NUMBER);
+        error("%s will not be signaled.\n", CLIPSIM_SIGNAL_PROGRAM);
+        return NULL;
+    }
+#if defined(SIGRTMIN)
+    *signal_number += SIGRTMIN;
+#endif
+    return CLIPSIM_SIGNAL_PROGRAM;
+}
+
+/* The debounce window for the next owner change, after coalesced changes
+ * were merged into the last fetch. */
+int32
+watch_debounce(int32 debounce, int32 coalesced) {
+    if (coalesced > 0) {
+        debounce *= 2;
+        if (debounce > CLIPBOARD_DEBOUNCE_MAX_MS) {
+            debounce = CLIPBOARD_DEBOUNCE_MAX_MS;
+        }
+    } else {
+        debounce /= 2;
+        if (debounce < CLIPBOARD_DEBOUNCE_MIN_MS) {
+            debounce = CLIPBOARD_DEBOUNCE_MIN_MS;
+        }
+    }
+    return debounce;
+}
 
 #if TESTING_clipsim
 #define CBASE_IMPLEMENT
@@ -52,6 +103,12 @@ reopen_magic(void) {
 int
 main(void) {
 	ASSERT(true);
+	ASSERT_EQUAL(watch_debounce(CLIPBOARD_DEBOUNCE_MIN_MS, 0),
+	             CLIPBOARD_DEBOUNCE_MIN_MS);
+	ASSERT_EQUAL(watch_debounce(CLIPBOARD_DEBOUNCE_MAX_MS, 3),
+	             CLIPBOARD_DEBOUNCE_MAX_MS);
+	ASSERT_EQUAL(watch_debounce(8, 1), 16);
+	ASSERT_EQUAL(watch_debounce(16, 0), 8);
 	exit(EXIT_SUCCESS);
 }
 
@@ -11,6 +11,11 @@
 #define DEBUGGING 0
 #endif
 
+/* Build the clipboard watcher on XCB instead of Xlib. */
+#if !defined(CLIPSIM_XCB)
+#define CLIPSIM_XCB 0
+#endif
+
 #if DEBUGGING
 #define DEBUG_PRINT(...) \
 do { \
@@ -40,20 +45,252 @@ do { \
 
 #define PAUSE10MS (1000*1000*10)
 #define HISTORY_BUFFER_SIZE 128
-#define HISTORY_INVALID_ID (HISTORY_BUFFER_SIZE+1)
-#define HISTORY_KEEP_SIZE (HISTORY_BUFFER_SIZE/2)
+#define HISTORY_MAX_SIZE (1 << 20)
+#define MAGIC_REOPEN_INTERVAL (HISTORY_BUFFER_SIZE/2)
 #define ENTRY_MAX_LENGTH SIZEMB(1)
 #define MAX_MAGIC_BUFFER_LEN SIZEKB(16)
 #define PRINT_DIGITS 3
 #define TRIMMED_SIZE 255
 
+#define PREVIEW_POOL_SIZE SIZEMB(2)
+
+/* How long the owner of the selection has to answer a conversion. */
+#define CLIPBOARD_CONVERT_TIMEOUT_MS 500
+
+/* After an owner change, further changes are waited for until none comes
+ * for the debounce window, which doubles after a burst and halves after a
+ * lone change, or until a burst has lasted CLIPBOARD_BURST_MAX_MS. */
+#define CLIPBOARD_DEBOUNCE_MIN_MS 4
+#define CLIPBOARD_DEBOUNCE_MAX_MS 64
+#define CLIPBOARD_BURST_MAX_MS 250
+
+/* INCR transfers give up when the owner takes longer than this to send
+ * the next chunk. */
+#define CLIPBOARD_INCR_TIMEOUT_MS 1000
+#define INCOMING_CAPACITY SIZEKB(64)
+
+/* preview is the collapsed-whitespace line shown by --print.  It is built
+ * on first use and either points into content, when trimming changes
+ * nothing, or to a copy in the preview pool which may be dropped at any
+ * time to stay within PREVIEW_POOL_SIZE. */
 typedef struct Entry {
     char *content;
+    char *preview;
+    uint64 hash;
+    int64 timestamp;
     int32 content_length;
-    int32 trimmed;
+    int32 preview_length;
+    int32 kind;
+    int32 preview_used;
+} Entry;
+
+/* Slot table ordered by a Fenwick tree over a timeline of positions.
+ * Every append or move-to-front takes the next timeline position, so the
+ * order of the entries is the order of their positions.  Looking up the
+ * n-th entry, moving an entry to the front and removing any entry are
+ * O(log n).  The timeline is compacted when it runs out of positions. */
+typedef struct Store {
+    Entry *entries;
+    int32 *positions;
+    int32 *timeline;
+    int32 *tree;
+    int32 *free_slots;
+    int32 capacity;
+    int32 length;
+    int32 timeline_size;
+    int32 timeline_next;
+    int32 nfree;
+    int32 padding;
+} Store;
+
+#define SLAB_MIN_SHIFT 5
+#define SLAB_MAX_SHIFT 16
+#define SLAB_NCLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAX_OBJECT (1 << SLAB_MAX_SHIFT)
+#define SLAB_ARENA_SIZE SIZEKB(256)
+
+/* Entry payloads up to SLAB_MAX_OBJECT bytes are rounded up to a power of
+ * two and packed into fixed size arenas, one list of arenas per size.
+ * An arena is unmapped when its last object is freed, unless it is the
+ * only arena of its size, which is kept mapped for the next one.  Bigger
+ * payloads are allocated on their own. */
+typedef struct Slab {
+    Arena *arena;
+    void *free_list;
+    int32 live;
+    int32 objects;
+} Slab;
+
+typedef struct SlabClass {
+    Slab *slabs;
+    int64 live;
+    int64 requested;
+    int32 nslabs;
+    int32 capacity;
+    int32 current;
+    int32 object_size;
+} SlabClass;
+
+typedef struct Slabs {
+    SlabClass classes[SLAB_NCLASSES];
+    int64 large_live;
+    int64 large_bytes;
+} Slabs;
+
+#define JOURNAL_MAGIC 0x324a5343
+#define JOURNAL_COMPACT_SIZE SIZEMB(4)
+
+enum {
+    JOURNAL_APPEND = 1,
+    JOURNAL_REORDER,
+    JOURNAL_REMOVE,
+};
+
+/* Every change to the history is appended to the journal as one of these
+ * records, followed by the content for JOURNAL_APPEND.  Reorder and
+ * remove refer to the entry by its content hash, so replaying a journal
+ * on top of a snapshot that already contains some of its records is
+ * harmless. */
+typedef struct JournalRecord {
+    int32 magic;
+    int32 op;
+    int32 kind;
+    int32 length;
+    uint64 hash;
+    int64 timestamp;
+} JournalRecord;
+
+#define HISTORY_MAGIC 0x48534350
+#define HISTORY_VERSION 2
+
+/* History file format since version 2: a HistoryHeader and then count
+ * records.  Each record is a HistoryRecord followed by length bytes of
+ * content and a NUL byte, so that content can be used in place.  Records
+ * are not aligned.  trimmed_length is the length of the --print preview,
+ * equal to length when the preview is the content itself.  Files without
+ * the header are read as the legacy format, content terminated by
+ * TEXT_TAG and a type tag, and rewritten on load. */
+typedef struct HistoryHeader {
+    int32 magic;
+    int32 version;
+    int32 count;
+    int32 padding;
+} HistoryHeader;
+
+typedef struct HistoryRecord {
+    uint64 hash;
+    int64 timestamp;
+    int32 length;
+    int32 kind;
     int32 trimmed_length;
     int32 padding;
-} Entry;
+} HistoryRecord;
+
+/* A record located by the serial pass over the history file, checked
+ * and, for legacy files, hashed and trimmed on the thread pool before
+ * being inserted in order. */
+typedef struct HistoryLoad {
+    char *content;
+    uint64 hash;
+    int64 timestamp;
+    int32 length;
+    int32 kind;
+    int32 trimmed_length;
+    int32 valid;
+} HistoryLoad;
+
+typedef struct Journal {
+    char *name;
+    int64 size;
+    int32 fd;
+    int32 generation;
+} Journal;
+
+/* A copy of the entry table in timeline order, written to disk without
+ * holding the history lock.  Entries removed while a snapshot is alive
+ * are kept until it is released. */
+typedef struct Snapshot {
+    Entry *entries;
+    int64 journal_size;
+    int32 length;
+    int32 journal_generation;
+} Snapshot;
+
+#define HISTORY_VIEW_ARENA_SIZE SIZEKB(256)
+
+/* Read-only copy of the entry table that ipc readers format from without
+ * the history lock.  The current one is kept published until the history
+ * changes, so listings in between share it, along with the formatted
+ * listing cached in it by the ipc thread.  Previews the entries did not
+ * have yet when it was taken are built in previews, and then copied to
+ * the preview pool of the live entries. */
+typedef struct HistoryView {
+    Snapshot snapshot;
+    StrBuilder listing;
+    int32 *listing_offsets;
+    Arena *previews;
+    int64 version;
+    int32 references;
+    int32 padding;
+} HistoryView;
+
+#define FUZZY_DEFAULT_LIMIT 50
+#define FUZZY_MIN_PARALLEL 4096
+
+/* Fuzzy ranking state of one ipc connection.  candidates are the snapshot
+ * indices of the entries that matched query in the view of that version,
+ * newest first, so a longer query typed after it only rescores those. */
+typedef struct Fuzzy {
+    char *query;
+    int32 *candidates;
+    int32 *scores;
+    int64 version;
+    int32 query_length;
+    int32 ncandidates;
+    int32 capacity;
+    int32 padding;
+} Fuzzy;
+
+/* What each thread of parallel_for gets to score its share of the
+ * candidates. */
+typedef struct FuzzyJob {
+    HistoryView *view;
+    Fuzzy *fuzzy;
+    char *query;
+    int32 query_length;
+    bool ignore_case;
+} FuzzyJob;
+
+/* Selection content being received, in one piece or in INCR chunks.  A
+ * PNG is written to its image file as it arrives, anything else goes to
+ * buffer, which starts at INCOMING_CAPACITY and doubles up to
+ * ENTRY_MAX_LENGTH. */
+typedef struct Incoming {
+    char *buffer;
+    int64 length;
+    int64 capacity;
+    int32 kind;
+    int32 image;
+    int32 image_length;
+    bool started;
+    bool failed;
+    char image_file[256];
+} Incoming;
+
+/* Called from the saver thread, without the history lock, once a save
+ * requested with history_save_async is done. */
+typedef void HistorySaveDone(void *, bool);
+
+/* Called with the history lock held for every change made to the history
+ * after it is read: op is JOURNAL_APPEND with the id of the new entry, or
+ * JOURNAL_REORDER and JOURNAL_REMOVE with the id the entry had before
+ * being moved to the end or removed. */
+typedef void HistoryListener(int32, int32, Entry *);
+
+typedef struct SaveWaiter {
+    HistorySaveDone *done;
+    void *data;
+} SaveWaiter;
 
 typedef struct File {
     FILE *file;
@@ -68,6 +305,7 @@ enum {
     CLIPBOARD_LARGE,
     CLIPBOARD_OTHER,
     CLIPBOARD_ERROR,
+    CLIPBOARD_SAVED,
 };
 
 enum {
@@ -76,18 +314,29 @@ enum {
     COMMAND_COPY,
     COMMAND_REMOVE,
     COMMAND_SAVE,
+    COMMAND_STATS,
+    COMMAND_SEARCH,
+    COMMAND_FUZZY,
+    COMMAND_LIST,
+    COMMAND_SUBSCRIBE,
     COMMAND_DAEMON,
     COMMAND_HELP,
 };
 
-static Entry clipsim_entries[HISTORY_BUFFER_SIZE] = {0};
-static bool is_image[HISTORY_BUFFER_SIZE] = {0};
+static Store clipsim_entries = {0};
 static char TEXT_TAG = (char)0x01;
 static char IMAGE_TAG = (char)0x02;
 static pthread_mutex_t lock;
 static magic_t magic = 0;
 
+/* Selection owner changes seen by the clipboard watcher, and how many of
+ * them were merged into the fetch of another.  Protected by lock. */
+static int64 clipboard_owner_changes = 0;
+static int64 clipboard_coalesced = 0;
+
 void util_close(File *file);
 void reopen_magic(void);
+char *watch_signal_program(int32 *signal_number);
+int32 watch_debounce(int32 debounce, int32 coalesced);
 
 #endif /* CLIPSIM_H */
@@ -17,6 +17,11 @@ _clipsim_completion() {
     "-c --copy"
     "-r --remove"
     "-s --save"
+    "-S --stats"
+    "-f --search"
+    "-z --fuzzy"
+    "-l --list"
+    "-w --watch"
     "-d --daemon"
     "-h --help"
   )
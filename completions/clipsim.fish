@@ -10,6 +10,16 @@ complete -c clipsim -l remove -d 'remove entry number <n>' -a '(_clipsim_entries
 complete -c clipsim -s r -d 'remove entry number <n>' -a '(_clipsim_entries)'
 complete -c clipsim -l save -d 'save history to $XDG_CACHE_HOME/clipsim/history'
 complete -c clipsim -s s -d 'save history to $XDG_CACHE_HOME/clipsim/history'
+complete -c clipsim -l stats -d 'print daemon memory usage'
+complete -c clipsim -s S -d 'print daemon memory usage'
+complete -c clipsim -l search -d 'print entries containing <query>'
+complete -c clipsim -s f -d 'print entries containing <query>'
+complete -c clipsim -l fuzzy -d 'print the entries that best fuzzy match <query>'
+complete -c clipsim -s z -d 'print the entries that best fuzzy match <query>'
+complete -c clipsim -l list -d 'print history in binary format for programs'
+complete -c clipsim -s l -d 'print history in binary format for programs'
+complete -c clipsim -l watch -d 'print changes to the history as they happen'
+complete -c clipsim -s w -d 'print changes to the history as they happen'
 complete -c clipsim -l daemon -d 'spawn daemon (clipboard watcher and command listener)'
 complete -c clipsim -s d -d 'spawn daemon (clipboard watcher and command listener)'
 complete -c clipsim -l help -d 'print this help message'
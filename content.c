@@ -14,7 +14,7 @@
 #endif
 
 static void content_remove_newline(char *, int *);
-static void content_trim_spaces(int32 *, int32 *, char *, int32);
+static int32 content_trim_spaces(char *, char *, int32);
 static int32 content_check_content(uchar *, int);
 
 void
@@ -36,37 +36,18 @@ content_remove_newline(char *text, int32 *length) {
     return;
 }
 
-void
-content_trim_spaces(int32 *trimmed, int32 *trimmed_length,
-                    char *content, int32 length) {
-    DEBUG_PRINT("%p, %p, %.50s, %d",
-                (void *)trimmed, (void *)trimmed_length, content, length)
-    char *out;
-    char temp = '\0';
+int32
+content_trim_spaces(char *out, char *content, int32 length) {
+    DEBUG_PRINT("%p, %.50s, %d", (void *)out, content, length)
+    char *begin = out;
     char *in = content;
+    char *end = content + MIN(length, TRIMMED_SIZE);
 
-    if (length <= 0) {
-        *trimmed = 0;
-        *trimmed_length = 0;
-        if (content) {
-            content[0] = '\0';
-        }
-        return;
-    }
-
-    *trimmed = length + 1;
-    out = &content[*trimmed];
-
-    if (length >= TRIMMED_SIZE) {
-        temp = content[TRIMMED_SIZE];
-        content[TRIMMED_SIZE] = '\0';
-    }
-
-    while (IS_SPACE(*in)) {
+    while ((in < end) && IS_SPACE(*in)) {
         in += 1;
     }
-    while (*in != '\0') {
-        while (IS_SPACE(*in) && IS_SPACE(*(in + 1))) {
+    while ((in < end) && (*in != '\0')) {
+        while (((in + 1) < end) && IS_SPACE(*in) && IS_SPACE(*(in + 1))) {
             in += 1;
         }
 
@@ -75,16 +56,7 @@ content_trim_spaces(int32 *trimmed, int32 *trimmed_length,
         in += 1;
     }
     *out = '\0';
-    *trimmed_length = (int32)(out - &content[*trimmed]);
-
-    if (temp) {
-        content[TRIMMED_SIZE] = temp;
-    }
-
-    if (*trimmed_length == length) {
-        *trimmed = 0;
-    }
-    return;
+    return (int32)(out - begin);
 }
 
 int32
@@ -130,11 +102,6 @@ content_check_content(uchar *data, int32 length) {
         return CLIPBOARD_ERROR;
     }
 
-    if (memchr64(data, TEXT_TAG, length) || memchr64(data, IMAGE_TAG, length)) {
-        error("Entry contains control chars. This won't be added to history");
-        return CLIPBOARD_OTHER;
-    }
-
     return CLIPBOARD_TEXT;
 }
 
@@ -161,13 +128,25 @@ main(void) {
 
     {
         char content[512] = "  hello   world ";
-        int32 trimmed;
+        char trimmed[TRIMMED_SIZE + 1];
         int32 trimmed_length;
         int32 orig_length = strlen32(content);
-        content_trim_spaces(&trimmed, &trimmed_length, content, orig_length);
-        PRINTLN(content + trimmed);
+        trimmed_length = content_trim_spaces(trimmed, content, orig_length);
+        PRINTLN(trimmed);
         ASSERT_EQUAL(trimmed_length, 12);
-        ASSERT_EQUAL(trimmed, orig_length + 1);
+        ASSERT(strequal(trimmed, "hello world "));
+        ASSERT(strequal(content, "  hello   world "));
+    }
+
+    {
+        char content[TRIMMED_SIZE*2];
+        char trimmed[TRIMMED_SIZE + 1];
+        int32 trimmed_length;
+
+        memset64(content, 'a', SIZEOF(content));
+        trimmed_length = content_trim_spaces(trimmed, content, SIZEOF(content));
+        ASSERT_EQUAL(trimmed_length, TRIMMED_SIZE);
+        ASSERT_EQUAL(trimmed[TRIMMED_SIZE], '\0');
     }
 
     {
@@ -185,6 +164,10 @@ main(void) {
         check2 = content_check_content(spaces_data, 8);
         ASSERT_EQUAL(check2, CLIPBOARD_ERROR);
 
+        /* History records are length prefixed, any byte can be stored. */
+        ASSERT_EQUAL(content_check_content((uchar *)"a\001b\002c", 5),
+                     CLIPBOARD_TEXT);
+
         magic_close(magic);
     }
 
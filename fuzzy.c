@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(FUZZY_C)
+#define FUZZY_C
+
+#include "cbase.h"
+#include "clipsim.h"
+#include "content.c"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_fuzzy 1
+#elif !defined(TESTING_fuzzy)
+#define TESTING_fuzzy 0
+#endif
+
+/* Fuzzy matching of the --print previews, scored the way fzf's first
+ * algorithm does it: the shortest window that contains the query as a
+ * subsequence is found with one pass forward and one backward, and
+ * matches are rewarded for starting words and for following each other,
+ * gaps are penalized.  The query ignores case unless it has uppercase
+ * letters. */
+#define FUZZY_NO_MATCH INT32_MIN
+#define FUZZY_SCORE_MATCH 16
+#define FUZZY_BONUS_BOUNDARY 8
+#define FUZZY_BONUS_CONSECUTIVE 4
+#define FUZZY_PENALTY_GAP_START 3
+#define FUZZY_PENALTY_GAP_EXTENSION 1
+
+static int32 fuzzy_rank(Fuzzy *, HistoryView *, char *, int32,
+                        int32 *, int32);
+static void fuzzy_free(Fuzzy *);
+static int32 fuzzy_score(char *, int32, char *, int32, bool);
+static void fuzzy_score_slice(int64, int64, int32, void *);
+static bool fuzzy_refines(Fuzzy *, HistoryView *, char *, int32);
+static bool fuzzy_better(Fuzzy *, int32, int32);
+static void fuzzy_sift_down(Fuzzy *, int32 *, int32, int32);
+
+static inline char
+fuzzy_lower(char c) {
+    if ((c >= 'A') && (c <= 'Z')) {
+        return (char)(c + ('a' - 'A'));
+    }
+    return c;
+}
+
+static inline bool
+fuzzy_equal(char text, char query, bool ignore_case) {
+    if (ignore_case) {
+        return fuzzy_lower(text) == query;
+    }
+    return text == query;
+}
+
+static inline bool
+fuzzy_boundary(char *text, int32 i) {
+    char c;
+    char previous;
+
+    if (i == 0) {
+        return true;
+    }
+    c = text[i];
+    previous = text[i - 1];
+    if ((previous >= 'a') && (previous <= 'z') && (c >= 'A') && (c <= 'Z')) {
+        return true;
+    }
+    return !(((previous >= 'a') && (previous <= 'z'))
+             || ((previous >= 'A') && (previous <= 'Z'))
+             || ((previous >= '0') && (previous <= '9')));
+}
+
+/* Returns FUZZY_NO_MATCH when query is not a subsequence of text.  With
+ * ignore_case, query must not have uppercase letters. */
+int32
+fuzzy_score(char *text, int32 length,
+            char *query, int32 query_length, bool ignore_case) {
+    int32 start = 0;
+    int32 end = -1;
+    int32 q = 0;
+    int32 score = 0;
+    bool consecutive = false;
+    bool gap = false;
+
+    if (query_length <= 0) {
+        return 0;
+    }
+
+    for (int32 i = 0; i < length; i += 1) {
+        if (fuzzy_equal(text[i], query[q], ignore_case)) {
+            q += 1;
+            if (q == query_length) {
+                end = i;
+                break;
+            }
+        }
+    }
+    if (end < 0) {
+        return FUZZY_NO_MATCH;
+    }
+
+    /* The last character matched is fixed, walking back from it finds
+     * the latest start, and so the tightest window. */
+    q = query_length - 1;
+    for (int32 i = end; i >= 0; i -= 1) {
+        if (fuzzy_equal(text[i], query[q], ignore_case)) {
+            if (q == 0) {
+                start = i;
+                break;
+            }
+            q -= 1;
+        }
+    }
+
+    q = 0;
+    for (int32 i = start; i <= end; i += 1) {
+        int32 bonus = 0;
+
+        if ((q >= query_length)
+            || !fuzzy_equal(text[i], query[q], ignore_case)) {
+            if (gap) {
+                score -= FUZZY_PENALTY_GAP_EXTENSION;
+            } else {
+                score -= FUZZY_PENALTY_GAP_START;
+            }
+            gap = true;
+            consecutive = false;
+            continue;
+        }
+
+        if (fuzzy_boundary(text, i)) {
+            bonus = FUZZY_BONUS_BOUNDARY;
+        } else if (consecutive) {
+            bonus = FUZZY_BONUS_CONSECUTIVE;
+        }
+        if (q == 0) {
+            bonus *= 2;
+        }
+        score += FUZZY_SCORE_MATCH + bonus;
+        consecutive = true;
+        gap = false;
+        q += 1;
+    }
+    return score;
+}
+
+void
+fuzzy_score_slice(int64 start, int64 end, int32 worker_id, void *data) {
+    FuzzyJob *job = data;
+    Fuzzy *fuzzy = job->fuzzy;
+
+    (void)worker_id;
+    for (int64 i = start; i < end; i += 1) {
+        Entry *e = &job->view->snapshot.entries[fuzzy->candidates[i]];
+
+        if (e->preview != NULL) {
+            fuzzy->scores[i] = fuzzy_score(e->preview, e->preview_length,
+                                           job->query, job->query_length,
+                                           job->ignore_case);
+        } else {
+            char buffer[TRIMMED_SIZE + 1];
+            int32 n = content_trim_spaces(buffer, e->content,
+                                          e->content_length);
+
+            fuzzy->scores[i] = fuzzy_score(buffer, n,
+                                           job->query, job->query_length,
+                                           job->ignore_case);
+        }
+    }
+    return;
+}
+
+/* Whatever matches query also matches any query it was typed from, when
+ * the old one is a subsequence of it and the history did not change. */
+bool
+fuzzy_refines(Fuzzy *fuzzy, HistoryView *view,
+              char *query, int32 query_length) {
+    int32 q = 0;
+
+    if ((fuzzy->query == NULL) || (fuzzy->version != view->version)) {
+        return false;
+    }
+    for (int32 i = 0; (i < query_length) && (q < fuzzy->query_length);
+         i += 1) {
+        if (query[i] == fuzzy->query[q]) {
+            q += 1;
+        }
+    }
+    return q == fuzzy->query_length;
+}
+
+/* Higher score first, newer entry first among equal scores.  Candidates
+ * are newest first, so the newer one is the lower position. */
+bool
+fuzzy_better(Fuzzy *fuzzy, int32 a, int32 b) {
+    if (fuzzy->scores[a] != fuzzy->scores[b]) {
+        return fuzzy->scores[a] > fuzzy->scores[b];
+    }
+    return a < b;
+}
+
+/* heap holds candidate positions with the worst one at the root. */
+void
+fuzzy_sift_down(Fuzzy *fuzzy, int32 *heap, int32 length, int32 i) {
+    while (true) {
+        int32 worst = i;
+        int32 left = 2*i + 1;
+        int32 right = 2*i + 2;
+        int32 swap;
+
+        if ((left < length) && fuzzy_better(fuzzy, heap[worst], heap[left])) {
+            worst = left;
+        }
+        if ((right < length)
+            && fuzzy_better(fuzzy, heap[worst], heap[right])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        swap = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = swap;
+        i = worst;
+    }
+}
+
+/* Ranks the entries of view against query and writes the snapshot
+ * indices of the best limit of them to top, best first.  Returns how
+ * many were written. */
+int32
+fuzzy_rank(Fuzzy *fuzzy, HistoryView *view, char *query, int32 query_length,
+           int32 *top, int32 limit) {
+    DEBUG_PRINT("%p, %p, %.*s, %d", (void *)fuzzy, (void *)view,
+                query_length, query, limit)
+    FuzzyJob job;
+    int32 kept = 0;
+    int32 ntop = 0;
+
+    if (!fuzzy_refines(fuzzy, view, query, query_length)) {
+        int32 length = view->snapshot.length;
+
+        if (length > fuzzy->capacity) {
+            if (fuzzy->capacity > 0) {
+                free2(fuzzy->candidates,
+                      fuzzy->capacity*SIZEOF(*fuzzy->candidates));
+                free2(fuzzy->scores, fuzzy->capacity*SIZEOF(*fuzzy->scores));
+            }
+            fuzzy->candidates = malloc2(length*SIZEOF(*fuzzy->candidates));
+            fuzzy->scores = malloc2(length*SIZEOF(*fuzzy->scores));
+            fuzzy->capacity = length;
+        }
+        for (int32 p = 0; p < length; p += 1) {
+            fuzzy->candidates[p] = length - 1 - p;
+        }
+        fuzzy->ncandidates = length;
+    }
+
+    job.view = view;
+    job.fuzzy = fuzzy;
+    job.query = query;
+    job.query_length = query_length;
+    job.ignore_case = true;
+    for (int32 i = 0; i < query_length; i += 1) {
+        if ((query[i] >= 'A') && (query[i] <= 'Z')) {
+            job.ignore_case = false;
+            break;
+        }
+    }
+
+    parallel_for_min_items(fuzzy->ncandidates, FUZZY_MIN_PARALLEL,
+                           fuzzy_score_slice, &job);
+
+    /* Only the matches are kept for the next, longer, query.  The best
+     * limit of them go through a heap as they are kept. */
+    for (int32 p = 0; p < fuzzy->ncandidates; p += 1) {
+        if (fuzzy->scores[p] == FUZZY_NO_MATCH) {
+            continue;
+        }
+        fuzzy->candidates[kept] = fuzzy->candidates[p];
+        fuzzy->scores[kept] = fuzzy->scores[p];
+
+        if (ntop < limit) {
+            int32 i = ntop;
+
+            top[ntop] = kept;
+            ntop += 1;
+            while ((i > 0) && fuzzy_better(fuzzy, top[(i - 1)/2], top[i])) {
+                int32 swap = top[i];
+                top[i] = top[(i - 1)/2];
+                top[(i - 1)/2] = swap;
+                i = (i - 1)/2;
+            }
+        } else if ((limit > 0) && fuzzy_better(fuzzy, kept, top[0])) {
+            top[0] = kept;
+            fuzzy_sift_down(fuzzy, top, ntop, 0);
+        }
+        kept += 1;
+    }
+    fuzzy->ncandidates = kept;
+
+    /* Taking the worst out repeatedly leaves the heap sorted. */
+    for (int32 n = ntop - 1; n > 0; n -= 1) {
+        int32 worst = top[0];
+
+        top[0] = top[n];
+        top[n] = worst;
+        fuzzy_sift_down(fuzzy, top, n, 0);
+    }
+    for (int32 i = 0; i < ntop; i += 1) {
+        top[i] = fuzzy->candidates[top[i]];
+    }
+
+    if (fuzzy->query != NULL) {
+        free2(fuzzy->query, fuzzy->query_length + 1);
+    }
+    /* query points into the request, which is not NUL terminated. */
+    fuzzy->query = malloc2(query_length + 1);
+    memcpy64(fuzzy->query, query, query_length);
+    fuzzy->query[query_length] = '\0';
+    fuzzy->query_length = query_length;
+    fuzzy->version = view->version;
+    return ntop;
+}
+
+void
+fuzzy_free(Fuzzy *fuzzy) {
+    if (fuzzy->query != NULL) {
+        free2(fuzzy->query, fuzzy->query_length + 1);
+    }
+    if (fuzzy->capacity > 0) {
+        free2(fuzzy->candidates, fuzzy->capacity*SIZEOF(*fuzzy->candidates));
+        free2(fuzzy->scores, fuzzy->capacity*SIZEOF(*fuzzy->scores));
+    }
+    memset64(fuzzy, 0, sizeof(*fuzzy));
+    return;
+}
+
+#if 0 == TESTING_fuzzy
+static inline void
+fuzzy_functions_sink(void) {
+    (void)fuzzy_functions_sink;
+    (void)fuzzy_rank;
+    (void)fuzzy_free;
+}
+#endif
+
+#if TESTING_fuzzy
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+int
+main(void) {
+    bool ignore = true;
+
+    (void)content_check_content;
+    (void)content_remove_newline;
+
+    ASSERT_EQUAL(fuzzy_score("abc", 3, "", 0, ignore), 0);
+    ASSERT_EQUAL(fuzzy_score("abc", 3, "abcd", 4, ignore), FUZZY_NO_MATCH);
+    ASSERT_EQUAL(fuzzy_score("abc", 3, "ca", 2, ignore), FUZZY_NO_MATCH);
+    ASSERT_EQUAL(fuzzy_score("ABC", 3, "abc", 3, ignore),
+                 fuzzy_score("abc", 3, "abc", 3, ignore));
+    ASSERT_EQUAL(fuzzy_score("abc", 3, "aBc", 3, false), FUZZY_NO_MATCH);
+
+    /* Consecutive beats scattered, word starts beat the middle of words,
+     * and the tightest window is the one scored. */
+    ASSERT_MORE(fuzzy_score("xx foo", 6, "foo", 3, ignore),
+                fuzzy_score("xf o o", 6, "foo", 3, ignore));
+    ASSERT_MORE(fuzzy_score("x foo", 5, "foo", 3, ignore),
+                fuzzy_score("xxfoo", 5, "foo", 3, ignore));
+    ASSERT_EQUAL(fuzzy_score("fxx foo", 7, "foo", 3, ignore),
+                 fuzzy_score("foo", 3, "foo", 3, ignore));
+
+    {
+        /* Refining a query reuses the candidates, and gives the same
+         * answer as ranking from scratch.  The history is big enough to
+         * be scored on the thread pool. */
+        int32 length = FUZZY_MIN_PARALLEL*2;
+        HistoryView view = {0};
+        Fuzzy incremental = {0};
+        char *queries[] = {"a", "ab", "abc", "abcd", "bd", "Ab", "AbC"};
+        char *texts = malloc2(length*16);
+        int32 *top = malloc2(length*SIZEOF(*top));
+        int32 *expected = malloc2(length*SIZEOF(*expected));
+
+        view.snapshot.length = length;
+        view.snapshot.entries = malloc2(length*SIZEOF(Entry));
+        view.version = 1;
+        rand_int_seed(2);
+        for (int32 i = 0; i < length; i += 1) {
+            Entry *e = &view.snapshot.entries[i];
+            char *text = texts + i*16;
+
+            for (int32 j = 0; j < 15; j += 1) {
+                int32 r = rand_int() % 10;
+                text[j] = (r < 5) ? (char)('a' + r) : (r < 7) ? 'A' : '-';
+            }
+            text[15] = '\0';
+            memset64(e, 0, sizeof(*e));
+            e->content = text;
+            e->content_length = 15;
+            /* Some previews were evicted, and are trimmed again. */
+            if (i % 512) {
+                e->preview = text;
+                e->preview_length = 15;
+            }
+        }
+
+        for (int32 i = 0; i < LENGTH(queries); i += 1) {
+            Fuzzy fresh = {0};
+            int32 query_length = strlen32(queries[i]);
+            int32 n = fuzzy_rank(&incremental, &view, queries[i],
+                                 query_length, top, 20);
+            int32 m = fuzzy_rank(&fresh, &view, queries[i],
+                                 query_length, expected, 20);
+
+            ASSERT_EQUAL(n, m);
+            ASSERT_EQUAL(incremental.ncandidates, fresh.ncandidates);
+            ASSERT(!memcmp64(top, expected, n*SIZEOF(*top)));
+            for (int32 j = 1; j < n; j += 1) {
+                Entry *a = &view.snapshot.entries[top[j - 1]];
+                Entry *b = &view.snapshot.entries[top[j]];
+                int32 score_a = fuzzy_score(a->content, a->content_length,
+                                            incremental.query, query_length,
+                                            false);
+                int32 score_b = fuzzy_score(b->content, b->content_length,
+                                            incremental.query, query_length,
+                                            false);
+
+                if (score_a == score_b) {
+                    ASSERT_MORE(top[j - 1], top[j]);
+                }
+            }
+            fuzzy_free(&fresh);
+        }
+
+        /* A candidate dropped from the set stays out of a refinement,
+         * proof that the set is what gets rescored. */
+        ASSERT_EQUAL(fuzzy_rank(&incremental, &view, "a", 1, top, 1), 1);
+        {
+            int32 dropped = incremental.candidates[0];
+            int32 n;
+
+            incremental.candidates[0] = incremental.candidates[1];
+            n = fuzzy_rank(&incremental, &view, "ab", 2, top, length);
+            ASSERT_EQUAL(n, incremental.ncandidates);
+            for (int32 i = 0; i < incremental.ncandidates; i += 1) {
+                ASSERT(incremental.candidates[i] != dropped);
+            }
+        }
+
+        /* A change in the history starts over. */
+        view.version = 2;
+        {
+            Fuzzy fresh = {0};
+
+            fuzzy_rank(&incremental, &view, "ab", 2, top, length);
+            fuzzy_rank(&fresh, &view, "ab", 2, expected, length);
+            ASSERT_EQUAL(incremental.ncandidates, fresh.ncandidates);
+            fuzzy_free(&fresh);
+        }
+
+        fuzzy_free(&incremental);
+        ASSERT_NULL(incremental.query);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* FUZZY_C */
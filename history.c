@@ -8,6 +8,9 @@
 #include "clipsim.h"
 #include "content.c"
 #include "clipsim.c"
+#include "store.c"
+#include "slab.c"
+#include "journal.c"
 
 #include <X11/X.h>
 #include <X11/Xatom.h>
@@ -16,6 +19,14 @@
 
 #define MAX_OPEN_FD 64
 
+#define HASH_KEY_TYPE uint64
+#define HASH_KEY_FIXED_LEN 1
+#define HASH_VALUE_TYPE int32
+#define HASH_VALUE_FORMATTER "%d"
+#define HASH_TYPE content
+#define HASH_PADDING_TYPE uint32
+#include "hash.c"
+
 #if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
 #define TESTING_history 1
 #elif !defined(TESTING_history)
@@ -23,25 +34,88 @@
 #endif
 
 static volatile bool recovered = false;
-static int32 history_length;
+static int32 history_evictions = 0;
 static File history = {.file = NULL, .fd = -1, .name = NULL};
+static Journal journal = {.name = NULL, .fd = -1};
+static Entry *deferred = NULL;
+static int32 deferred_length = 0;
+static int32 deferred_capacity = 0;
+static int32 snapshots_alive = 0;
+static HistoryView *history_view = NULL;
+static int64 history_version = 0;
+static HistoryListener *history_listener = NULL;
+static pthread_mutex_t saver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saver_wake = PTHREAD_COND_INITIALIZER;
+static bool saver_started = false;
+static bool saver_pending = false;
+static SaveWaiter saver_waiters[64];
+static int32 saver_nwaiters = 0;
 static char *XDG_CACHE_HOME = NULL;
 static char xdg_cache_home_buffer[4096];
 static char *HOME = NULL;
-static uint8 length_counts[ENTRY_MAX_LENGTH] = {0};
+static struct Hash_content *history_hashes = NULL;
+static Slabs history_slabs = {0};
+static Slabs preview_slabs = {0};
+static int64 preview_bytes = 0;
+static int64 preview_limit = PREVIEW_POOL_SIZE;
+static int32 preview_hand = 0;
+
+/* Entries loaded from a version 2 history file keep pointing into its
+ * read-only mapping.  It is unmapped when the last of them is destroyed. */
+static char *history_mapping = NULL;
+static int64 history_mapping_size = 0;
+static int32 history_mapping_references = 0;
 static char tmp_directory_buffer[PATH_MAX];
 static char *tmp_directory = tmp_directory_buffer;
 
-static int32 history_repeated_index(char *, int32);
-static void history_free_entry(Entry *, int32);
+static bool history_read_snapshot(void);
+static void history_read_records(char *, int64);
+static void history_read_legacy(char *, int64);
+static void history_read_check(int64, int64, int32, void *);
+static void history_read_hash(int64, int64, int32, void *);
+static void history_read_insert(HistoryLoad *, int32);
+static void history_read_journal(void);
+static int32 history_insert(char *, int32, int32, uint64, int64);
+static void history_log(int32, Entry *);
+static void history_snapshot_take(Snapshot *);
+static int history_snapshot_write(Snapshot *);
+static void history_snapshot_release(Snapshot *, bool);
+static void *history_saver(void *);
+static void history_changed(void);
+static void history_notify(int32, int32);
+static void history_view_drop(HistoryView *);
+static HistoryView *history_view_acquire(void);
+static int32 history_view_previews(HistoryView *, int32 *);
+static void history_view_keep(HistoryView *, int32 *, int32);
+static void history_view_release(HistoryView *);
+static void history_destroy_entry(Entry *);
+static int32 history_hash_slot(uint64);
+static int32 history_repeated_slot(char *, int32, uint64);
+static void history_index_add(int32);
+static void history_index_remove(int32);
+static Entry *history_preview(int32);
+static void history_preview_store(Entry *, char *, int32);
+static void history_preview_drop(Entry *);
+static void history_preview_evict(int64);
+static bool history_mapped(char *);
+static void history_unmap(void);
+static void history_free_entry(Entry *);
+static void history_defer(Entry *);
 static void history_reorder(int32);
+static void history_remove_slot(int32);
 static void history_prune(void);
+static int32 history_create_image(char *, int32, int32 *);
 static int32 history_save_image(char **, int32 *);
+static void history_free_content(char *, int64);
+static void history_add(char *, int32, int32, int64);
 static bool history_recover_write(int32, Entry *);
 static void history_prepare_tmp_directory(void);
 
-static void history_append(char *, int, bool);
+static void history_init(void);
+static void history_append(char *, int32, int64);
+static void history_append_image(char *, int32, int64);
 static int history_save(void);
+static bool history_save_async(HistorySaveDone *, void *);
 static void history_recover(int32);
 static void history_remove(int32);
 static noreturn void history_exit(int);
@@ -83,17 +157,37 @@ history_prepare_tmp_directory(void) {
     return;
 }
 
-static int32
-history_text_allocation_size(Entry *e) {
-    int32 size;
-
-    if (e->content_length >= TRIMMED_SIZE) {
-        size = e->content_length + 1 + TRIMMED_SIZE + 1;
-    } else {
-        size = (e->content_length + 1)*2;
+void
+history_init(void) {
+    char *CLIPSIM_HISTORY_SIZE;
+    int32 capacity = HISTORY_BUFFER_SIZE;
+
+    GETENV(CLIPSIM_HISTORY_SIZE);
+    if (CLIPSIM_HISTORY_SIZE != NULL) {
+        if ((util_string_int32(&capacity, CLIPSIM_HISTORY_SIZE) < 0)
+            || (capacity <= 0) || (capacity > HISTORY_MAX_SIZE)) {
+            error("Invalid CLIPSIM_HISTORY_SIZE: %s."
+                  " Must be between 1 and %d.\n",
+                  CLIPSIM_HISTORY_SIZE, HISTORY_MAX_SIZE);
+            capacity = HISTORY_BUFFER_SIZE;
+        }
     }
 
-    return size;
+    history_changed();
+    store_destroy(&clipsim_entries);
+    store_init(&clipsim_entries, capacity);
+    slab_destroy(&history_slabs);
+    slab_destroy(&preview_slabs);
+    preview_bytes = 0;
+    preview_hand = 0;
+    deferred_length = 0;
+    history_unmap();
+
+    if (history_hashes != NULL) {
+        hash_destroy_content(history_hashes);
+    }
+    history_hashes = hash_create_content((uint32)capacity, "history_hashes");
+    return;
 }
 
 static int32
@@ -156,20 +250,253 @@ history_recover_write(int32 fd, Entry *e) {
 int
 history_save(void) {
     DEBUG_PRINT("void")
-    int32 nfds = 0;
-    struct pollfd pipes[HISTORY_BUFFER_SIZE];
-    int dests[HISTORY_BUFFER_SIZE];
+    Snapshot snapshot;
+    int saved;
+
+    xpthread_mutex_lock(&lock);
+    history_snapshot_take(&snapshot);
+    xpthread_mutex_unlock(&lock);
+
+    saved = history_snapshot_write(&snapshot);
+
+    xpthread_mutex_lock(&lock);
+    history_snapshot_release(&snapshot, saved);
+    xpthread_mutex_unlock(&lock);
+    return saved;
+}
+
+void
+history_snapshot_take(Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *)snapshot)
+    int32 i = 0;
+
+    snapshot->length = clipsim_entries.length;
+    snapshot->journal_size = journal.size;
+    snapshot->journal_generation = journal.generation;
+    snapshot->entries = NULL;
+
+    /* Only the table is copied.  Contents are never modified after
+     * insertion, and history_free_entry holds on to them while any
+     * snapshot is alive. */
+    if (snapshot->length > 0) {
+        snapshot->entries = malloc2(snapshot->length
+                                    *SIZEOF(*snapshot->entries));
+    }
+    for (int32 slot = store_oldest(&clipsim_entries); slot >= 0;
+         slot = store_next(&clipsim_entries, slot)) {
+        snapshot->entries[i] = clipsim_entries.entries[slot];
+        i += 1;
+    }
+
+    snapshots_alive += 1;
+    return;
+}
+
+void
+history_snapshot_release(Snapshot *snapshot, bool saved) {
+    DEBUG_PRINT("%p, %d", (void *)snapshot, saved)
+    if (snapshot->length > 0) {
+        free2(snapshot->entries, snapshot->length*SIZEOF(*snapshot->entries));
+    }
+    snapshot->entries = NULL;
+
+    snapshots_alive -= 1;
+    if (snapshots_alive <= 0) {
+        /* Previews dropped while a snapshot was alive come without their
+         * content. */
+        for (int32 i = 0; i < deferred_length; i += 1) {
+            if (deferred[i].content == NULL) {
+                slab_free(&preview_slabs, deferred[i].preview,
+                          deferred[i].preview_length + 1);
+            } else {
+                history_destroy_entry(&deferred[i]);
+            }
+        }
+        deferred_length = 0;
+    }
+
+    if (saved && (snapshot->journal_generation == journal.generation)) {
+        journal_discard_head(&journal, snapshot->journal_size);
+    }
+    return;
+}
+
+void
+history_changed(void) {
+    history_version += 1;
+    if (history_view != NULL) {
+        history_view_drop(history_view);
+        history_view = NULL;
+    }
+    return;
+}
+
+void
+history_notify(int32 op, int32 slot) {
+    if (history_listener != NULL) {
+        history_listener(op, store_index(&clipsim_entries, slot),
+                         &clipsim_entries.entries[slot]);
+    }
+    return;
+}
+
+void
+history_view_drop(HistoryView *view) {
+    view->references -= 1;
+    if (view->references <= 0) {
+        if (view->listing_offsets != NULL) {
+            free2(view->listing_offsets, (view->snapshot.length + 1)
+                                         *SIZEOF(*view->listing_offsets));
+        }
+        if (view->previews != NULL) {
+            arena_destroy(view->previews);
+        }
+        history_snapshot_release(&view->snapshot, false);
+        sb_free(&view->listing);
+        free2(view, sizeof(*view));
+    }
+    return;
+}
+
+HistoryView *
+history_view_acquire(void) {
+    DEBUG_PRINT("void")
+    HistoryView *view;
+    int32 *built = NULL;
+    int32 nbuilt;
+
+    xpthread_mutex_lock(&lock);
+    if ((view = history_view) != NULL) {
+        view->references += 1;
+        xpthread_mutex_unlock(&lock);
+        return view;
+    }
+
+    /* The first reader after a change copies the table and builds the
+     * missing previews on its copy after letting go of the lock. */
+    view = malloc2(sizeof(*view));
+    history_snapshot_take(&view->snapshot);
+    sb_init(&view->listing);
+    view->listing_offsets = NULL;
+    view->previews = NULL;
+    view->version = history_version;
+    view->references = 1;
+    xpthread_mutex_unlock(&lock);
+
+    if (view->snapshot.length > 0) {
+        built = malloc2(view->snapshot.length*SIZEOF(*built));
+    }
+    nbuilt = history_view_previews(view, built);
+
+    xpthread_mutex_lock(&lock);
+    history_view_keep(view, built, nbuilt);
+    if (history_view != NULL) {
+        /* Another reader published one for the current version first. */
+        history_view_drop(view);
+        view = history_view;
+        view->references += 1;
+    } else if (view->version == history_version) {
+        view->references += 1;
+        history_view = view;
+    }
+    xpthread_mutex_unlock(&lock);
+
+    if (view->snapshot.length > 0) {
+        free2(built, view->snapshot.length*SIZEOF(*built));
+    }
+    return view;
+}
+
+/* Previews the copy was taken without are built into an arena of the
+ * view, without the lock.  Their indices are written to built. */
+int32
+history_view_previews(HistoryView *view, int32 *built) {
+    DEBUG_PRINT("%p, %p", (void *)view, (void *)built)
+    int32 nbuilt = 0;
+
+    for (int32 i = 0; i < view->snapshot.length; i += 1) {
+        Entry *e = &view->snapshot.entries[i];
+        char buffer[TRIMMED_SIZE + 1];
+        int32 n;
+
+        if (e->preview != NULL) {
+            continue;
+        }
+        built[nbuilt] = i;
+        nbuilt += 1;
+        if (e->kind == CLIPBOARD_IMAGE) {
+            e->preview = e->content;
+            e->preview_length = e->content_length;
+            continue;
+        }
 
-    for (int32 i = 0; i < LENGTH(pipes); i += 1) {
-        pipes[i].fd = -1;
-        pipes[i].events = POLLIN;
-        pipes[i].revents = 0;
+        n = content_trim_spaces(buffer, e->content, e->content_length);
+        if (n == e->content_length) {
+            e->preview = e->content;
+        } else {
+            if (view->previews == NULL) {
+                view->previews = arena_create(HISTORY_VIEW_ARENA_SIZE, NULL);
+            }
+            e->preview = xarena_push(view->previews, n + 1);
+            memcpy64(e->preview, buffer, n + 1);
+        }
+        e->preview_length = n;
+    }
+    return nbuilt;
+}
+
+/* Called with the lock held: caches the previews built for a view in the
+ * live entries they were copied from, so the next view after a change
+ * only builds those of the new entries.  Entries removed meanwhile are
+ * skipped, as are those sharing their hash with an older one. */
+void
+history_view_keep(HistoryView *view, int32 *built, int32 nbuilt) {
+    DEBUG_PRINT("%p, %p, %d", (void *)view, (void *)built, nbuilt)
+
+    for (int32 i = 0; i < nbuilt; i += 1) {
+        Entry *copy = &view->snapshot.entries[built[i]];
+        Entry *e;
+        int32 slot;
+
+        if ((slot = history_hash_slot(copy->hash)) < 0) {
+            continue;
+        }
+        e = &clipsim_entries.entries[slot];
+        if ((e->content != copy->content) || (e->preview != NULL)) {
+            continue;
+        }
 
-        dests[i] = -1;
+        if (copy->preview == copy->content) {
+            e->preview = e->content;
+        } else {
+            history_preview_store(e, copy->preview, copy->preview_length);
+        }
+        e->preview_length = copy->preview_length;
+        e->preview_used = 1;
     }
+    return;
+}
+
+void
+history_view_release(HistoryView *view) {
+    DEBUG_PRINT("%p", (void *)view)
+    xpthread_mutex_lock(&lock);
+    history_view_drop(view);
+    xpthread_mutex_unlock(&lock);
+    return;
+}
+
+int
+history_snapshot_write(Snapshot *snapshot) {
+    DEBUG_PRINT("%p", (void *)snapshot)
+    static atomic_int counter = 0;
+    UtilCopyFilesAsync *copy_files = NULL;
+    char tmp_name[PATH_MAX];
+    File file = {.file = NULL, .fd = -1, .name = tmp_name};
+    HistoryHeader header = {0};
 
     error("Saving history...\n");
-    if (history_length <= 0) {
+    if (snapshot->length <= 0) {
         error("History is empty. Not saving.\n");
         return 0;
     }
@@ -177,94 +504,183 @@ history_save(void) {
         error("History file name unresolved, can't save history.");
         return 0;
     }
-    if ((history.fd
-         = open(history.name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR))
-        < 0) {
-        error("Error opening history file for saving: %s\n", strerror(errno));
+
+    SNPRINTF(tmp_name, "%s.%d.%d.tmp", history.name,
+             (int32)getpid(), atomic_fetch_add(&counter, 1));
+    if ((file.fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        S_IRUSR | S_IWUSR)) < 0) {
+        error("Error opening %s for saving: %s\n", tmp_name, strerror(errno));
+        return 0;
+    }
+    if ((file.file = fdopen(file.fd, "w")) == NULL) {
+        error("Error opening stream for %s: %s\n", tmp_name, strerror(errno));
+        util_close(&file);
+        unlink(tmp_name);
         return 0;
     }
+    file.fd = -1;
 
-    for (int32 i = 0; i < history_length; i += 1) {
-        int64 tag_size = sizeof(*(&IMAGE_TAG));
-        Entry *e = &clipsim_entries[i];
+    header.magic = HISTORY_MAGIC;
+    header.version = HISTORY_VERSION;
+    fwrite64(&header, 1, SIZEOF(header), file.file);
 
-        if (is_image[i]) {
+    for (int32 i = 0; i < snapshot->length; i += 1) {
+        Entry *e = &snapshot->entries[i];
+        HistoryRecord record = {0};
+        char *content = e->content;
+
+        record.hash = e->hash;
+        record.timestamp = e->timestamp;
+        record.kind = e->kind;
+        record.length = e->content_length;
+
+        if (e->kind == CLIPBOARD_IMAGE) {
             char image_save[PATH_MAX];
-            int32 n;
+            char *base = memrchr64(e->content, '/', e->content_length);
 
-            n = SNPRINTF(image_save,
-                         "%s/clipsim/%s",
-                         XDG_CACHE_HOME, basename2(e->content,
-                                                   &e->content_length, NULL));
+            base = (base == NULL) ? e->content : base + 1;
+            record.length = SNPRINTF(image_save, "%s/clipsim/%s",
+                                     XDG_CACHE_HOME, base);
+            record.trimmed_length = record.length;
 
             if (!strequal(image_save, e->content)) {
-                if ((pipes[nfds].fd
+                int32 nfds;
+
+                if (copy_files == NULL) {
+                    copy_files = malloc2(sizeof(*copy_files));
+                    copy_files->nfds = 0;
+                }
+                nfds = copy_files->nfds;
+
+                copy_files->pipes[nfds].events = POLLIN;
+                copy_files->pipes[nfds].revents = 0;
+                if ((copy_files->pipes[nfds].fd
                         = util_copy_file_async(image_save, e->content,
-                                               &dests[nfds])) < 0) {
+                                               &copy_files->dests[nfds])) < 0) {
                     error("Error copying %s to %s: %s.\n",
                           e->content, image_save, strerror(errno));
-                    history_remove(i);
                     continue;
                 }
-                nfds += 1;
-            }
-            if (write64(history.fd, image_save, n) < n) {
-                error("Error writing %s: %s\n", image_save, strerror(errno));
-                history_remove(i);
-                continue;
-            }
-            if (write64(history.fd, &TEXT_TAG, tag_size) < tag_size) {
-                error("Error writing TEXT_TAG: %s\n", strerror(errno));
-                history_remove(i);
-                continue;
-            }
-            if (write64(history.fd, &IMAGE_TAG, tag_size) < tag_size) {
-                error("Error writing IMAGE_TAG: %s\n", strerror(errno));
-                history_remove(i);
-                continue;
-            }
-        } else {
-            int32 left = e->content_length;
-            int32 offset = 0;
-            int64 w;
+                copy_files->nfds += 1;
 
-            do {
-                if ((w = write64(history.fd, e->content + offset, left)) <= 0) {
-                    break;
+                if (copy_files->nfds >= LENGTH(copy_files->pipes)) {
+                    util_copy_file_async_parsed(copy_files);
+                    copy_files = NULL;
                 }
-                left -= w;
-                offset += w;
-            } while (left > 0);
-            if (w < 0) {
-                error("Error writing %s: %s\n", e->content, strerror(errno));
-                history_remove(i);
-                continue;
-            }
-            if (write64(history.fd, &TEXT_TAG, tag_size) < tag_size) {
-                error("Error writing TEXT_TAG: %s\n", strerror(errno));
-                history_remove(i);
-                continue;
-            }
-            if (write64(history.fd, &TEXT_TAG, tag_size) < tag_size) {
-                error("Error writing TEXT_TAG: %s\n", strerror(errno));
-                history_remove(i);
-                continue;
             }
+
+            /* The hash stays the one of the original path, which is
+             * what the journal refers to. */
+            fwrite64(&record, 1, SIZEOF(record), file.file);
+            fwrite64(image_save, 1, record.length + 1, file.file);
+            header.count += 1;
+            continue;
         }
+
+        if (e->preview != NULL) {
+            record.trimmed_length = e->preview_length;
+        } else {
+            char buffer[TRIMMED_SIZE + 1];
+            record.trimmed_length = content_trim_spaces(buffer, content,
+                                                        record.length);
+        }
+        fwrite64(&record, 1, SIZEOF(record), file.file);
+        fwrite64(content, 1, record.length + 1, file.file);
+        header.count += 1;
     }
 
-    if (nfds > 0) {
-        UtilCopyFilesAsync *copy_files = malloc2(sizeof(*copy_files));
+    if (copy_files != NULL) {
+        if (copy_files->nfds > 0) {
+            util_copy_file_async_parsed(copy_files);
+        } else {
+            free2(copy_files, sizeof(*copy_files));
+        }
+    }
 
-        memcpy64(copy_files->pipes, pipes, sizeof(pipes));
-        memcpy64(copy_files->dests, dests, sizeof(dests));
-        copy_files->nfds = nfds;
+    if (fseek(file.file, 0, SEEK_SET) < 0) {
+        error("Error seeking %s: %s\n", tmp_name, strerror(errno));
+        goto fail;
+    }
+    fwrite64(&header, 1, SIZEOF(header), file.file);
 
-        util_copy_file_async_parsed(copy_files);
+    if ((fflush(file.file) != 0) || ferror(file.file)) {
+        error("Error writing %s: %s\n", tmp_name, strerror(errno));
+        goto fail;
+    }
+    if (fsync(fileno(file.file)) < 0) {
+        error("Error syncing %s: %s\n", tmp_name, strerror(errno));
+        goto fail;
     }
+    util_close(&file);
 
-    util_close(&history);
+    if (rename(tmp_name, history.name) < 0) {
+        error("Error renaming %s to %s: %s\n",
+              tmp_name, history.name, strerror(errno));
+        unlink(tmp_name);
+        return 0;
+    }
     return 1;
+
+fail:
+    util_close(&file);
+    unlink(tmp_name);
+    return 0;
+}
+
+bool
+history_save_async(HistorySaveDone *done, void *data) {
+    DEBUG_PRINT("%p", data)
+    bool queued = true;
+
+    xpthread_mutex_lock(&saver_lock);
+    if (!saver_started) {
+        pthread_t thread;
+
+        xpthread_create(&thread, NULL, history_saver, NULL);
+        pthread_detach(thread);
+        saver_started = true;
+    }
+    if (done != NULL) {
+        if (saver_nwaiters < LENGTH(saver_waiters)) {
+            saver_waiters[saver_nwaiters].done = done;
+            saver_waiters[saver_nwaiters].data = data;
+            saver_nwaiters += 1;
+        } else {
+            queued = false;
+        }
+    }
+    saver_pending = true;
+    pthread_cond_signal(&saver_wake);
+    xpthread_mutex_unlock(&saver_lock);
+    return queued;
+}
+
+void *
+history_saver(void *unused) {
+    (void)unused;
+
+    while (true) {
+        SaveWaiter waiters[LENGTH(saver_waiters)];
+        int32 nwaiters;
+        bool saved;
+
+        xpthread_mutex_lock(&saver_lock);
+        while (!saver_pending) {
+            pthread_cond_wait(&saver_wake, &saver_lock);
+        }
+        saver_pending = false;
+        nwaiters = saver_nwaiters;
+        memcpy64(waiters, saver_waiters, nwaiters*SIZEOF(*waiters));
+        saver_nwaiters = 0;
+        xpthread_mutex_unlock(&saver_lock);
+
+        saved = history_save();
+
+        for (int32 i = 0; i < nwaiters; i += 1) {
+            waiters[i].done(waiters[i].data, saved);
+        }
+    }
+    return NULL;
 }
 
 void
@@ -275,7 +691,16 @@ history_exit(int32 signum) {
         error("Received signal %d.\n", signum);
     }
 
-    history_save();
+    /* The lock is not taken: this signal may have interrupted the thread
+     * holding it, and nothing else runs after this save anyway. */
+    {
+        Snapshot snapshot;
+
+        history_snapshot_take(&snapshot);
+        if (history_snapshot_write(&snapshot)) {
+            journal_truncate(&journal, 0);
+        }
+    }
 
     history_prepare_tmp_directory();
 
@@ -295,14 +720,9 @@ history_exit(int32 signum) {
 static void
 history_read(void) {
     DEBUG_PRINT("void")
-    int64 history_size;
-    char *history_map;
-    char *begin;
-    char *p;
-    int32 left;
-
     char *clipsim = "clipsim/history";
     int64 length;
+    bool upgrade;
 
     history_prepare_tmp_directory();
 
@@ -329,6 +749,9 @@ history_read(void) {
         int n = SNPRINTF(buffer, "%s/%s", XDG_CACHE_HOME, clipsim);
         history.name = xmemdup(buffer, n + 1);
 
+        n = SNPRINTF(buffer, "%s/clipsim/journal", XDG_CACHE_HOME);
+        journal.name = xmemdup(buffer, n + 1);
+
         clipsim_dir = dirname(buffer);
         if (mkdir(clipsim_dir, 0770) < 0) {
             if (errno != EEXIST) {
@@ -339,11 +762,29 @@ history_read(void) {
         }
     }
 
+    upgrade = history_read_snapshot();
+    history_read_journal();
+
+    if (upgrade && (clipsim_entries.length > 0)) {
+        error("Converting %s to the current format.\n", history.name);
+        history_save();
+    }
+    return;
+}
+
+bool
+history_read_snapshot(void) {
+    DEBUG_PRINT("void")
+    int64 history_size;
+    char *history_map;
+    bool legacy = false;
+    int32 left;
+
     if ((history.fd = open(history.name, O_RDONLY)) < 0) {
         error("Error opening history file for reading: %s\n"
               "History will start empty.\n",
               strerror(errno));
-        return;
+        return false;
     }
 
     {
@@ -353,24 +794,24 @@ history_read(void) {
                   "History will start empty.\n",
                   strerror(errno));
             util_close(&history);
-            return;
+            return false;
         }
         history_size = history_stat.st_size;
         if (history_size <= 0) {
             error("history_size: %lld\n", history_size);
             error("History file is empty.\n");
             util_close(&history);
-            return;
+            return false;
         }
         if (history_size >= MAXOF(left)) {
             error("History file is too big.\n");
             error("Max size is %d bytes.", MAXOF(left));
             util_close(&history);
-            return;
+            return false;
         }
     }
 
-    history_map = mmap(NULL, (size_t)history_size, PROT_READ | PROT_WRITE,
+    history_map = mmap(NULL, (size_t)history_size, PROT_READ,
                        MAP_PRIVATE, history.fd, 0);
 
     if (history_map == MAP_FAILED) {
@@ -378,124 +819,530 @@ history_read(void) {
               "History will start empty.\n",
               strerror(errno));
         util_close(&history);
+        return false;
+    }
+
+    legacy = (history_size < SIZEOF(HistoryHeader))
+             || (*(int32 *)history_map != HISTORY_MAGIC);
+
+    if (!legacy && (history_mapping == NULL)) {
+        history_mapping = history_map;
+        history_mapping_size = history_size;
+        history_read_records(history_map, history_size);
+        if (history_mapping_references <= 0) {
+            history_unmap();
+        }
+    } else {
+        /* Legacy records are not NUL terminated, they are copied. */
+        if (legacy) {
+            history_read_legacy(history_map, history_size);
+        } else {
+            history_read_records(history_map, history_size);
+        }
+        if (munmap(history_map, (size_t)history_size) < 0) {
+            error("Error unmapping %p with %lld bytes: %s\n",
+                  (void *)history_map, history_size, strerror(errno));
+        }
+    }
+    util_close(&history);
+    return legacy;
+}
+
+bool
+history_mapped(char *content) {
+    return (content >= history_mapping)
+           && (content < (history_mapping + history_mapping_size));
+}
+
+void
+history_unmap(void) {
+    if (history_mapping == NULL) {
         return;
     }
+    if (munmap(history_mapping, (size_t)history_mapping_size) < 0) {
+        error("Error unmapping %p with %lld bytes: %s\n",
+              (void *)history_mapping, history_mapping_size, strerror(errno));
+    }
+    history_mapping = NULL;
+    history_mapping_size = 0;
+    history_mapping_references = 0;
+    return;
+}
 
-    history_length = 0;
-    begin = history_map;
-    left = (int32)history_size;
+void
+history_read_records(char *map, int64 size) {
+    DEBUG_PRINT("%p, %lld", (void *)map, size)
+    HistoryHeader header;
+    HistoryLoad *records;
+    int64 offset = SIZEOF(header);
+    int32 capacity;
+    int32 nrecords = 0;
+
+    memcpy64(&header, map, SIZEOF(header));
+    if (header.version != HISTORY_VERSION) {
+        error("Unknown history file version %d.\n"
+              "History will start empty.\n", header.version);
+        return;
+    }
+    capacity = (int32)MIN(header.count, size / SIZEOF(HistoryRecord));
+    if (capacity <= 0) {
+        return;
+    }
+    records = malloc2(capacity*SIZEOF(*records));
+
+    /* Only the record headers are touched here, the contents are checked
+     * on the thread pool.  Nothing is hashed or trimmed: both come from
+     * the file. */
+    while (nrecords < capacity) {
+        HistoryRecord record;
+        HistoryLoad *load = &records[nrecords];
+
+        if ((size - offset) < SIZEOF(record)) {
+            break;
+        }
+        memcpy64(&record, map + offset, SIZEOF(record));
+        if ((record.length < 0)
+            || ((size - offset - SIZEOF(record)) < ((int64)record.length + 1))) {
+            break;
+        }
+
+        load->content = map + offset + SIZEOF(record);
+        load->hash = record.hash;
+        load->timestamp = record.timestamp;
+        load->length = record.length;
+        load->kind = record.kind;
+        load->trimmed_length = record.trimmed_length;
+        offset += SIZEOF(record) + record.length + 1;
+        nrecords += 1;
+    }
+
+    if (nrecords < header.count) {
+        error("History file is truncated: read %d of %d entries.\n",
+              nrecords, header.count);
+    }
+
+    parallel_for(nrecords, history_read_check, records);
+    history_read_insert(records, nrecords);
+    free2(records, capacity*SIZEOF(*records));
+    return;
+}
+
+void
+history_read_legacy(char *map, int64 size) {
+    DEBUG_PRINT("%p, %lld", (void *)map, size)
+    HistoryLoad *records = NULL;
+    char *begin = map;
+    char *p;
+    int32 left = (int32)size;
+    int32 capacity = 0;
+    int32 nrecords = 0;
+    int64 now = time(NULL);
 
     while ((left > 1) && (p = memchr64(begin, TEXT_TAG, left - 1))) {
-        Entry *e;
-        int32 content_length;
-        int32 record_length;
+        HistoryLoad *load;
         char type = *(p + 1);
-        *p = '\0';
 
-        content_length = (int32)(p - begin);
-        record_length = content_length + 2;
-        if ((content_length <= 0) || (content_length >= ENTRY_MAX_LENGTH)) {
-            error("Skipping invalid history entry with length %d.\n",
-                  content_length);
-            goto next_entry;
+        if (nrecords >= capacity) {
+            int32 new_capacity = MAX(HISTORY_BUFFER_SIZE, capacity*2);
+            records = realloc2(records, capacity, new_capacity,
+                               SIZEOF(*records));
+            capacity = new_capacity;
         }
-        if ((type != TEXT_TAG) && (type != IMAGE_TAG)) {
-            error("Skipping history entry with invalid type '%c'.\n", type);
-            goto next_entry;
-        }
-        if (history_length >= HISTORY_BUFFER_SIZE) {
-            error("History buffer is full; skipping remaining clipsim_entries.\n");
-            break;
+
+        load = &records[nrecords];
+        load->content = begin;
+        load->length = (int32)(p - begin);
+        load->timestamp = now;
+        if (type == TEXT_TAG) {
+            load->kind = CLIPBOARD_TEXT;
+        } else if (type == IMAGE_TAG) {
+            load->kind = CLIPBOARD_IMAGE;
+        } else {
+            load->kind = CLIPBOARD_ERROR;
         }
+        nrecords += 1;
 
-        e = &clipsim_entries[history_length];
-        e->content_length = content_length;
+        begin += load->length + 2;
+        left -= load->length + 2;
+    }
+
+    parallel_for(nrecords, history_read_hash, records);
+    history_read_insert(records, nrecords);
+    if (capacity > 0) {
+        free2(records, capacity*SIZEOF(*records));
+    }
+    return;
+}
 
-        if (type == IMAGE_TAG) {
-            e->trimmed = 0;
-            e->trimmed_length = e->content_length;
-            is_image[history_length] = true;
-            e->content = malloc2(e->content_length + 1);
-            memcpy64(e->content, begin, e->content_length + 1);
+void
+history_read_check(int64 start, int64 end, int32 worker, void *data) {
+    HistoryLoad *records = data;
+    (void)worker;
+
+    for (int64 i = start; i < end; i += 1) {
+        HistoryLoad *load = &records[i];
+
+        load->valid = (load->length > 0)
+                      && (load->length < ENTRY_MAX_LENGTH)
+                      && (load->content[load->length] == '\0')
+                      && ((load->kind == CLIPBOARD_TEXT)
+                          || (load->kind == CLIPBOARD_IMAGE));
+    }
+    return;
+}
+
+void
+history_read_hash(int64 start, int64 end, int32 worker, void *data) {
+    HistoryLoad *records = data;
+    (void)worker;
+
+    for (int64 i = start; i < end; i += 1) {
+        HistoryLoad *load = &records[i];
+
+        load->valid = (load->length > 0)
+                      && (load->length < ENTRY_MAX_LENGTH)
+                      && (load->kind != CLIPBOARD_ERROR);
+        if (!load->valid) {
+            continue;
+        }
+
+        load->hash = hash_function(load->content, load->length);
+        if (load->kind == CLIPBOARD_TEXT) {
+            char buffer[TRIMMED_SIZE + 1];
+            load->trimmed_length = content_trim_spaces(buffer, load->content,
+                                                       load->length);
         } else {
-            int32 size = history_text_allocation_size(e);
-            e->content = malloc2(size);
-            memcpy64(e->content, begin, e->content_length + 1);
+            load->trimmed_length = load->length;
+        }
+    }
+    return;
+}
+
+void
+history_read_insert(HistoryLoad *records, int32 nrecords) {
+    DEBUG_PRINT("%p, %d", (void *)records, nrecords)
+
+    for (int32 i = 0; i < nrecords; i += 1) {
+        HistoryLoad *load = &records[i];
+        int32 slot;
+        Entry *e;
 
-            content_trim_spaces(&e->trimmed, &e->trimmed_length, e->content,
-                                e->content_length);
-            is_image[history_length] = false;
+        if (!load->valid) {
+            error("Skipping invalid history entry %d"
+                  " with type %d and length %d.\n",
+                  i, load->kind, load->length);
+            continue;
         }
 
-        length_counts[e->content_length] += 1;
-        history_length += 1;
+        slot = history_insert(load->content, load->length, load->kind,
+                              load->hash, load->timestamp);
+        e = &clipsim_entries.entries[slot];
+        if ((load->trimmed_length == load->length)
+            && (load->length <= TRIMMED_SIZE) && (e->preview == NULL)) {
+            e->preview = e->content;
+            e->preview_length = e->content_length;
+        }
+    }
+    return;
+}
 
-next_entry:
-        begin += record_length;
-        left -= record_length;
+void
+history_read_journal(void) {
+    DEBUG_PRINT("void")
+    char *map;
+    char *payload;
+    int64 offset = 0;
+    int32 nrecords = 0;
+    JournalRecord record;
+
+    if (!journal_open(&journal, journal.name)) {
+        error("Changes will only be saved on exit.\n");
+        return;
+    }
+    if (journal.size <= 0) {
+        return;
+    }
 
-        if (history_length >= HISTORY_BUFFER_SIZE) {
+    map = mmap(NULL, (size_t)journal.size, PROT_READ, MAP_PRIVATE,
+               journal.fd, 0);
+    if (map == MAP_FAILED) {
+        error("Error mapping journal %s: %s.\n",
+              journal.name, strerror(errno));
+        return;
+    }
+
+    while (journal_next(map, journal.size, &offset, &record, &payload)) {
+        int32 slot;
+
+        nrecords += 1;
+        switch (record.op) {
+        case JOURNAL_APPEND:
+            if ((record.length <= 0)
+                || ((record.kind != CLIPBOARD_TEXT)
+                    && (record.kind != CLIPBOARD_IMAGE))
+                || (hash_function(payload, record.length) != record.hash)) {
+                error("Skipping corrupted journal record %d.\n", nrecords);
+                break;
+            }
+            history_insert(payload, record.length, record.kind, record.hash,
+                           record.timestamp);
             break;
+        case JOURNAL_REORDER:
+            if ((slot = history_hash_slot(record.hash)) >= 0) {
+                store_touch(&clipsim_entries, slot);
+                clipsim_entries.entries[slot].timestamp = record.timestamp;
+                history_changed();
+            }
+            break;
+        case JOURNAL_REMOVE:
+            if ((slot = history_hash_slot(record.hash)) >= 0) {
+                history_remove_slot(slot);
+            }
+            break;
+        default:
+            error("Unexpected default case.\n");
+            exit(EXIT_FAILURE);
         }
     }
 
-    if (munmap(history_map, (size_t)history_size) < 0) {
-        error("Error unmapping %p with %lld bytes: %s\n",
-              (void *)history_map, history_size, strerror(errno));
+    if (munmap(map, (size_t)journal.size) < 0) {
+        error("Error unmapping journal: %s.\n", strerror(errno));
     }
-    util_close(&history);
+    if (offset < journal.size) {
+        error("Discarding %lld bytes at the end of journal %s.\n",
+              journal.size - offset, journal.name);
+        journal_truncate(&journal, offset);
+    }
+    error("Replayed %d changes from %s.\n", nrecords, journal.name);
     return;
 }
 
 int32
-history_repeated_index(char *content, int32 length) {
-    DEBUG_PRINT("%.50s, %d", content, length)
-    int32 candidates;
+history_insert(char *content, int32 length, int32 kind, uint64 hash,
+               int64 timestamp) {
+    int32 slot;
+    Entry *e;
+
+    history_changed();
+    if ((slot = history_repeated_slot(content, length, hash)) >= 0) {
+        store_touch(&clipsim_entries, slot);
+        clipsim_entries.entries[slot].timestamp = timestamp;
+        return slot;
+    }
+    if (clipsim_entries.length >= clipsim_entries.capacity) {
+        history_prune();
+    }
+
+    slot = store_push(&clipsim_entries);
+    e = &clipsim_entries.entries[slot];
+    e->content_length = length;
+    e->kind = kind;
+    e->hash = hash;
+    e->timestamp = timestamp;
+
+    /* Contents are never written after insertion, so one that is already
+     * in the history mapping, and NUL terminated there, is used as is. */
+    if (history_mapped(content)) {
+        e->content = content;
+        history_mapping_references += 1;
+    } else {
+        e->content = slab_alloc(&history_slabs, length + 1);
+        memcpy64(e->content, content, length);
+        e->content[length] = '\0';
+    }
+
+    history_index_add(slot);
+    return slot;
+}
+
+void
+history_log(int32 op, Entry *e) {
+    if (journal.fd < 0) {
+        return;
+    }
+
+    journal_append(&journal, op, e);
+
+    /* A saved snapshot drops the journal records it contains. */
+    if (journal.size >= JOURNAL_COMPACT_SIZE) {
+        history_save_async(NULL, NULL);
+    }
+    return;
+}
+
+int32
+history_hash_slot(uint64 hash) {
+    int32 slot;
+
+    if (!hash_lookup_pre_calc_content(history_hashes, &hash, hash,
+                                      hash_normal(history_hashes, hash),
+                                      &slot)) {
+        return -1;
+    }
+    return slot;
+}
+
+int32
+history_repeated_slot(char *content, int32 length, uint64 hash) {
+    DEBUG_PRINT("%.50s, %d, %llu", content, length, (ullong)hash)
+    int32 slot;
+    Entry *e;
 
     if ((length <= 0) || (length >= ENTRY_MAX_LENGTH)) {
         return -1;
     }
+    if ((slot = history_hash_slot(hash)) < 0) {
+        return -1;
+    }
 
-    candidates = length_counts[length];
-    if (candidates == 0) {
+    /* A 64 bit collision is unlikely but still possible, so the hit must
+     * be confirmed before the new content is dropped. */
+    e = &clipsim_entries.entries[slot];
+    if ((e->content_length != length)
+        || memcmp64(e->content, content, length)) {
         return -1;
     }
+    return slot;
+}
 
-    for (int32 i = history_length - 1; i >= 0; i -= 1) {
-        Entry *e = &clipsim_entries[i];
+void
+history_index_add(int32 slot) {
+    Entry *e = &clipsim_entries.entries[slot];
 
-        if (e->content_length != length) {
-            continue;
+    hash_insert_pre_calc_content(history_hashes, &e->hash, e->hash,
+                                 hash_normal(history_hashes, e->hash), slot);
+    return;
+}
+
+void
+history_index_remove(int32 slot) {
+    Entry *e = &clipsim_entries.entries[slot];
+    int32 indexed;
+    uint32 index = hash_normal(history_hashes, e->hash);
+
+    /* On a collision only the first entry with that hash is indexed. */
+    if (hash_lookup_pre_calc_content(history_hashes, &e->hash, e->hash,
+                                     index, &indexed)
+        && (indexed == slot)) {
+        hash_remove_pre_calc_content(history_hashes, &e->hash, e->hash, index);
+    }
+    return;
+}
+
+Entry *
+history_preview(int32 slot) {
+    Entry *e = &clipsim_entries.entries[slot];
+
+    e->preview_used = 1;
+    if (e->preview != NULL) {
+        return e;
+    }
+
+    if (e->kind == CLIPBOARD_IMAGE) {
+        e->preview = e->content;
+        e->preview_length = e->content_length;
+    } else {
+        char buffer[TRIMMED_SIZE + 1];
+        int32 n = content_trim_spaces(buffer, e->content, e->content_length);
+
+        /* Trimming only ever removes bytes, so an unchanged length means
+         * the preview is the content itself. */
+        if (n == e->content_length) {
+            e->preview = e->content;
+        } else {
+            history_preview_store(e, buffer, n);
+        }
+        e->preview_length = n;
+    }
+    return e;
+}
+
+/* Puts a copy of the n bytes of preview, and a NUL, in the pool. */
+void
+history_preview_store(Entry *e, char *preview, int32 n) {
+    if ((preview_bytes + n + 1) > preview_limit) {
+        history_preview_evict(n + 1);
+    }
+    e->preview = slab_alloc(&preview_slabs, n + 1);
+    memcpy64(e->preview, preview, n);
+    e->preview[n] = '\0';
+    preview_bytes += n + 1;
+    return;
+}
+
+void
+history_preview_drop(Entry *e) {
+    if ((e->preview != NULL) && (e->preview != e->content)) {
+        /* A view may still be listing it. */
+        if (snapshots_alive > 0) {
+            Entry preview = {.preview = e->preview,
+                             .preview_length = e->preview_length};
+            history_defer(&preview);
+        } else {
+            slab_free(&preview_slabs, e->preview, e->preview_length + 1);
         }
-        if (!memcmp64(e->content, content, length)) {
-            return i;
+        preview_bytes -= e->preview_length + 1;
+    }
+    e->preview = NULL;
+    e->preview_length = 0;
+    return;
+}
+
+void
+history_preview_evict(int64 needed) {
+    int32 capacity = clipsim_entries.capacity;
+
+    /* Clock sweep: previews listed since the last pass get a second
+     * chance, two full turns are enough to free any amount. */
+    for (int32 i = 0; i < 2*capacity; i += 1) {
+        Entry *e = &clipsim_entries.entries[preview_hand];
+
+        if ((preview_bytes + needed) <= preview_limit) {
+            break;
         }
+        preview_hand = (preview_hand + 1) % capacity;
 
-        candidates -= 1;
-        if (candidates <= 0) {
-            return -1;
+        if ((e->preview == NULL) || (e->preview == e->content)) {
+            continue;
+        }
+        if (e->preview_used) {
+            e->preview_used = 0;
+            continue;
         }
+        history_preview_drop(e);
     }
-    return -1;
+    return;
 }
 
+/* Creates the file an image copied now is saved to, with its name written
+ * to image_file and the length of the name to length. */
 int32
-history_save_image(char **content, int32 *length) {
-    DEBUG_PRINT("%p, %d", (void *)content, *length)
+history_create_image(char *image_file, int32 size, int32 *length) {
+    DEBUG_PRINT("%p, %d, %p", (void *)image_file, size, (void *)length)
     int32 file;
-    int64 w;
-    int64 copied = 0;
-    char image_file[256];
-    int64 t = time(NULL);
-    int32 n;
 
     history_prepare_tmp_directory();
-    n = SNPRINTF(image_file, "%s/%lld.png", tmp_directory, t);
+    *length = snprintf2(image_file, size, "%s/%lld.png",
+                        tmp_directory, (llong)time(NULL));
 
     if ((file
          = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR))
         < 0) {
         error("Error opening %s for saving: %s\n", image_file, strerror(errno));
+    }
+    return file;
+}
+
+int32
+history_save_image(char **content, int32 *length) {
+    DEBUG_PRINT("%p, %d", (void *)content, *length)
+    int32 file;
+    int64 w;
+    int64 copied = 0;
+    char image_file[256];
+    int32 n;
+
+    if ((file = history_create_image(image_file, SIZEOF(image_file), &n)) < 0) {
         return -1;
     }
 
@@ -525,13 +1372,22 @@ history_save_image(char **content, int32 *length) {
     return 0;
 }
 
+/* Content comes from Xlib when capacity is 0, and otherwise was allocated
+ * by the INCR receiver with that capacity. */
+void
+history_free_content(char *content, int64 capacity) {
+    if (capacity > 0) {
+        free2(content, capacity);
+    } else {
+        XFree(content);
+    }
+    return;
+}
+
 void
-history_append(char *content, int32 length, bool incr_buffer) {
+history_append(char *content, int32 length, int64 capacity) {
     DEBUG_PRINT("%.50s, %d", content, length)
-    int32 oldindex;
     int32 kind;
-    int32 size;
-    Entry *e;
 
     if (!content) {
         error("Error getting data from clipboard. Skipping entry...\n");
@@ -540,11 +1396,7 @@ history_append(char *content, int32 length, bool incr_buffer) {
     }
     if (recovered) {
         recovered = false;
-        if (incr_buffer) {
-            free2(content, ENTRY_MAX_LENGTH);
-        } else {
-            XFree(content);
-        }
+        history_free_content(content, capacity);
         return;
     }
 
@@ -555,120 +1407,79 @@ history_append(char *content, int32 length, bool incr_buffer) {
         break;
     case CLIPBOARD_IMAGE:
         if (history_save_image(&content, &length) < 0) {
-            if (incr_buffer) {
-                free2(content, ENTRY_MAX_LENGTH);
-            } else {
-                XFree(content);
-            }
+            history_free_content(content, capacity);
             return;
         }
         break;
     default:
-        if (incr_buffer) {
-            free2(content, ENTRY_MAX_LENGTH);
-        } else {
-            XFree(content);
-        }
+        history_free_content(content, capacity);
         return;
     }
 
-    if ((oldindex = history_repeated_index(content, length)) >= 0) {
-        if (oldindex != (history_length - 1)) {
-            history_reorder(oldindex);
-        }
-        if (incr_buffer) {
-            free2(content, ENTRY_MAX_LENGTH);
-        } else {
-            XFree(content);
-        }
-        return;
-    }
-
-    if (history_length >= HISTORY_BUFFER_SIZE) {
-        history_prune();
-    }
+    history_add(content, length, kind, capacity);
+    return;
+}
 
-    e = &clipsim_entries[history_length];
-    e->content_length = length;
-    length_counts[length] += 1;
+/* Adds an image the INCR receiver already wrote to the file named by
+ * path. */
+void
+history_append_image(char *path, int32 length, int64 capacity) {
+    DEBUG_PRINT("%s, %d", path, length)
 
-    switch (kind) {
-    case CLIPBOARD_TEXT:
-        size = history_text_allocation_size(e);
-        if (incr_buffer) {
-            e->content = realloc2(content,
-                                  ENTRY_MAX_LENGTH, size,
-                                  SIZEOF(char));
-        } else {
-            e->content = malloc2(size);
-            memcpy64(e->content, content, e->content_length + 1);
+    if (recovered) {
+        recovered = false;
+        if (unlink(path) < 0) {
+            error("Error removing %s: %s.\n", path, strerror(errno));
         }
+        history_free_content(path, capacity);
+        return;
+    }
 
-        content_trim_spaces(&e->trimmed, &e->trimmed_length,
-                            e->content, e->content_length);
-        is_image[history_length] = false;
-        break;
-    case CLIPBOARD_IMAGE:
-        e->trimmed = 0;
-        e->trimmed_length = e->content_length;
+    history_add(path, length, CLIPBOARD_IMAGE, capacity);
+    return;
+}
 
-        if (incr_buffer) {
-            e->content = realloc2(content,
-                                  ENTRY_MAX_LENGTH, length + 1,
-                                  SIZEOF(char));
-        } else {
-            e->content = malloc2(length + 1);
-            memcpy64(e->content, content, length + 1);
+void
+history_add(char *content, int32 length, int32 kind, int64 capacity) {
+    DEBUG_PRINT("%.50s, %d, %d", content, length, kind)
+    int32 oldslot;
+    int32 slot;
+    uint64 hash;
+
+    hash = hash_function(content, length);
+    if ((oldslot = history_repeated_slot(content, length, hash)) >= 0) {
+        /* Copying the newest entry again changes nothing. */
+        if (oldslot == store_newest(&clipsim_entries)) {
+            history_free_content(content, capacity);
+            return;
         }
-        
-        is_image[history_length] = true;
-        break;
-    default:
-        error("Unexpected default case.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (!incr_buffer) {
-        XFree(content);
+        history_notify(JOURNAL_REORDER, oldslot);
+        store_touch(&clipsim_entries, oldslot);
+        clipsim_entries.entries[oldslot].timestamp = time(NULL);
+        history_changed();
+        history_log(JOURNAL_REORDER, &clipsim_entries.entries[oldslot]);
+        history_free_content(content, capacity);
+        return;
     }
 
-    history_length += 1;
-    if (history_length >= HISTORY_BUFFER_SIZE) {
-        history_prune();
-    }
+    slot = history_insert(content, length, kind, hash, time(NULL));
+    history_log(JOURNAL_APPEND, &clipsim_entries.entries[slot]);
+    history_notify(JOURNAL_APPEND, slot);
 
+    history_free_content(content, capacity);
     return;
 }
 
 void
 history_prune(void) {
-    int32 to_remove;
-
-    if (history_length < HISTORY_BUFFER_SIZE) {
-        return;
-    }
-
-    to_remove = history_length - HISTORY_KEEP_SIZE;
-    if (to_remove <= 0) {
-        return;
-    }
+    while (clipsim_entries.length >= clipsim_entries.capacity) {
+        history_remove_slot(store_oldest(&clipsim_entries));
 
-    for (int32 i = 0; i < to_remove; i += 1) {
-        history_free_entry(&clipsim_entries[i], i);
+        history_evictions += 1;
+        if ((history_evictions % MAGIC_REOPEN_INTERVAL) == 0) {
+            reopen_magic();
+        }
     }
-
-    memcpy64(&clipsim_entries[0], &clipsim_entries[to_remove],
-             HISTORY_KEEP_SIZE*SIZEOF(*clipsim_entries));
-    memset64(&clipsim_entries[HISTORY_KEEP_SIZE], 0,
-             to_remove*SIZEOF(*clipsim_entries));
-
-    memcpy64(&is_image[0], &is_image[to_remove],
-             HISTORY_KEEP_SIZE*SIZEOF(*is_image));
-    memset64(&is_image[HISTORY_KEEP_SIZE], 0,
-             to_remove*SIZEOF(*is_image));
-
-    history_length = HISTORY_KEEP_SIZE;
-
-    reopen_magic();
     return;
 }
 
@@ -680,22 +1491,22 @@ history_recover(int32 id) {
     bool istext;
     char *xclip = "xclip";
 
-    if (history_length <= 0) {
+    if (clipsim_entries.length <= 0) {
         error("Clipboard history empty. Start copying text.\n");
         return;
     }
     if (id < 0) {
-        id = history_length + id;
+        id = clipsim_entries.length + id;
     }
-    if ((id >= history_length) || (id < 0)) {
+    if ((id >= clipsim_entries.length) || (id < 0)) {
         error("Invalid index for recovery: %d\n", id);
         recovered = true;
         return;
     }
 
-    e = &clipsim_entries[id];
+    e = store_get(&clipsim_entries, id);
 
-    if ((istext = (is_image[id] == false))) {
+    if ((istext = (e->kind != CLIPBOARD_IMAGE))) {
         xpipe(fd);
     }
 
@@ -733,9 +1544,7 @@ history_recover(int32 id) {
         exit(EXIT_FAILURE);
     }
 
-    if (id != (history_length - 1)) {
-        history_reorder(id);
-    }
+    history_reorder(id);
 
     recovered = true;
     return;
@@ -744,65 +1553,96 @@ history_recover(int32 id) {
 void
 history_remove(int32 id) {
     DEBUG_PRINT("%d", id)
-    if (history_length <= 0) {
+    int32 slot;
+
+    if (clipsim_entries.length <= 0) {
         return;
     }
 
     if (id < 0) {
-        id = history_length + id;
+        id = clipsim_entries.length + id;
     }
-    if ((id < 0) || (id >= history_length)) {
+    if ((id < 0) || (id >= clipsim_entries.length)) {
         error("Invalid index %d for deletion.\n", id);
         return;
     }
 
-    history_free_entry(&clipsim_entries[id], id);
-
-    if (id < (history_length - 1)) {
-        memmove64(&clipsim_entries[id], &clipsim_entries[id + 1],
-                  (history_length - 1 - id)*SIZEOF(*clipsim_entries));
-        memmove64(&is_image[id], &is_image[id + 1],
-                  (history_length - 1 - id)*SIZEOF(*is_image));
-    }
-
-    memset64(&clipsim_entries[history_length - 1], 0, sizeof(*clipsim_entries));
-    memset64(&is_image[history_length - 1], 0, sizeof(*is_image));
-    history_length -= 1;
+    slot = store_slot(&clipsim_entries, id);
+    history_log(JOURNAL_REMOVE, &clipsim_entries.entries[slot]);
+    history_remove_slot(slot);
+    return;
+}
 
+void
+history_remove_slot(int32 slot) {
+    DEBUG_PRINT("%d", slot)
+    history_notify(JOURNAL_REMOVE, slot);
+    history_index_remove(slot);
+    history_free_entry(&clipsim_entries.entries[slot]);
+    store_release(&clipsim_entries, slot);
+    history_changed();
     return;
 }
 
 void
 history_reorder(int32 oldindex) {
     DEBUG_PRINT("%d", oldindex)
-    Entry aux = clipsim_entries[oldindex];
-    bool aux2 = is_image[oldindex];
-    int32 n = history_length - 1 - oldindex;
+    int32 slot = store_slot(&clipsim_entries, oldindex);
+
+    if (slot == store_newest(&clipsim_entries)) {
+        return;
+    }
+    history_notify(JOURNAL_REORDER, slot);
+    store_touch(&clipsim_entries, slot);
+    clipsim_entries.entries[slot].timestamp = time(NULL);
+    history_changed();
+    history_log(JOURNAL_REORDER, &clipsim_entries.entries[slot]);
+    return;
+}
+
+void
+history_free_entry(Entry *e) {
+    DEBUG_PRINT("{content=%.50s,length=%d}", e->content, e->content_length)
+
+    history_preview_drop(e);
+    if (snapshots_alive > 0) {
+        history_defer(e);
+        return;
+    }
+    history_destroy_entry(e);
+    return;
+}
 
-    if (n > 0) {
-        memmove64(&clipsim_entries[oldindex], &clipsim_entries[oldindex + 1], n*SIZEOF(*clipsim_entries));
-        memmove64(&is_image[oldindex], &is_image[oldindex + 1], n*SIZEOF(*is_image));
+void
+history_defer(Entry *e) {
+    if (deferred_length >= deferred_capacity) {
+        int32 capacity = MAX(16, deferred_capacity*2);
+        deferred = realloc2(deferred, deferred_capacity, capacity,
+                            SIZEOF(*deferred));
+        deferred_capacity = capacity;
     }
-    
-    memmove64(&clipsim_entries[history_length - 1], &aux, SIZEOF(*clipsim_entries));
-    memmove64(&is_image[history_length - 1], &aux2, SIZEOF(*is_image));
+    deferred[deferred_length] = *e;
+    deferred_length += 1;
     return;
 }
 
 void
-history_free_entry(Entry *e, int32 index) {
-    DEBUG_PRINT("{content=%.50s,length=%d}, index=%d",
-                e->content, e->content_length, index)
-    length_counts[e->content_length] -= 1;
+history_destroy_entry(Entry *e) {
+    DEBUG_PRINT("{content=%.50s,length=%d}", e->content, e->content_length)
 
-    if (is_image[index]) {
-        if (unlink(e->content) < 0) {
+    if (e->kind == CLIPBOARD_IMAGE) {
+        if ((unlink(e->content) < 0) && (errno != ENOENT)) {
             error("Error deleting %s: %s.\n", e->content, strerror(errno));
         }
-        free2(e->content, e->content_length + 1);
-    } else {
-        free2(e->content, history_text_allocation_size(e));
     }
+    if (history_mapped(e->content)) {
+        history_mapping_references -= 1;
+        if (history_mapping_references <= 0) {
+            history_unmap();
+        }
+        return;
+    }
+    slab_free(&history_slabs, e->content, e->content_length + 1);
     return;
 }
 
@@ -812,7 +1652,13 @@ history_functions_sink(void) {
     (void)history_functions_sink;
     (void)history_exit;
     (void)history_read;
+    (void)history_init;
+    (void)history_remove;
+    (void)history_preview;
+    (void)history_view_acquire;
+    (void)history_view_release;
     (void)history_append;
+    (void)history_append_image;
 }
 #endif
 
@@ -826,46 +1672,48 @@ main(void) {
 
     setenv("XDG_CACHE_HOME", test_dir, 1);
     mkdir(test_dir, 0770);
+    unlink("/tmp/clipsim_test_cache/clipsim/journal");
     tmp_directory = "/tmp/clipsim_test_tmp";
     mkdir(tmp_directory, 0770);
 
     magic = magic_open(MAGIC_MIME_TYPE);
     magic_load(magic, NULL);
 
-    {
-        int32 idx = 0;
-
-        history_length = 3;
-
-        clipsim_entries[0].content = "alpha";
-        clipsim_entries[0].content_length = 5;
-        is_image[0] = false;
-        length_counts[5] += 1;
+    history_init();
 
-        clipsim_entries[1].content = "beta";
-        clipsim_entries[1].content_length = 4;
-        is_image[1] = false;
-        length_counts[4] += 1;
+    {
+        int32 slot = 0;
+        char *contents[] = {"alpha", "beta", "gamma"};
+
+        for (int32 i = 0; i < LENGTH(contents); i += 1) {
+            Entry *e;
+
+            slot = store_push(&clipsim_entries);
+            e = &clipsim_entries.entries[slot];
+            e->content = contents[i];
+            e->content_length = strlen32(contents[i]);
+            e->kind = CLIPBOARD_TEXT;
+            e->hash = hash_function(e->content, e->content_length);
+            history_index_add(slot);
+        }
 
-        clipsim_entries[2].content = "gamma";
-        clipsim_entries[2].content_length = 5;
-        is_image[2] = false;
-        length_counts[5] += 1;
+        slot = history_repeated_slot("beta", 4, hash_function("beta", 4));
+        ASSERT_EQUAL(store_index(&clipsim_entries, slot), 1);
 
-        idx = history_repeated_index("beta", 4);
-        ASSERT_EQUAL(idx, 1);
+        slot = history_repeated_slot("delta", 5, hash_function("delta", 5));
+        ASSERT_EQUAL(slot, -1);
 
-        idx = history_repeated_index("delta", 5);
-        ASSERT_EQUAL(idx, -1);
+        /* Same hash, different content: must not be reported. */
+        slot = history_repeated_slot("betA", 4, hash_function("beta", 4));
+        ASSERT_EQUAL(slot, -1);
 
         history_reorder(0);
-        ASSERT_EQUAL(clipsim_entries[0].content_length, 4);
-        ASSERT_EQUAL(clipsim_entries[1].content_length, 5);
-        ASSERT_EQUAL(clipsim_entries[2].content_length, 5);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 0)->content_length, 4);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 1)->content_length, 5);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 2)->content_length, 5);
+        ASSERT(strequal(store_get(&clipsim_entries, 2)->content, "alpha"));
 
-        history_length = 0;
-        length_counts[4] = 0;
-        length_counts[5] = 0;
+        history_init();
     }
 
     {
@@ -877,20 +1725,20 @@ main(void) {
         char *text2 = malloc2(ENTRY_MAX_LENGTH);
 
         memcpy64(text1, testing12, len12 + 1);
-        history_append(text1, len12, true);
-        ASSERT_EQUAL(clipsim_entries[0].content_length, len12);
-        ASSERT_EQUAL(history_length, 1);
+        history_append(text1, len12, ENTRY_MAX_LENGTH);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 0)->content_length, len12);
+        ASSERT_EQUAL(clipsim_entries.length, 1);
 
         memcpy64(text2, testing34, len34 + 1);
-        history_append(text2, len34, true);
-        ASSERT_EQUAL(clipsim_entries[0].content_length, len34);
-        ASSERT_EQUAL(history_length, 2);
+        history_append(text2, len34, ENTRY_MAX_LENGTH);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 0)->content_length, len34);
+        ASSERT_EQUAL(clipsim_entries.length, 2);
     }
 
     {
         history_remove(0);
-        ASSERT_EQUAL(history_length, 1);
-        ASSERT_EQUAL(clipsim_entries[0].content_length, 9);
+        ASSERT_EQUAL(clipsim_entries.length, 1);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 0)->content_length, 9);
     }
 
     {
@@ -899,12 +1747,293 @@ main(void) {
 
         ASSERT(history_save());
 
-        history_length = 0;
-        memset64(length_counts, 0, sizeof(length_counts));
+        history_init();
 
         history_read();
-        ASSERT_EQUAL(history_length, 1);
-        ASSERT_EQUAL(clipsim_entries[0].content_length, 9);
+        ASSERT_EQUAL(clipsim_entries.length, 1);
+        ASSERT_EQUAL(store_get(&clipsim_entries, 0)->content_length, 9);
+    }
+
+    {
+        char *texts[] = {"journal one", "journal two"};
+
+        ASSERT_NOT_EQUAL(journal.fd, -1);
+        ASSERT_EQUAL(journal.size, 0);
+
+        for (int32 i = 0; i < LENGTH(texts); i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "%s", texts[i]);
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        {
+            int64 size = journal.size;
+            int64 version = history_version;
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "%s", texts[1]);
+
+            history_append(text, len, ENTRY_MAX_LENGTH);
+            ASSERT_EQUAL(clipsim_entries.length, 3);
+            ASSERT_EQUAL(journal.size, size);
+            ASSERT_EQUAL(history_version, version);
+        }
+        history_reorder(0);
+        history_remove(0);
+        ASSERT_EQUAL(clipsim_entries.length, 2);
+        ASSERT_POSITIVE(journal.size);
+
+        /* Crash: nothing saved but the journal. */
+        journal_close(&journal);
+        history_init();
+        history_read();
+        ASSERT_EQUAL(clipsim_entries.length, 2);
+        ASSERT(strequal(store_get(&clipsim_entries, 0)->content,
+                        "journal two"));
+        ASSERT(strequal(store_get(&clipsim_entries, 1)->content,
+                        "testing34"));
+
+        /* Replaying twice on top of the same snapshot changes nothing. */
+        journal_close(&journal);
+        history_init();
+        history_read();
+        ASSERT_EQUAL(clipsim_entries.length, 2);
+
+        ASSERT(history_save());
+        ASSERT_EQUAL(journal.size, 0);
+    }
+
+    {
+        /* Changes made while a snapshot is being written survive it: the
+         * removed entry stays readable and its journal record is kept. */
+        Snapshot snapshot;
+        int32 generation = journal.generation;
+        int64 size;
+
+        history_snapshot_take(&snapshot);
+        ASSERT_EQUAL(snapshot.length, 2);
+        history_remove(0);
+        ASSERT_EQUAL(deferred_length, 1);
+        ASSERT(strequal(deferred[0].content, "journal two"));
+        size = journal.size;
+        ASSERT_POSITIVE(size);
+
+        ASSERT(history_snapshot_write(&snapshot));
+        history_snapshot_release(&snapshot, true);
+        ASSERT_EQUAL(deferred_length, 0);
+        ASSERT_EQUAL(journal.size, size);
+        ASSERT_EQUAL(journal.generation, generation);
+
+        journal_close(&journal);
+        history_init();
+        history_read();
+        ASSERT_EQUAL(clipsim_entries.length, 1);
+        ASSERT(strequal(store_get(&clipsim_entries, 0)->content,
+                        "testing34"));
+        journal_close(&journal);
+    }
+
+    {
+        /* A legacy file is converted on load, then binary content
+         * survives a round trip. */
+        char legacy[] = "legacy one\001\001legacy two\001\001";
+        char binary[] = "bin\001ary\002";
+        char *text = malloc2(ENTRY_MAX_LENGTH);
+        int32 fd;
+        int32 magic_number = 0;
+        Entry *e;
+
+        unlink(journal.name);
+        fd = open(history.name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ASSERT(journal_write_all(fd, legacy, SIZEOF(legacy) - 1));
+        XCLOSE(&fd);
+
+        history_init();
+        history_read();
+        ASSERT_EQUAL(clipsim_entries.length, 2);
+        fd = open(history.name, O_RDONLY);
+        ASSERT_EQUAL(read64(fd, &magic_number, SIZEOF(magic_number)),
+                     SIZEOF(magic_number));
+        XCLOSE(&fd);
+        ASSERT_EQUAL(magic_number, HISTORY_MAGIC);
+
+        memcpy64(text, binary, SIZEOF(binary));
+        history_append(text, SIZEOF(binary) - 1, ENTRY_MAX_LENGTH);
+        ASSERT_EQUAL(clipsim_entries.length, 3);
+        ASSERT(history_save());
+
+        journal_close(&journal);
+        history_init();
+        history_read();
+        ASSERT_EQUAL(clipsim_entries.length, 3);
+        e = store_get(&clipsim_entries, 2);
+        ASSERT_EQUAL(e->content_length, SIZEOF(binary) - 1);
+        ASSERT(!memcmp64(e->content, binary, SIZEOF(binary)));
+        ASSERT_EQUAL(e->hash, hash_function(binary, SIZEOF(binary) - 1));
+        ASSERT_POSITIVE(e->timestamp);
+
+        e = store_get(&clipsim_entries, 0);
+        ASSERT(strequal(e->content, "legacy one"));
+        ASSERT(e->preview == e->content);
+
+        /* Loaded contents are not copied, the mapping goes away with the
+         * last entry that points into it. */
+        ASSERT(history_mapped(e->content));
+        ASSERT_EQUAL(history_mapping_references, 3);
+        ASSERT_EQUAL(history_slabs.classes[0].live, 0);
+        while (clipsim_entries.length > 0) {
+            history_remove(0);
+        }
+        ASSERT_EQUAL(history_mapping_references, 0);
+        ASSERT(history_mapping == NULL);
+        journal_close(&journal);
+    }
+
+    {
+        /* Enough records for the load to be split across threads. */
+        int32 n = 1000;
+
+        setenv("CLIPSIM_HISTORY_SIZE", "1000", 1);
+        unlink(journal.name);
+        history_init();
+        for (int32 i = 0; i < n; i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "  parallel  %d", i);
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        ASSERT(history_save());
+        journal_close(&journal);
+
+        history_init();
+        history_read();
+        unsetenv("CLIPSIM_HISTORY_SIZE");
+        ASSERT_EQUAL(clipsim_entries.length, n);
+        for (int32 i = 0; i < n; i += 1) {
+            char text[64];
+            int32 len = SNPRINTF(text, "  parallel  %d", i);
+            Entry *e = store_get(&clipsim_entries, i);
+
+            ASSERT(strequal(e->content, text));
+            ASSERT_EQUAL(e->hash, hash_function(text, len));
+            ASSERT(e->preview == NULL);
+        }
+        journal_close(&journal);
+    }
+
+    {
+        setenv("CLIPSIM_HISTORY_SIZE", "4", 1);
+        history_init();
+        unsetenv("CLIPSIM_HISTORY_SIZE");
+        ASSERT_EQUAL(clipsim_entries.capacity, 4);
+
+        for (int32 i = 0; i < 10; i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "entry%d", i);
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        ASSERT_EQUAL(clipsim_entries.length, 4);
+        ASSERT(strequal(store_get(&clipsim_entries, 0)->content, "entry6"));
+        ASSERT(strequal(store_get(&clipsim_entries, 3)->content, "entry9"));
+
+        {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "entry7");
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        ASSERT_EQUAL(clipsim_entries.length, 4);
+        ASSERT(strequal(store_get(&clipsim_entries, 3)->content, "entry7"));
+        ASSERT(strequal(store_get(&clipsim_entries, 2)->content, "entry9"));
+        ASSERT_EQUAL(hash_length(history_hashes), 4);
+    }
+
+    {
+        char *texts[] = {"  one   two", "three", " four  five "};
+        Entry *e;
+
+        history_init();
+        for (int32 i = 0; i < LENGTH(texts); i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "%s", texts[i]);
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        for (int32 i = 0; i < clipsim_entries.length; i += 1) {
+            ASSERT_NULL(store_get(&clipsim_entries, i)->preview);
+        }
+
+        e = history_preview(store_slot(&clipsim_entries, 1));
+        ASSERT(strequal(e->preview, "three"));
+        ASSERT(e->preview == e->content);
+        ASSERT_EQUAL(preview_bytes, 0);
+
+        e = history_preview(store_slot(&clipsim_entries, 0));
+        ASSERT(strequal(e->preview, "one two"));
+        ASSERT_EQUAL(preview_bytes, 8);
+
+        e = history_preview(store_slot(&clipsim_entries, 2));
+        ASSERT(strequal(e->preview, "four five "));
+        ASSERT_EQUAL(preview_bytes, 8 + 11);
+
+        /* Over the limit the older, unused preview goes first. */
+        preview_limit = 20;
+        store_get(&clipsim_entries, 0)->preview_used = 0;
+        store_get(&clipsim_entries, 2)->preview_used = 0;
+        {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "six   seven");
+            history_append(text, len, ENTRY_MAX_LENGTH);
+        }
+        e = history_preview(store_slot(&clipsim_entries, 3));
+        ASSERT(strequal(e->preview, "six seven"));
+        ASSERT_LESS_EQUAL(preview_bytes, preview_limit);
+        ASSERT_NULL(store_get(&clipsim_entries, 0)->preview);
+        preview_limit = PREVIEW_POOL_SIZE;
+    }
+
+    {
+        /* A view is shared until the history changes, and what it points
+         * to outlives the entries it was copied from. */
+        HistoryView *view;
+        HistoryView *same;
+        int64 bytes;
+        Entry *e;
+        char *text = malloc2(ENTRY_MAX_LENGTH);
+        int32 len = snprintf2(text, ENTRY_MAX_LENGTH, "eight   nine");
+
+        view = history_view_acquire();
+        same = history_view_acquire();
+        ASSERT(view == same);
+        ASSERT_EQUAL(view->snapshot.length, clipsim_entries.length);
+        ASSERT(strequal(view->snapshot.entries[0].preview, "one two"));
+        history_view_release(same);
+
+        history_remove(0);
+        history_append(text, len, ENTRY_MAX_LENGTH);
+        ASSERT_POSITIVE(deferred_length);
+        ASSERT(strequal(view->snapshot.entries[0].preview, "one two"));
+        ASSERT(strequal(view->snapshot.entries[0].content, "  one   two"));
+
+        /* Missing previews are built on the copy and then cached in the
+         * pool for the next view. */
+        bytes = preview_bytes;
+        same = history_view_acquire();
+        ASSERT(same != view);
+        ASSERT(same == history_view);
+        ASSERT_MORE(same->version, view->version);
+        ASSERT(strequal(same->snapshot.entries[same->snapshot.length - 1]
+                        .preview, "eight nine"));
+        e = &same->snapshot.entries[same->snapshot.length - 1];
+        ASSERT(arena_of(same->previews, e->preview) != NULL);
+        ASSERT(strequal(store_get(&clipsim_entries,
+                                  clipsim_entries.length - 1)->preview,
+                        "eight nine"));
+        ASSERT(store_get(&clipsim_entries, clipsim_entries.length - 1)->preview
+               != e->preview);
+        ASSERT_EQUAL(preview_bytes, bytes + 11);
+        history_view_release(same);
+        history_view_release(view);
+        ASSERT_EQUAL(snapshots_alive, 1);
+
+        history_changed();
+        ASSERT_EQUAL(snapshots_alive, 0);
+        ASSERT_EQUAL(deferred_length, 0);
     }
 
     {
@@ -926,6 +2055,35 @@ main(void) {
         free2(img_content, 256);
     }
 
+    {
+        char image_file[256];
+        int32 n;
+        int32 file;
+        int32 length = clipsim_entries.length;
+        struct stat st;
+
+        file = history_create_image(image_file, SIZEOF(image_file), &n);
+        ASSERT_MORE_EQUAL(file, 0);
+        ASSERT_EQUAL(write64(file, "fake_image_data", 15), 15);
+        XCLOSE(&file);
+
+        history_append_image(xmemdup(image_file, n + 1), n, n + 1);
+        ASSERT_EQUAL(clipsim_entries.length, length + 1);
+        ASSERT_EQUAL(store_get(&clipsim_entries, length)->kind,
+                     CLIPBOARD_IMAGE);
+        ASSERT_EQUAL(store_get(&clipsim_entries, length)->content_length, n);
+
+        recovered = true;
+        file = history_create_image(image_file, SIZEOF(image_file), &n);
+        ASSERT_MORE_EQUAL(file, 0);
+        XCLOSE(&file);
+
+        history_append_image(xmemdup(image_file, n + 1), n, n + 1);
+        ASSERT(!recovered);
+        ASSERT_EQUAL(clipsim_entries.length, length + 1);
+        ASSERT_NOT_EQUAL(stat(image_file, &st), 0);
+    }
+
     {
         pid_t pid = fork();
 
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(INCOMING_C)
+#define INCOMING_C
+
+#include "cbase.h"
+#include "clipsim.h"
+#include "history.c"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_incoming 1
+#elif !defined(TESTING_incoming)
+#define TESTING_incoming 0
+#endif
+
+/* Collects selection content for the clipboard watchers, whichever X
+ * library they use.  The owner keeps sending INCR chunks until an empty
+ * one, so chunks are still taken, and dropped, after giving up. */
+
+static char incoming_png_signature[] = "\x89PNG\r\n\x1a\n";
+
+static void incoming_start(Incoming *, int32);
+static void incoming_chunk(Incoming *, char *, int64);
+static int32 incoming_finish(Incoming *, char **, ulong *, int64 *);
+static bool incoming_write(int32, char *, int64);
+static void incoming_store(int32, char *, ulong, int64, int32);
+
+void
+incoming_start(Incoming *incoming, int32 kind) {
+    DEBUG_PRINT("%p, %d", (void *)incoming, kind)
+    incoming->buffer = NULL;
+    incoming->length = 0;
+    incoming->capacity = 0;
+    incoming->kind = kind;
+    incoming->image = -1;
+    incoming->image_length = 0;
+    incoming->started = false;
+    incoming->failed = false;
+    return;
+}
+
+void
+incoming_chunk(Incoming *incoming, char *chunk, int64 length) {
+    DEBUG_PRINT("%p, %p, %lld", (void *)incoming, (void *)chunk, length)
+    int64 signature_length = SIZEOF(incoming_png_signature) - 1;
+
+    if (!incoming->started && (incoming->kind == CLIPBOARD_IMAGE)
+        && (length >= signature_length)
+        && !memcmp64(chunk, incoming_png_signature, signature_length)) {
+        xpthread_mutex_lock(&lock);
+        incoming->image = history_create_image(incoming->image_file,
+                                               SIZEOF(incoming->image_file),
+                                               &incoming->image_length);
+        xpthread_mutex_unlock(&lock);
+        if (incoming->image < 0) {
+            incoming->failed = true;
+        }
+    }
+    incoming->started = true;
+
+    if (incoming->failed) {
+        return;
+    }
+
+    if (incoming->image >= 0) {
+        if (!incoming_write(incoming->image, chunk, length)) {
+            error("Error writing to %s: %s.\n",
+                  incoming->image_file, strerror(errno));
+            incoming->failed = true;
+        }
+        return;
+    }
+
+    if ((incoming->length + length) >= ENTRY_MAX_LENGTH) {
+        free2(incoming->buffer, incoming->capacity);
+        incoming->buffer = NULL;
+        incoming->capacity = 0;
+        incoming->failed = true;
+        return;
+    }
+
+    if ((incoming->length + length) >= incoming->capacity) {
+        int64 capacity = incoming->capacity;
+
+        if (capacity == 0) {
+            capacity = INCOMING_CAPACITY;
+        }
+        while ((incoming->length + length) >= capacity) {
+            capacity *= 2;
+        }
+        if (capacity > ENTRY_MAX_LENGTH) {
+            capacity = ENTRY_MAX_LENGTH;
+        }
+
+        if (incoming->buffer == NULL) {
+            incoming->buffer = malloc2(capacity);
+        } else {
+            incoming->buffer = realloc2(incoming->buffer, incoming->capacity,
+                                        capacity, SIZEOF(*incoming->buffer));
+        }
+        incoming->capacity = capacity;
+    }
+
+    memcpy64(incoming->buffer + incoming->length, chunk, length);
+    incoming->length += length;
+    return;
+}
+
+/* Hands the content over in the form the history takes it: a PNG as
+ * CLIPBOARD_SAVED with the name of its file, anything else as the
+ * NUL terminated buffer.  *capacity is what *save is freed with. */
+int32
+incoming_finish(Incoming *incoming, char **save,
+                ulong *length, int64 *capacity) {
+    DEBUG_PRINT("%p, %p, %p", (void *)incoming, (void *)save, (void *)length)
+
+    *save = NULL;
+    *length = 0;
+    *capacity = 0;
+
+    if (incoming->image >= 0) {
+        XCLOSE(&incoming->image, incoming->image_file);
+        if (incoming->failed) {
+            unlink(incoming->image_file);
+            return CLIPBOARD_LARGE;
+        }
+        *capacity = incoming->image_length + 1;
+        *save = xmemdup(incoming->image_file, *capacity);
+        *length = (ulong)incoming->image_length;
+        return CLIPBOARD_SAVED;
+    }
+
+    if (incoming->failed || (incoming->length == 0)) {
+        free2(incoming->buffer, incoming->capacity);
+        incoming->buffer = NULL;
+        return CLIPBOARD_LARGE;
+    }
+
+    incoming->buffer[incoming->length] = '\0';
+    *save = incoming->buffer;
+    *length = (ulong)incoming->length;
+    *capacity = incoming->capacity;
+    incoming->buffer = NULL;
+    return incoming->kind;
+}
+
+bool
+incoming_write(int32 file, char *chunk, int64 length) {
+    int64 copied = 0;
+
+    while (copied < length) {
+        int64 w = write64(file, chunk + copied, length - copied);
+
+        if (w <= 0) {
+            return false;
+        }
+        copied += w;
+    }
+    return true;
+}
+
+/* Adds what a watcher fetched after an owner change, and coalesced more
+ * of them, to the history. */
+void
+incoming_store(int32 result, char *save, ulong length,
+               int64 capacity, int32 coalesced) {
+    DEBUG_PRINT("%d, %p, %lu", result, (void *)save, length)
+
+    xpthread_mutex_lock(&lock);
+    clipboard_owner_changes += 1 + coalesced;
+    clipboard_coalesced += coalesced;
+
+    switch (result) {
+    case CLIPBOARD_TEXT:
+        history_append(save, (int32)length, capacity);
+        break;
+    case CLIPBOARD_IMAGE:
+        history_append(save, (int32)length, capacity);
+        break;
+    case CLIPBOARD_SAVED:
+        history_append_image(save, (int32)length, capacity);
+        break;
+    case CLIPBOARD_OTHER:
+        error("Unsupported format."
+              " Clipsim only works with UTF-8 and images.\n");
+        break;
+    case CLIPBOARD_LARGE:
+        error("Buffer is too large."
+              " This data won't be saved to history.\n");
+        break;
+    case CLIPBOARD_ERROR:
+        error("Empty clipboard detected. Recovering last entry...\n");
+        history_recover(-1);
+        break;
+    default:
+        error("Unhandled result from clipboard_get_clipboard.\n");
+        exit(EXIT_FAILURE);
+    }
+    xpthread_mutex_unlock(&lock);
+    return;
+}
+
+#if 0 == TESTING_incoming
+static inline void
+incoming_functions_sink(void) {
+    (void)incoming_functions_sink;
+    (void)incoming_start;
+    (void)incoming_chunk;
+    (void)incoming_finish;
+    (void)incoming_store;
+}
+#endif
+
+#if TESTING_incoming
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+int
+main(void) {
+    Incoming incoming;
+    char *save;
+    ulong length;
+    int64 capacity;
+    int32 result;
+    char *chunk = malloc2(SIZEKB(100));
+
+    tmp_directory = "/tmp/clipsim_test_tmp";
+    memset64(chunk, 'x', SIZEKB(100));
+
+    incoming_start(&incoming, CLIPBOARD_TEXT);
+    incoming_chunk(&incoming, "abc", 3);
+    incoming_chunk(&incoming, "def", 3);
+    result = incoming_finish(&incoming, &save, &length, &capacity);
+    ASSERT_EQUAL(result, CLIPBOARD_TEXT);
+    ASSERT_EQUAL(length, 6);
+    ASSERT_EQUAL(capacity, INCOMING_CAPACITY);
+    ASSERT_EQUAL(strcmp(save, "abcdef"), 0);
+    free2(save, capacity);
+
+    /* 64 KiB, then 256 KiB once 200 KiB are in. */
+    incoming_start(&incoming, CLIPBOARD_TEXT);
+    incoming_chunk(&incoming, chunk, SIZEKB(50));
+    ASSERT_EQUAL(incoming.capacity, INCOMING_CAPACITY);
+    incoming_chunk(&incoming, chunk, SIZEKB(100));
+    incoming_chunk(&incoming, chunk, SIZEKB(50));
+    ASSERT_EQUAL(incoming.capacity, 4*INCOMING_CAPACITY);
+    result = incoming_finish(&incoming, &save, &length, &capacity);
+    ASSERT_EQUAL(result, CLIPBOARD_TEXT);
+    ASSERT_EQUAL(length, SIZEKB(200));
+    ASSERT_EQUAL(save[length], '\0');
+    free2(save, capacity);
+
+    /* Chunks after the limit are dropped without being kept. */
+    incoming_start(&incoming, CLIPBOARD_TEXT);
+    for (int64 i = 0; i < (ENTRY_MAX_LENGTH / SIZEKB(100)) + 2; i += 1) {
+        incoming_chunk(&incoming, chunk, SIZEKB(100));
+    }
+    ASSERT(incoming.failed);
+    ASSERT_NULL(incoming.buffer);
+    result = incoming_finish(&incoming, &save, &length, &capacity);
+    ASSERT_EQUAL(result, CLIPBOARD_LARGE);
+    ASSERT_NULL(save);
+
+    incoming_start(&incoming, CLIPBOARD_TEXT);
+    result = incoming_finish(&incoming, &save, &length, &capacity);
+    ASSERT_EQUAL(result, CLIPBOARD_LARGE);
+
+    /* Images that are not PNG are kept in memory, for the history to
+     * check and save like any other. */
+    incoming_start(&incoming, CLIPBOARD_IMAGE);
+    incoming_chunk(&incoming, "GIF89a", 6);
+    result = incoming_finish(&incoming, &save, &length, &capacity);
+    ASSERT_EQUAL(result, CLIPBOARD_IMAGE);
+    ASSERT_EQUAL(length, 6);
+    free2(save, capacity);
+
+    {
+        char data[64];
+        struct stat st;
+        int32 file;
+
+        memcpy64(chunk, incoming_png_signature, 8);
+        incoming_start(&incoming, CLIPBOARD_IMAGE);
+        incoming_chunk(&incoming, chunk, 40);
+        incoming_chunk(&incoming, chunk + 40, 24);
+        ASSERT_NULL(incoming.buffer);
+        result = incoming_finish(&incoming, &save, &length, &capacity);
+        ASSERT_EQUAL(result, CLIPBOARD_SAVED);
+        ASSERT_EQUAL((int64)length, capacity - 1);
+        ASSERT_EQUAL(save[length], '\0');
+
+        ASSERT_EQUAL(stat(save, &st), 0);
+        ASSERT_EQUAL(st.st_size, 64);
+        file = open(save, O_RDONLY);
+        ASSERT_EQUAL(read64(file, data, SIZEOF(data)), 64);
+        ASSERT_EQUAL(memcmp64(data, chunk, 64), 0);
+        XCLOSE(&file);
+
+        unlink(save);
+        free2(save, capacity);
+    }
+
+    {
+        struct stat st;
+
+        incoming_start(&incoming, CLIPBOARD_IMAGE);
+        incoming_chunk(&incoming, chunk, 64);
+        incoming.failed = true;
+        result = incoming_finish(&incoming, &save, &length, &capacity);
+        ASSERT_EQUAL(result, CLIPBOARD_LARGE);
+        ASSERT_NOT_EQUAL(stat(incoming.image_file, &st), 0);
+    }
+
+    incoming_store(CLIPBOARD_LARGE, NULL, 0, 0, 2);
+    incoming_store(CLIPBOARD_OTHER, NULL, 0, 0, 0);
+    ASSERT_EQUAL(clipboard_owner_changes, 4);
+    ASSERT_EQUAL(clipboard_coalesced, 2);
+
+    free2(chunk, SIZEKB(100));
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* INCOMING_C */
@@ -7,6 +7,8 @@
 #include "cbase.h"
 #include "clipsim.h"
 #include "history.c"
+#include "search.c"
+#include "fuzzy.c"
 
 #if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
 #define TESTING_ipc 1
@@ -15,32 +17,212 @@
 #endif
 
 #define IPC_SOCKET_TIMEOUT_SECONDS 5
+#define IPC_MAGIC 0x49435343
+#define IPC_MAX_CLIENTS 64
+#define IPC_CLIENT_REQUESTS 32
+#define IPC_CLIENT_BACKLOG (1 << 22)
+#define IPC_CLIENT_IOVECS 64
+#define IPC_QUERY_MAX 1024
+
+#if OS_LINUX && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define IPC_MEMFD 1
+#else
+#define IPC_MEMFD 0
+#endif
 
+enum {
+    IPC_OK = 0,
+    IPC_ERROR,
+};
+
+enum {
+    IPC_FLAG_PASS_FD = 1 << 0,
+};
+
+/* A connection carries any number of requests, which may be sent without
+ * waiting for the previous responses.  Each request is answered by one
+ * IpcResponse with the same request_id, followed by length bytes.
+ * Responses come in request order, except for COMMAND_SAVE, which is
+ * answered once the history is on disk.  The daemon closes the
+ * connection after the client shuts down its writing side.
+ *
+ * For COMMAND_PRINT, id is the number of newest entries to skip and a
+ * positive limit asks for at most that many entries.  A page past the end
+ * of the history is empty.
+ *
+ * A request is followed by length bytes of payload, at most IPC_QUERY_MAX.
+ * Only COMMAND_SEARCH and COMMAND_FUZZY have one, the query.  Search is
+ * answered like COMMAND_PRINT but with only the text entries that contain
+ * the query, newest first, at most limit of them when it is positive.
+ * Fuzzy answers the best limit entries for the query, FUZZY_DEFAULT_LIMIT
+ * when it is not positive, best first.  A connection remembers its last
+ * fuzzy query, so a picker that sends one per keystroke on the same
+ * connection only has the previous matches rescored.
+ *
+ * COMMAND_LIST pages like COMMAND_PRINT, but for programs: each entry is
+ * an IpcEntry followed by trimmed_length bytes of its preview, with no
+ * terminator.  Numbers are in the byte order of the host.
+ *
+ * COMMAND_INFO with IPC_FLAG_PASS_FD in flags may answer with the content
+ * in a file descriptor instead of in the response: a sealed memfd for
+ * text, the image file itself for images.  The descriptor comes as
+ * SCM_RIGHTS with the first byte of the IpcResponse, and the response
+ * then has only what comes before the content, the length line or
+ * IMAGE_TAG.  Without a descriptor the response is the usual one.
+ *
+ * COMMAND_SUBSCRIBE is answered at once with an empty response, and then
+ * with one more response with the same request_id for every change to
+ * the history, until the connection is closed.  Each is an IpcEvent
+ * followed by trimmed_length bytes of the preview of the entry.  op is
+ * JOURNAL_APPEND, JOURNAL_REORDER or JOURNAL_REMOVE, and id is the id of
+ * the new entry, or the id the entry had before it was moved to the end
+ * or removed, so that a copy of the listing can be kept up to date. */
 typedef struct IpcRequest {
+    int32 magic;
     int32 command;
     int32 id;
+    uint32 request_id;
+    int32 limit;
+    int32 length;
+    int32 flags;
+    int32 padding;
 } IpcRequest;
 
+typedef struct IpcResponse {
+    uint32 request_id;
+    int32 status;
+    int64 length;
+} IpcResponse;
+
+typedef struct IpcEntry {
+    uint64 hash;
+    int32 id;
+    int32 kind;
+    int32 length;
+    int32 trimmed_length;
+} IpcEntry;
+
+typedef struct IpcEvent {
+    uint64 hash;
+    int32 op;
+    int32 id;
+    int32 kind;
+    int32 length;
+    int32 trimmed_length;
+    int32 padding;
+} IpcEvent;
+
+/* What is left to send to a client, in order: either the next length
+ * bytes of its output buffer, or the cached listing of a view, which is
+ * written from the view itself and not copied.  fd, when not negative,
+ * is passed along with the first byte of the part. */
+typedef struct IpcPart {
+    HistoryView *view;
+    int64 start;
+    int64 length;
+    int32 fd;
+    int32 padding;
+} IpcPart;
+
+/* Responses are queued and written as the socket accepts them, a client
+ * that stops reading only delays itself. */
+typedef struct IpcClient {
+    StrBuilder output;
+    Fuzzy fuzzy;
+    struct timespec progress;
+    IpcPart *parts;
+    uint64 serial;
+    int64 queued;
+    int64 output_sent;
+    int64 part_sent;
+    int32 nparts;
+    int32 parts_capacity;
+    int32 part;
+    int32 fd;
+    int32 input_length;
+    int32 pending_saves;
+    uint32 subscription;
+    bool subscribed;
+    bool eof;
+    char input[IPC_CLIENT_REQUESTS*sizeof(IpcRequest) + IPC_QUERY_MAX];
+} IpcClient;
+
+typedef struct IpcSaveReply {
+    uint64 serial;
+    uint32 request_id;
+    int32 status;
+} IpcSaveReply;
+
 static char ipc_directory[PATH_MAX];
 static char ipc_lock_name[PATH_MAX];
 static char ipc_socket_name[PATH_MAX];
 static File ipc_lock = {.file = NULL, .fd = -1, .name = ipc_lock_name};
 static File ipc_socket = {.file = NULL, .fd = -1, .name = ipc_socket_name};
 
-static void ipc_daemon_history_save(int32);
-static void ipc_client_check_save(int32 *);
-static void ipc_daemon_pipe_entries(int32);
-static void ipc_daemon_pipe_id(int32, int32);
+static IpcClient ipc_clients[IPC_MAX_CLIENTS];
+static int32 ipc_nclients = 0;
+static uint64 ipc_serial = 0;
+
+/* The saver thread queues its answers here and wakes the ipc thread
+ * through ipc_wake, only the ipc thread writes to clients. */
+static int32 ipc_wake[2] = {-1, -1};
+static pthread_mutex_t ipc_saves_lock = PTHREAD_MUTEX_INITIALIZER;
+static IpcSaveReply *ipc_saves = NULL;
+static int32 ipc_nsaves = 0;
+static int32 ipc_saves_capacity = 0;
+
+/* Changes to the history are queued here by whichever thread made them,
+ * as IpcEvents each followed by its preview, and sent to subscribers by
+ * the ipc thread. */
+static pthread_mutex_t ipc_events_lock = PTHREAD_MUTEX_INITIALIZER;
+static StrBuilder ipc_events = {0};
+static atomic_int ipc_nsubscribers = 0;
+
+static IpcClient *ipc_daemon_accept(int32);
+static void ipc_daemon_close(IpcClient *);
+static bool ipc_daemon_read(IpcClient *);
+static void ipc_daemon_handle(IpcClient *, IpcRequest *, char *);
+static void ipc_daemon_queue(IpcClient *, uint32, int32, char *, int64);
+static void ipc_daemon_push(IpcClient *, HistoryView *, int64, int64);
+static IpcPart *ipc_daemon_part(IpcClient *);
+static void ipc_daemon_attach(IpcClient *, int32, int64);
+static bool ipc_daemon_flush(IpcClient *);
+static bool ipc_daemon_stalled(IpcClient *);
+static bool ipc_daemon_history_save(IpcClient *, uint32);
+static void ipc_daemon_history_saved(void *, bool);
+static void ipc_daemon_deliver_saves(void);
+static void ipc_daemon_history_event(int32, int32, Entry *);
+static void ipc_daemon_deliver_events(void);
+static void ipc_client_check_save(int32 *, int64);
+static int32 ipc_daemon_print_entries(HistoryView *);
+static int32 ipc_daemon_print_page(StrBuilder *, HistoryView *,
+                                   int32, int32);
+static void ipc_daemon_print_entry(StrBuilder *, Entry *, int32);
+static int32 ipc_daemon_list(StrBuilder *, HistoryView *, int32, int32);
+static void ipc_daemon_page(HistoryView *, int32 *, int32 *);
+static int32 ipc_daemon_search(StrBuilder *, HistoryView *,
+                               char *, int32, int32);
+static int32 ipc_daemon_fuzzy(IpcClient *, HistoryView *,
+                              char *, int32, int32);
+static int32 ipc_daemon_print_id(StrBuilder *, HistoryView *, int32);
+static int32 ipc_daemon_pass_id(StrBuilder *, HistoryView *, int32, int32 *);
+static int32 ipc_daemon_memfd(char *, int32);
+static int32 ipc_daemon_print_stats(StrBuilder *);
 static bool ipc_write_all(int32, void *, int64, char *);
 static bool ipc_read_all(int32, void *, int64, char *);
 static bool ipc_daemon_dprintf(int32, char *, char *, ...)
     __attribute__((format(printf, 3, 4)));
-static void ipc_client_print_entries(int32 *);
+static void ipc_client_print_entries(int32 *, int64, int32);
+static bool ipc_client_read_response(int32, IpcResponse *, int32 *);
+static void ipc_client_write_fd(int32 *);
+static noreturn void ipc_client_subscribe(int32 *, uint32);
+static void ipc_client_write_raw(int32 *, int64);
 static void ipc_resolve_socket_name(void);
 static void ipc_make_directory(void);
 static int32 ipc_lock_exclusive_nonblock(int32);
 static void ipc_lock_daemon(void);
 static bool ipc_set_close_on_exec(int32, char *);
+static bool ipc_set_nonblock(int32, char *);
 static bool ipc_set_socket_timeout(int32, char *);
 static void ipc_shutdown_response(int32, char *);
 static int32 ipc_connect_socket(bool);
@@ -48,7 +230,7 @@ static void ipc_make_socket(void);
 static void ipc_clean_socket(void);
 
 static noreturn void *ipc_daemon_listen(void *);
-static void ipc_client_speak(int32, int32);
+static void ipc_client_speak(int32, int32, int32, char *);
 
 void
 ipc_resolve_socket_name(void) {
@@ -195,6 +377,25 @@ ipc_set_close_on_exec(int32 fd, char *name) {
     return true;
 }
 
+bool
+ipc_set_nonblock(int32 fd, char *name) {
+    int32 flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        error("Error reading file status flags from %s: %s.\n",
+              name, strerror(errno));
+        return false;
+    }
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        error("Error setting non-blocking mode on %s: %s.\n",
+              name, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 bool
 ipc_set_socket_timeout(int32 fd, char *name) {
     struct timeval timeout;
@@ -321,103 +522,640 @@ ipc_daemon_dprintf(int32 fd, char *name, char *format, ...) {
 void *
 ipc_daemon_listen(void *unused) {
     DEBUG_PRINT("void")
-    int32 client_fd;
+    struct pollfd fds[2 + IPC_MAX_CLIENTS];
 
     (void)unused;
     ipc_make_socket();
+    ipc_set_nonblock(ipc_socket.fd, ipc_socket.name);
 
+    xpipe(ipc_wake);
+    for (int32 i = 0; i < LENGTH(ipc_wake); i += 1) {
+        ipc_set_close_on_exec(ipc_wake[i], "ipc wake pipe");
+        ipc_set_nonblock(ipc_wake[i], "ipc wake pipe");
+    }
+    xpthread_mutex_lock(&lock);
+    history_listener = ipc_daemon_history_event;
+    xpthread_mutex_unlock(&lock);
+
+    /* One thread serves every client.  The history lock is only taken to
+     * build a response into the client's output buffer, never while
+     * writing to a socket. */
     while (true) {
-        IpcRequest request;
-        socklen_t size;
-        struct sockaddr_un client_addr;
+        int32 npolled = ipc_nclients;
+        int32 nfds = 2;
 
         if (DEBUGGING) {
             error("ipc_daemon_listen loop...\n");
         }
 
-        memset64(&client_addr, 0, sizeof(client_addr));
-        size = sizeof(client_addr);
-        client_fd = accept(ipc_socket.fd, (struct sockaddr *)&client_addr,
-                           &size);
-        if (client_fd < 0) {
+        fds[0].fd = ipc_socket.fd;
+        fds[0].events = (ipc_nclients < IPC_MAX_CLIENTS) ? POLLIN : 0;
+        fds[1].fd = ipc_wake[0];
+        fds[1].events = POLLIN;
+        for (int32 i = 0; i < npolled; i += 1) {
+            IpcClient *client = &ipc_clients[i];
+            int64 queued = client->queued;
+
+            fds[nfds].fd = client->fd;
+            fds[nfds].events = 0;
+            if (!client->eof && (queued < IPC_CLIENT_BACKLOG)) {
+                fds[nfds].events |= POLLIN;
+            }
+            if (queued > 0) {
+                fds[nfds].events |= POLLOUT;
+            }
+            nfds += 1;
+        }
+        for (int32 i = 0; i < nfds; i += 1) {
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, (nfds_t)nfds, IPC_SOCKET_TIMEOUT_SECONDS*1000) < 0) {
+            if (errno != EINTR) {
+                error("Error polling %s: %s.\n",
+                      ipc_socket.name, strerror(errno));
+            }
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buffer[64];
+
+            while (read64(ipc_wake[0], buffer, SIZEOF(buffer)) > 0) {
+            }
+            ipc_daemon_deliver_saves();
+            ipc_daemon_deliver_events();
+        }
+
+        /* Backwards, because closing a client moves the last one into its
+         * place. */
+        for (int32 i = npolled - 1; i >= 0; i -= 1) {
+            IpcClient *client = &ipc_clients[i];
+            short revents = fds[2 + i].revents;
+            bool alive = true;
+
+            if ((revents & (POLLIN | POLLHUP | POLLERR))
+                || (client->input_length >= SIZEOF(IpcRequest))) {
+                alive = ipc_daemon_read(client);
+            }
+            /* The peer closed both directions, nobody will read what is
+             * left to send. */
+            if (revents & (POLLHUP | POLLERR)) {
+                alive = false;
+            }
+            alive = alive
+                    && ipc_daemon_flush(client)
+                    && !ipc_daemon_stalled(client);
+
+            if (!alive
+                || (client->eof
+                    && !client->subscribed
+                    && (client->queued <= 0)
+                    && (client->input_length < SIZEOF(IpcRequest))
+                    && (client->pending_saves <= 0))) {
+                ipc_daemon_close(client);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            while (ipc_nclients < IPC_MAX_CLIENTS) {
+                int32 client_fd = accept(ipc_socket.fd, NULL, NULL);
+
+                if (client_fd < 0) {
+                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+                        && (errno != EINTR)) {
+                        error("Error accepting connection on %s: %s.\n",
+                              ipc_socket.name, strerror(errno));
+                    }
+                    break;
+                }
+                ipc_daemon_accept(client_fd);
+            }
+        }
+    }
+}
+
+IpcClient *
+ipc_daemon_accept(int32 fd) {
+    DEBUG_PRINT("%d", fd)
+    IpcClient *client;
+
+    if ((ipc_nclients >= IPC_MAX_CLIENTS)
+        || !ipc_set_close_on_exec(fd, ipc_socket.name)
+        || !ipc_set_nonblock(fd, ipc_socket.name)) {
+        XCLOSE(&fd, ipc_socket.name);
+        return NULL;
+    }
+
+    client = &ipc_clients[ipc_nclients];
+    ipc_nclients += 1;
+    ipc_serial += 1;
+
+    memset64(client, 0, sizeof(*client));
+    sb_init(&client->output);
+    client->fd = fd;
+    client->serial = ipc_serial;
+    time_monotonic_precise(&client->progress);
+    return client;
+}
+
+void
+ipc_daemon_close(IpcClient *client) {
+    DEBUG_PRINT("%d", client->fd)
+
+    XCLOSE(&client->fd, ipc_socket.name);
+    for (int32 i = client->part; i < client->nparts; i += 1) {
+        if (client->parts[i].view != NULL) {
+            history_view_release(client->parts[i].view);
+        }
+        XCLOSE(&client->parts[i].fd);
+    }
+    if (client->parts_capacity > 0) {
+        free2(client->parts, client->parts_capacity*SIZEOF(*client->parts));
+    }
+    sb_free(&client->output);
+    fuzzy_free(&client->fuzzy);
+    if (client->subscribed) {
+        ipc_nsubscribers -= 1;
+    }
+
+    /* A save still pending for this client is answered to nobody. */
+    ipc_nclients -= 1;
+    if (client != &ipc_clients[ipc_nclients]) {
+        *client = ipc_clients[ipc_nclients];
+    }
+    return;
+}
+
+bool
+ipc_daemon_read(IpcClient *client) {
+    DEBUG_PRINT("%d", client->fd)
+
+    while (true) {
+        int32 offset = 0;
+        int64 r;
+
+        /* Requests already received are answered first, unless the client
+         * is too far behind reading the previous answers. */
+        while (((client->input_length - offset) >= SIZEOF(IpcRequest))
+               && (client->queued < IPC_CLIENT_BACKLOG)) {
+            IpcRequest request;
+
+            memcpy64(&request, client->input + offset, sizeof(request));
+            if ((request.magic != IPC_MAGIC)
+                || (request.length < 0) || (request.length > IPC_QUERY_MAX)) {
+                error("Invalid request received on %s.\n", ipc_socket.name);
+                return false;
+            }
+            if ((client->input_length - offset)
+                < (SIZEOF(request) + request.length)) {
+                break;
+            }
+            ipc_daemon_handle(client, &request,
+                              client->input + offset + SIZEOF(request));
+            offset += SIZEOF(request) + request.length;
+        }
+        memmove64(client->input, client->input + offset,
+                  client->input_length - offset);
+        client->input_length -= offset;
+
+        if (client->eof
+            || (client->queued >= IPC_CLIENT_BACKLOG)) {
+            return true;
+        }
+
+        r = read64(client->fd, client->input + client->input_length,
+                   SIZEOF(client->input) - client->input_length);
+        if (r < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            error("Error accepting connection on %s: %s.\n",
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return true;
+            }
+            error("Error reading from %s: %s.\n",
                   ipc_socket.name, strerror(errno));
-            continue;
+            return false;
         }
+        if (r == 0) {
+            /* End of file is how a client says it is done. */
+            client->eof = true;
+            if (client->input_length > 0) {
+                error("Peer closed %s in the middle of a request.\n",
+                      ipc_socket.name);
+                return false;
+            }
+            return true;
+        }
+        client->input_length += (int32)r;
+    }
+}
 
-        ipc_set_close_on_exec(client_fd, ipc_socket.name);
-        ipc_set_socket_timeout(client_fd, ipc_socket.name);
-        if (!ipc_read_all(client_fd, &request, sizeof(request),
-                          ipc_socket.name)) {
-            XCLOSE(&client_fd, ipc_socket.name);
-            continue;
+void
+ipc_daemon_handle(IpcClient *client, IpcRequest *request, char *payload) {
+    DEBUG_PRINT("%d, %u", request->command, request->request_id)
+    IpcResponse response;
+    HistoryView *view = NULL;
+    int64 built;
+    int64 start = 0;
+    int64 listed = 0;
+    int32 header;
+    int32 pass = -1;
+    int32 status = IPC_OK;
+
+    if (request->command == COMMAND_SAVE) {
+        if (ipc_daemon_history_save(client, request->request_id)) {
+            client->pending_saves += 1;
+        } else {
+            ipc_daemon_queue(client, request->request_id, IPC_ERROR, NULL, 0);
+        }
+        return;
+    }
+    if (request->command == COMMAND_SUBSCRIBE) {
+        if (!client->subscribed) {
+            client->subscribed = true;
+            ipc_nsubscribers += 1;
         }
+        client->subscription = request->request_id;
+        ipc_daemon_queue(client, request->request_id, IPC_OK, NULL, 0);
+        return;
+    }
 
+    /* The header is written first and patched once the length of the
+     * response is known, the response is built in place. */
+    ipc_daemon_queue(client, request->request_id, IPC_OK, NULL, 0);
+    header = client->output.len - SIZEOF(response);
+
+    /* Listings are read from a view, the history lock is only held
+     * while getting and releasing it. */
+    switch (request->command) {
+    case COMMAND_PRINT:
+        view = history_view_acquire();
+        if ((request->limit > 0) && (view->listing.len <= 0)) {
+            /* Formatting a page does not wait for the whole listing,
+             * a picker gets its first screen in constant time. */
+            status = ipc_daemon_print_page(&client->output, view,
+                                           request->id, request->limit);
+        } else if ((status = ipc_daemon_print_entries(view)) == IPC_OK) {
+            int32 first = request->id;
+            int32 count = request->limit;
+
+            ipc_daemon_page(view, &first, &count);
+            start = view->listing_offsets[first];
+            listed = view->listing_offsets[first + count] - start;
+        }
+        break;
+    case COMMAND_INFO:
+        view = history_view_acquire();
+        if (request->flags & IPC_FLAG_PASS_FD) {
+            status = ipc_daemon_pass_id(&client->output, view,
+                                        request->id, &pass);
+        } else {
+            status = ipc_daemon_print_id(&client->output, view, request->id);
+        }
+        history_view_release(view);
+        break;
+    case COMMAND_LIST:
+        view = history_view_acquire();
+        status = ipc_daemon_list(&client->output, view,
+                                 request->id, request->limit);
+        history_view_release(view);
+        break;
+    case COMMAND_SEARCH:
+        view = history_view_acquire();
+        status = ipc_daemon_search(&client->output, view, payload,
+                                   request->length, request->limit);
+        history_view_release(view);
+        break;
+    case COMMAND_FUZZY:
+        view = history_view_acquire();
+        status = ipc_daemon_fuzzy(client, view, payload,
+                                  request->length, request->limit);
+        history_view_release(view);
+        break;
+    case COMMAND_COPY:
+        xpthread_mutex_lock(&lock);
+        history_recover(request->id);
+        xpthread_mutex_unlock(&lock);
+        break;
+    case COMMAND_REMOVE:
         xpthread_mutex_lock(&lock);
+        history_remove(request->id);
+        xpthread_mutex_unlock(&lock);
+        break;
+    case COMMAND_STATS:
+        xpthread_mutex_lock(&lock);
+        status = ipc_daemon_print_stats(&client->output);
+        xpthread_mutex_unlock(&lock);
+        break;
+    default:
+        error("Invalid command received: '%c'\n", request->command);
+        status = IPC_ERROR;
+        break;
+    }
 
-        switch (request.command) {
-        case COMMAND_PRINT:
-            ipc_daemon_pipe_entries(client_fd);
-            break;
-        case COMMAND_SAVE:
-            ipc_daemon_history_save(client_fd);
-            break;
-        case COMMAND_COPY:
-            history_recover(request.id);
-            break;
-        case COMMAND_REMOVE:
-            history_remove(request.id);
-            break;
-        case COMMAND_INFO:
-            ipc_daemon_pipe_id(client_fd, request.id);
-            break;
-        default:
-            error("Invalid command received: '%c'\n", request.command);
-            break;
+    built = client->output.len - header - SIZEOF(response);
+    if (built > 0) {
+        ipc_daemon_push(client, NULL, 0, built);
+    }
+    if (pass >= 0) {
+        ipc_daemon_attach(client, pass, SIZEOF(response) + built);
+    }
+    if (request->command == COMMAND_PRINT) {
+        /* The part keeps the reference until the listing is sent. */
+        if (listed > 0) {
+            ipc_daemon_push(client, view, start, listed);
+        } else {
+            history_view_release(view);
         }
+    }
 
-        xpthread_mutex_unlock(&lock);
-        XCLOSE(&client_fd, ipc_socket.name);
+    response.request_id = request->request_id;
+    response.status = status;
+    response.length = built + listed;
+    memcpy64(client->output.data + header, &response, sizeof(response));
+    return;
+}
+
+void
+ipc_daemon_queue(IpcClient *client, uint32 request_id, int32 status,
+                 char *data, int64 length) {
+    DEBUG_PRINT("%d, %u, %d, %lld", client->fd, request_id, status, length)
+    IpcResponse response;
+
+    response.request_id = request_id;
+    response.status = status;
+    response.length = length;
+    sb_append(&client->output, (char *)&response, SIZEOF(response));
+    if (length > 0) {
+        sb_append(&client->output, data, (int32)length);
     }
+    ipc_daemon_push(client, NULL, 0, SIZEOF(response) + length);
+    return;
 }
 
 void
-ipc_client_speak(int32 command, int32 id) {
-    DEBUG_PRINT("%d, %d", command, id)
+ipc_daemon_push(IpcClient *client, HistoryView *view,
+                int64 start, int64 length) {
+    IpcPart *last = NULL;
+
+    if (client->queued <= 0) {
+        time_monotonic_precise(&client->progress);
+    }
+    client->queued += length;
+
+    if (client->nparts > client->part) {
+        last = &client->parts[client->nparts - 1];
+    }
+    if ((view == NULL) && (last != NULL) && (last->view == NULL)) {
+        last->length += length;
+        return;
+    }
+
+    last = ipc_daemon_part(client);
+    last->view = view;
+    last->start = start;
+    last->length = length;
+    return;
+}
+
+IpcPart *
+ipc_daemon_part(IpcClient *client) {
+    IpcPart *part;
+
+    if (client->nparts >= client->parts_capacity) {
+        int32 capacity = MAX(8, client->parts_capacity*2);
+        client->parts = realloc2(client->parts, client->parts_capacity,
+                                 capacity, SIZEOF(*client->parts));
+        client->parts_capacity = capacity;
+    }
+    part = &client->parts[client->nparts];
+    client->nparts += 1;
+    memset64(part, 0, sizeof(*part));
+    part->fd = -1;
+    return part;
+}
+
+/* The last length bytes queued get fd, which needs them to start a part
+ * of their own, since it goes with the first byte of a part. */
+void
+ipc_daemon_attach(IpcClient *client, int32 fd, int64 length) {
+    IpcPart *last = &client->parts[client->nparts - 1];
+
+    if (last->length > length) {
+        last->length -= length;
+        last = ipc_daemon_part(client);
+        last->length = length;
+    }
+    last->fd = fd;
+    return;
+}
+
+bool
+ipc_daemon_flush(IpcClient *client) {
+    DEBUG_PRINT("%d", client->fd)
+
+    /* Everything queued goes out in one writev, a listing of any size
+     * takes as many calls as the socket buffer needs, not one per
+     * entry. */
+    while (client->queued > 0) {
+        struct iovec iov[IPC_CLIENT_IOVECS];
+        char *bytes = client->output.data + client->output_sent;
+        IpcPart *first = &client->parts[client->part];
+        int32 niov = 0;
+        int64 w;
+
+        for (int32 i = client->part;
+             (i < client->nparts) && (niov < LENGTH(iov)); i += 1) {
+            IpcPart *part = &client->parts[i];
+            int64 skip = (i == client->part) ? client->part_sent : 0;
+
+            /* A descriptor has to be sent with the first byte of a
+             * write. */
+            if ((i > client->part) && (part->fd >= 0)) {
+                break;
+            }
+
+            if (part->view != NULL) {
+                iov[niov].iov_base = part->view->listing.data
+                                     + part->start + skip;
+            } else {
+                iov[niov].iov_base = bytes + skip;
+                bytes += part->length;
+            }
+            iov[niov].iov_len = (size_t)(part->length - skip);
+            niov += 1;
+        }
+
+        if ((first->fd >= 0) && (client->part_sent == 0)) {
+            struct msghdr message = {0};
+            struct cmsghdr *control;
+            union {
+                char buffer[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+            } rights;
+
+            memset64(&rights, 0, sizeof(rights));
+            message.msg_iov = iov;
+            message.msg_iovlen = (size_t)niov;
+            message.msg_control = rights.buffer;
+            message.msg_controllen = sizeof(rights.buffer);
+            control = CMSG_FIRSTHDR(&message);
+            control->cmsg_level = SOL_SOCKET;
+            control->cmsg_type = SCM_RIGHTS;
+            control->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy64(CMSG_DATA(control), &first->fd, sizeof(int));
+
+            if ((w = sendmsg(client->fd, &message, 0)) > 0) {
+                XCLOSE(&first->fd);
+            }
+        } else {
+            w = writev(client->fd, iov, niov);
+        }
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (errno == EPIPE) {
+                error("Peer closed %s before clipsim finished writing.\n",
+                      ipc_socket.name);
+            } else {
+                error("Error writing to %s: %s.\n",
+                      ipc_socket.name, strerror(errno));
+            }
+            return false;
+        }
+        client->queued -= w;
+        time_monotonic_precise(&client->progress);
+
+        while (w > 0) {
+            IpcPart *part = &client->parts[client->part];
+            int64 left = part->length - client->part_sent;
+
+            if (w < left) {
+                client->part_sent += w;
+                break;
+            }
+            w -= left;
+            if (part->view != NULL) {
+                history_view_release(part->view);
+            } else {
+                client->output_sent += part->length;
+            }
+            client->part += 1;
+            client->part_sent = 0;
+        }
+    }
+
+    /* Do not keep a large answer around for a client that sits idle. */
+    if (client->output.cap > BUFSIZ) {
+        sb_free(&client->output);
+    } else {
+        sb_clear(&client->output);
+    }
+    client->output_sent = 0;
+    client->nparts = 0;
+    client->part = 0;
+    client->part_sent = 0;
+    return true;
+}
+
+bool
+ipc_daemon_stalled(IpcClient *client) {
+    struct timespec now;
+
+    if (client->queued <= 0) {
+        return false;
+    }
+
+    time_monotonic_precise(&now);
+    if (timediff(client->progress, now) < IPC_SOCKET_TIMEOUT_SECONDS) {
+        return false;
+    }
+    error("Client on %s stopped reading, closing the connection.\n",
+          ipc_socket.name);
+    return true;
+}
+
+void
+ipc_client_speak(int32 command, int32 id, int32 limit, char *query) {
+    DEBUG_PRINT("%d, %d, %d, %p", command, id, limit, (void *)query)
     IpcRequest request;
+    IpcResponse response;
+    int32 length = 0;
+    int32 passed = -1;
     int32 fd;
 
+    if (query != NULL) {
+        if ((length = strlen32(query)) > IPC_QUERY_MAX) {
+            error("Query is longer than %d bytes.\n", IPC_QUERY_MAX);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if ((fd = ipc_connect_socket(false)) < 0) {
         fatal(EXIT_FAILURE);
     }
-    if (!ipc_set_socket_timeout(fd, ipc_socket.name)) {
+    /* A subscription waits for changes for as long as it takes. */
+    if ((command != COMMAND_SUBSCRIBE)
+        && !ipc_set_socket_timeout(fd, ipc_socket.name)) {
         XCLOSE(&fd, ipc_socket.name);
         fatal(EXIT_FAILURE);
     }
 
+    request.magic = IPC_MAGIC;
     request.command = command;
     request.id = id;
-    if (!ipc_write_all(fd, &request, sizeof(request), ipc_socket.name)) {
+    request.request_id = 1;
+    request.limit = limit;
+    request.length = length;
+    request.flags = (command == COMMAND_INFO) ? IPC_FLAG_PASS_FD : 0;
+    request.padding = 0;
+    if (!ipc_write_all(fd, &request, sizeof(request), ipc_socket.name)
+        || !ipc_write_all(fd, query, length, ipc_socket.name)) {
         XCLOSE(&fd, ipc_socket.name);
         fatal(EXIT_FAILURE);
     }
+    ipc_shutdown_response(fd, ipc_socket.name);
+
+    if (!ipc_client_read_response(fd, &response, &passed)
+        || (response.request_id != request.request_id)
+        || (response.length < 0)) {
+        error("Invalid response from %s.\n", ipc_socket.name);
+        XCLOSE(&fd, ipc_socket.name);
+        exit(EXIT_FAILURE);
+    }
 
     switch (command) {
     case COMMAND_PRINT:
-        ipc_client_print_entries(&fd);
+    case COMMAND_INFO:
+    case COMMAND_STATS:
+    case COMMAND_SEARCH:
+    case COMMAND_FUZZY:
+        if (response.status != IPC_OK) {
+            XCLOSE(&fd, ipc_socket.name);
+            exit(EXIT_FAILURE);
+        }
+        ipc_client_print_entries(&fd, response.length, passed);
+        break;
+    case COMMAND_LIST:
+        if (response.status != IPC_OK) {
+            XCLOSE(&fd, ipc_socket.name);
+            exit(EXIT_FAILURE);
+        }
+        ipc_client_write_raw(&fd, response.length);
         break;
     case COMMAND_SAVE:
-        ipc_client_check_save(&fd);
+        ipc_client_check_save(&fd, response.length);
         break;
+    case COMMAND_SUBSCRIBE:
+        ipc_client_subscribe(&fd, request.request_id);
     case COMMAND_COPY:
     case COMMAND_REMOVE:
         break;
-    case COMMAND_INFO:
-        ipc_client_print_entries(&fd);
-        break;
     default:
         error("Invalid command: %d\n", command);
         XCLOSE(&fd, ipc_socket.name);
@@ -428,28 +1166,153 @@ ipc_client_speak(int32 command, int32 id) {
     return;
 }
 
-void
-ipc_daemon_history_save(int32 fd) {
-    DEBUG_PRINT("%d", fd)
-    char saved;
-    int64 saved_size = sizeof(*(&saved));
+bool
+ipc_daemon_history_save(IpcClient *client, uint32 request_id) {
+    DEBUG_PRINT("%d, %u", client->fd, request_id)
+    IpcSaveReply *reply;
 
+    /* The client is found again by serial, its slot and file descriptor
+     * may belong to someone else by the time the save is done. */
     error("Trying to save history...\n");
-    saved = (char)history_save();
+    reply = malloc2(sizeof(*reply));
+    reply->serial = client->serial;
+    reply->request_id = request_id;
+    if (history_save_async(ipc_daemon_history_saved, reply)) {
+        return true;
+    }
 
-    ipc_write_all(fd, &saved, saved_size, ipc_socket.name);
-    ipc_shutdown_response(fd, ipc_socket.name);
+    error("Too many pending saves.\n");
+    free2(reply, sizeof(*reply));
+    return false;
+}
+
+void
+ipc_daemon_history_saved(void *data, bool saved) {
+    IpcSaveReply *reply = data;
+    char byte = 0;
+
+    xpthread_mutex_lock(&ipc_saves_lock);
+    if (ipc_nsaves >= ipc_saves_capacity) {
+        int32 capacity = MAX(8, ipc_saves_capacity*2);
+        ipc_saves = realloc2(ipc_saves, ipc_saves_capacity, capacity,
+                             SIZEOF(*ipc_saves));
+        ipc_saves_capacity = capacity;
+    }
+    reply->status = saved ? IPC_OK : IPC_ERROR;
+    ipc_saves[ipc_nsaves] = *reply;
+    ipc_nsaves += 1;
+    xpthread_mutex_unlock(&ipc_saves_lock);
+    free2(reply, sizeof(*reply));
+
+    /* A full pipe already means the ipc thread will look. */
+    if ((write64(ipc_wake[1], &byte, 1) < 0)
+        && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        error("Error waking ipc thread: %s.\n", strerror(errno));
+    }
     return;
 }
 
 void
-ipc_client_check_save(int32 *fd) {
-    DEBUG_PRINT("%d", *fd)
+ipc_daemon_deliver_saves(void) {
+    DEBUG_PRINT("void")
+
+    xpthread_mutex_lock(&ipc_saves_lock);
+    for (int32 i = 0; i < ipc_nsaves; i += 1) {
+        IpcSaveReply *reply = &ipc_saves[i];
+        char result = (char)(reply->status == IPC_OK);
+
+        for (int32 c = 0; c < ipc_nclients; c += 1) {
+            IpcClient *client = &ipc_clients[c];
+
+            if (client->serial == reply->serial) {
+                ipc_daemon_queue(client, reply->request_id, reply->status,
+                                 &result, SIZEOF(result));
+                client->pending_saves -= 1;
+                break;
+            }
+        }
+    }
+    ipc_nsaves = 0;
+    xpthread_mutex_unlock(&ipc_saves_lock);
+    return;
+}
+
+void
+ipc_daemon_history_event(int32 op, int32 id, Entry *e) {
+    IpcEvent event;
+    char buffer[TRIMMED_SIZE + 1];
+    char *preview = e->preview;
+    char byte = 0;
+
+    if (ipc_nsubscribers <= 0) {
+        return;
+    }
+
+    event.hash = e->hash;
+    event.op = op;
+    event.id = id;
+    event.kind = e->kind;
+    event.length = e->content_length;
+    event.padding = 0;
+    if (preview != NULL) {
+        event.trimmed_length = e->preview_length;
+    } else {
+        preview = buffer;
+        event.trimmed_length = content_trim_spaces(buffer, e->content,
+                                                   e->content_length);
+    }
+
+    xpthread_mutex_lock(&ipc_events_lock);
+    sb_append(&ipc_events, (char *)&event, SIZEOF(event));
+    sb_append(&ipc_events, preview, event.trimmed_length);
+    xpthread_mutex_unlock(&ipc_events_lock);
+
+    if ((write64(ipc_wake[1], &byte, 1) < 0)
+        && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        error("Error waking ipc thread: %s.\n", strerror(errno));
+    }
+    return;
+}
+
+void
+ipc_daemon_deliver_events(void) {
+    DEBUG_PRINT("void")
+    StrBuilder events;
+
+    xpthread_mutex_lock(&ipc_events_lock);
+    events = ipc_events;
+    sb_init(&ipc_events);
+    xpthread_mutex_unlock(&ipc_events_lock);
+
+    for (int32 offset = 0; offset < events.len;) {
+        IpcEvent event;
+        int32 length;
+
+        memcpy64(&event, events.data + offset, sizeof(event));
+        length = SIZEOF(event) + event.trimmed_length;
+        for (int32 c = 0; c < ipc_nclients; c += 1) {
+            IpcClient *client = &ipc_clients[c];
+
+            if (client->subscribed) {
+                ipc_daemon_queue(client, client->subscription, IPC_OK,
+                                 events.data + offset, length);
+            }
+        }
+        offset += length;
+    }
+    sb_free(&events);
+    return;
+}
+
+void
+ipc_client_check_save(int32 *fd, int64 length) {
+    DEBUG_PRINT("%d, %lld", *fd, length)
     char saved = 0;
 
     error("Trying to save history...\n");
 
-    if (ipc_read_all(*fd, &saved, sizeof(*(&saved)), ipc_socket.name)) {
+    if ((length == SIZEOF(saved))
+        && ipc_read_all(*fd, &saved, sizeof(*(&saved)), ipc_socket.name)) {
         if (saved) {
             error("History saved to disk.\n");
         } else {
@@ -466,82 +1329,358 @@ ipc_client_check_save(int32 *fd) {
     return;
 }
 
-void
-ipc_daemon_pipe_entries(int32 fd) {
-    DEBUG_PRINT("%d", fd)
+int32
+ipc_daemon_print_entries(HistoryView *view) {
+    DEBUG_PRINT("%p", (void *)view)
+    StrBuilder *response = &view->listing;
 
-    if (history_length <= 0) {
+    if (view->snapshot.length <= 0) {
         error("Clipboard history empty. Start copying text.\n");
-        ipc_shutdown_response(fd, ipc_socket.name);
-        return;
+        return IPC_ERROR;
+    }
+    /* Built by the first listing of this view, reused until the history
+     * changes. */
+    if (response->len > 0) {
+        return IPC_OK;
     }
 
-    for (int32 i = history_length - 1; i >= 0; i -= 1) {
-        Entry *e = &clipsim_entries[i];
-        int64 size = e->trimmed_length + 1;
-        char *trimmed = &e->content[e->trimmed];
+    /* listing_offsets[p] is where the p-th newest entry starts, so that
+     * pages are cut from the listing without scanning it. */
+    view->listing_offsets = malloc2((view->snapshot.length + 1)
+                                    *SIZEOF(*view->listing_offsets));
+    for (int32 i = view->snapshot.length - 1; i >= 0; i -= 1) {
+        view->listing_offsets[view->snapshot.length - 1 - i] = response->len;
+        ipc_daemon_print_entry(response, &view->snapshot.entries[i], i);
+    }
+    view->listing_offsets[view->snapshot.length] = response->len;
+    return IPC_OK;
+}
 
-        if (!ipc_daemon_dprintf(fd, ipc_socket.name,
-                                "%.*d ", PRINT_DIGITS, i)) {
-            break;
+int32
+ipc_daemon_print_page(StrBuilder *response, HistoryView *view,
+                      int32 first, int32 count) {
+    DEBUG_PRINT("%p, %p, %d, %d", (void *)response, (void *)view,
+                first, count)
+
+    if (view->snapshot.length <= 0) {
+        error("Clipboard history empty. Start copying text.\n");
+        return IPC_ERROR;
+    }
+
+    ipc_daemon_page(view, &first, &count);
+    for (int32 p = first; p < (first + count); p += 1) {
+        int32 i = view->snapshot.length - 1 - p;
+
+        ipc_daemon_print_entry(response, &view->snapshot.entries[i], i);
+    }
+    return IPC_OK;
+}
+
+void
+ipc_daemon_print_entry(StrBuilder *response, Entry *e, int32 index) {
+    sb_printf(response, "%.*d ", PRINT_DIGITS, index);
+    if (e->preview != NULL) {
+        sb_append(response, e->preview, e->preview_length + 1);
+    } else {
+        /* Evicted while the view was being copied. */
+        char buffer[TRIMMED_SIZE + 1];
+        int32 n = content_trim_spaces(buffer, e->content, e->content_length);
+
+        sb_append(response, buffer, n + 1);
+    }
+    return;
+}
+
+int32
+ipc_daemon_list(StrBuilder *response, HistoryView *view,
+                int32 first, int32 count) {
+    DEBUG_PRINT("%p, %p, %d, %d", (void *)response, (void *)view,
+                first, count)
+
+    ipc_daemon_page(view, &first, &count);
+    for (int32 p = first; p < (first + count); p += 1) {
+        int32 i = view->snapshot.length - 1 - p;
+        Entry *e = &view->snapshot.entries[i];
+        char buffer[TRIMMED_SIZE + 1];
+        char *preview = e->preview;
+        IpcEntry header;
+
+        header.hash = e->hash;
+        header.id = i;
+        header.kind = e->kind;
+        header.length = e->content_length;
+        if (preview != NULL) {
+            header.trimmed_length = e->preview_length;
+        } else {
+            /* Evicted while the view was being copied. */
+            preview = buffer;
+            header.trimmed_length = content_trim_spaces(buffer, e->content,
+                                                        e->content_length);
         }
-        if (!ipc_write_all(fd, trimmed, size, ipc_socket.name)) {
+        sb_append(response, (char *)&header, SIZEOF(header));
+        sb_append(response, preview, header.trimmed_length);
+    }
+    return IPC_OK;
+}
+
+void
+ipc_daemon_page(HistoryView *view, int32 *first, int32 *count) {
+    int32 length = view->snapshot.length;
+
+    *first = MAX(0, MIN(*first, length));
+    if ((*count <= 0) || (*count > (length - *first))) {
+        *count = length - *first;
+    }
+    return;
+}
+
+int32
+ipc_daemon_search(StrBuilder *response, HistoryView *view,
+                  char *query, int32 length, int32 limit) {
+    DEBUG_PRINT("%p, %p, %.*s, %d", (void *)response, (void *)view,
+                length, query, limit)
+    int32 found = 0;
+
+    /* Image entries hold the name of the image file, which is not what
+     * anyone searches for. */
+    for (int32 i = view->snapshot.length - 1; i >= 0; i -= 1) {
+        Entry *e = &view->snapshot.entries[i];
+
+        if ((e->kind == CLIPBOARD_IMAGE)
+            || !search_find(e->content, e->content_length, query, length)) {
+            continue;
+        }
+        ipc_daemon_print_entry(response, e, i);
+        found += 1;
+        if (found == limit) {
             break;
         }
     }
+    return IPC_OK;
+}
+
+int32
+ipc_daemon_fuzzy(IpcClient *client, HistoryView *view,
+                 char *query, int32 length, int32 limit) {
+    DEBUG_PRINT("%d, %p, %.*s, %d", client->fd, (void *)view,
+                length, query, limit)
+    int32 *top;
+    int32 n;
+
+    if (limit <= 0) {
+        limit = FUZZY_DEFAULT_LIMIT;
+    }
+    if ((limit = MIN(limit, view->snapshot.length)) <= 0) {
+        return IPC_OK;
+    }
 
-    ipc_shutdown_response(fd, ipc_socket.name);
-    return;
+    top = malloc2(limit*SIZEOF(*top));
+    n = fuzzy_rank(&client->fuzzy, view, query, length, top, limit);
+    for (int32 i = 0; i < n; i += 1) {
+        ipc_daemon_print_entry(&client->output,
+                               &view->snapshot.entries[top[i]], top[i]);
+    }
+    free2(top, limit*SIZEOF(*top));
+    return IPC_OK;
 }
 
-void
-ipc_daemon_pipe_id(int32 fd, int32 id) {
-    DEBUG_PRINT("%d, %d", fd, id)
+int32
+ipc_daemon_print_id(StrBuilder *response, HistoryView *view, int32 id) {
+    DEBUG_PRINT("%p, %p, %d", (void *)response, (void *)view, id)
     Entry *e;
-    int64 tag_size = sizeof(*(&IMAGE_TAG));
 
-    if (history_length <= -1) {
+    if (view->snapshot.length <= 0) {
         error("Clipboard history empty. Start copying text.\n");
-        ipc_daemon_dprintf(fd, ipc_socket.name,
-                           "000 Clipboard history empty. "
-                           "Start copying text.\n");
-        ipc_shutdown_response(fd, ipc_socket.name);
-        return;
+        sb_printf(response, "000 Clipboard history empty. "
+                            "Start copying text.\n");
+        return IPC_OK;
     }
 
     if (id < 0) {
-        id = history_length + id;
+        id = view->snapshot.length + id;
     }
-    if ((id >= history_length) || (id < 0)) {
+    if ((id >= view->snapshot.length) || (id < 0)) {
         error("Invalid index: %d\n", id);
-        ipc_shutdown_response(fd, ipc_socket.name);
-        return;
+        return IPC_ERROR;
     }
 
-    e = &clipsim_entries[id];
-    if (is_image[id]) {
-        if (!ipc_write_all(fd, &IMAGE_TAG, tag_size, ipc_socket.name)) {
-            return;
-        }
+    e = &view->snapshot.entries[id];
+    if (e->kind == CLIPBOARD_IMAGE) {
+        sb_append_byte(response, IMAGE_TAG);
     } else {
-        if (!ipc_daemon_dprintf(fd, ipc_socket.name,
-                                "Length: \033[31;1m%d\n\033[0;m",
-                                e->content_length)) {
-            return;
+        sb_printf(response, "Length: \033[31;1m%d\n\033[0;m",
+                  e->content_length);
+    }
+    sb_append(response, e->content, e->content_length);
+    return IPC_OK;
+}
+
+int32
+ipc_daemon_pass_id(StrBuilder *response, HistoryView *view,
+                   int32 id, int32 *fd) {
+    DEBUG_PRINT("%p, %p, %d", (void *)response, (void *)view, id)
+    Entry *e;
+
+    if (id < 0) {
+        id = view->snapshot.length + id;
+    }
+    /* Errors, and the message for an empty history, are answered as
+     * usual. */
+    if ((id >= view->snapshot.length) || (id < 0)) {
+        return ipc_daemon_print_id(response, view, id);
+    }
+
+    e = &view->snapshot.entries[id];
+    if (e->kind == CLIPBOARD_IMAGE) {
+        *fd = open(e->content, O_RDONLY | O_CLOEXEC);
+    } else {
+        *fd = ipc_daemon_memfd(e->content, e->content_length);
+    }
+    if (*fd < 0) {
+        return ipc_daemon_print_id(response, view, id);
+    }
+
+    if (e->kind == CLIPBOARD_IMAGE) {
+        sb_append_byte(response, IMAGE_TAG);
+    } else {
+        sb_printf(response, "Length: \033[31;1m%d\n\033[0;m",
+                  e->content_length);
+    }
+    return IPC_OK;
+}
+
+/* A copy of data in memory that the receiver can map, but nobody can
+ * change.  Returns -1 where there are no sealed memfds. */
+int32
+ipc_daemon_memfd(char *data, int32 length) {
+#if IPC_MEMFD
+    int32 fd;
+
+    if ((fd = memfd_create("clipsim-entry",
+                           MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+        error("Error creating memfd: %s.\n", strerror(errno));
+        return -1;
+    }
+    if (!ipc_write_all(fd, data, length, "memfd")
+        || (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                                   | F_SEAL_WRITE | F_SEAL_SEAL) < 0)) {
+        error("Error sealing memfd: %s.\n", strerror(errno));
+        XCLOSE(&fd, "memfd");
+        return -1;
+    }
+    return fd;
+#else
+    (void)data;
+    (void)length;
+    return -1;
+#endif
+}
+
+int32
+ipc_daemon_print_stats(StrBuilder *response) {
+    DEBUG_PRINT("%p", (void *)response)
+    char buffer[BUFSIZ];
+    int32 n;
+
+    n = SNPRINTF(buffer, "entries: %d of %d\n",
+                 clipsim_entries.length, clipsim_entries.capacity);
+    n += slab_report(&history_slabs, buffer + n, SIZEOF(buffer) - n);
+    n += snprintf2(buffer + n, SIZEOF(buffer) - n,
+                   "previews: %lld bytes of %lld\n"
+                   "mapped: %d entries, %lld bytes\n"
+                   "owner changes: %lld, %lld coalesced\n",
+                   preview_bytes, preview_limit,
+                   history_mapping_references, history_mapping_size,
+                   clipboard_owner_changes, clipboard_coalesced);
+
+    sb_append(response, buffer, n);
+    return IPC_OK;
+}
+
+bool
+ipc_client_read_response(int32 fd, IpcResponse *response, int32 *passed) {
+    struct iovec iov;
+    struct msghdr message = {0};
+    struct cmsghdr *control;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } rights;
+    int64 r;
+
+    /* A descriptor only comes with the first byte of the response. */
+    iov.iov_base = response;
+    iov.iov_len = sizeof(*response);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = rights.buffer;
+    message.msg_controllen = sizeof(rights.buffer);
+
+    do {
+        r = recvmsg(fd, &message, 0);
+    } while ((r < 0) && (errno == EINTR));
+    if (r <= 0) {
+        if (r < 0) {
+            error("Error reading from %s: %s.\n",
+                  ipc_socket.name, strerror(errno));
+        } else {
+            error("Peer closed %s before sending a response.\n",
+                  ipc_socket.name);
+        }
+        return false;
+    }
+
+    for (control = CMSG_FIRSTHDR(&message); control != NULL;
+         control = CMSG_NXTHDR(&message, control)) {
+        if ((control->cmsg_level == SOL_SOCKET)
+            && (control->cmsg_type == SCM_RIGHTS)
+            && (control->cmsg_len == CMSG_LEN(sizeof(int)))) {
+            memcpy64(passed, CMSG_DATA(control), sizeof(int));
         }
     }
-    ipc_write_all(fd, e->content, e->content_length, ipc_socket.name);
-    ipc_shutdown_response(fd, ipc_socket.name);
-    return;
+    return ipc_read_all(fd, (char *)response + r,
+                        SIZEOF(*response) - r, ipc_socket.name);
 }
 
+/* Writes the content of a passed memfd, mapped instead of read. */
 void
-ipc_client_print_entries(int32 *fd) {
+ipc_client_write_fd(int32 *fd) {
     DEBUG_PRINT("%d", *fd)
+    struct stat st;
+    char *data;
+
+    if (fstat(*fd, &st) < 0) {
+        error("Error checking passed entry: %s.\n", strerror(errno));
+        XCLOSE(fd);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, *fd, 0);
+        if (data == MAP_FAILED) {
+            error("Error mapping passed entry: %s.\n", strerror(errno));
+            XCLOSE(fd);
+            exit(EXIT_FAILURE);
+        }
+        fwrite64(data, 1, st.st_size, stdout);
+        munmap(data, (size_t)st.st_size);
+    }
+    XCLOSE(fd);
+    return;
+}
+
+void
+ipc_client_print_entries(int32 *fd, int64 length, int32 passed) {
+    DEBUG_PRINT("%d, %lld, %d", *fd, length, passed)
     static char buffer[BUFSIZ];
     int64 r;
 
-    r = read64(*fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+        XCLOSE(fd, ipc_socket.name);
+        XCLOSE(&passed);
+        return;
+    }
+
+    r = read64(*fd, buffer, MIN(length, SIZEOF(buffer)));
     if (r <= 0) {
         error("Error reading data from %s", ipc_socket.name);
         if (r < 0) {
@@ -556,31 +1695,39 @@ ipc_client_print_entries(int32 *fd) {
     if (buffer[0] != IMAGE_TAG) {
         do {
             fwrite64(buffer, 1, r, stdout);
-        } while ((r = read64(*fd, buffer, sizeof(buffer))) > 0);
+            length -= r;
+        } while ((length > 0)
+                 && ((r = read64(*fd, buffer,
+                                 MIN(length, SIZEOF(buffer)))) > 0));
         if (r < 0) {
             error("Error reading data from %s: %s.\n",
                   ipc_socket.name, strerror(errno));
             XCLOSE(fd, ipc_socket.name);
             exit(EXIT_FAILURE);
         }
+        if (passed >= 0) {
+            ipc_client_write_fd(&passed);
+        }
     } else {
         int32 test;
-        int64 image_path_length = r - 1;
+        int64 image_path_length = length - 1;
         char *CLIPSIM_IMAGE_PREVIEW;
 
-        if (r == 1) {
-            r = read64(*fd, buffer + 1, sizeof(buffer) - 1);
-            if (r <= 0) {
-                error("Error reading image name from %s.\n", ipc_socket.name);
-                goto close;
-            }
-            image_path_length = r;
-        }
         if (image_path_length >= ((int64)sizeof(buffer) - 1)) {
             error("Image path from %s is too long.\n", ipc_socket.name);
             goto close;
         }
+        if ((r < length)
+            && !ipc_read_all(*fd, buffer + r, length - r, ipc_socket.name)) {
+            error("Error reading image name from %s.\n", ipc_socket.name);
+            goto close;
+        }
         buffer[image_path_length + 1] = '\0';
+        if (passed >= 0) {
+            /* The viewer reads the passed descriptor, which it inherits,
+             * and the image is not looked up by name again. */
+            snprintf2(buffer + 1, SIZEOF(buffer) - 1, "/dev/fd/%d", passed);
+        }
 
         XCLOSE(fd, ipc_socket.name);
         if ((test = open(buffer + 1, O_RDONLY)) >= 0) {
@@ -608,6 +1755,67 @@ close:
     return;
 }
 
+/* Prints each change as the name of the operation, the id and the preview,
+ * terminated by a NUL byte like the entries of --print. */
+void
+ipc_client_subscribe(int32 *fd, uint32 request_id) {
+    DEBUG_PRINT("%d, %u", *fd, request_id)
+    static char *names[] = {
+        [JOURNAL_APPEND] = "append",
+        [JOURNAL_REORDER] = "reorder",
+        [JOURNAL_REMOVE] = "remove",
+    };
+
+    while (true) {
+        IpcResponse response;
+        IpcEvent event;
+        char preview[TRIMMED_SIZE + 1];
+
+        if (!ipc_read_all(*fd, &response, sizeof(response), ipc_socket.name)
+            || (response.request_id != request_id)
+            || (response.length < SIZEOF(event))
+            || (response.length > (SIZEOF(event) + TRIMMED_SIZE))
+            || !ipc_read_all(*fd, &event, sizeof(event), ipc_socket.name)
+            || (event.op < JOURNAL_APPEND) || (event.op > JOURNAL_REMOVE)
+            || (event.trimmed_length != (response.length - SIZEOF(event)))
+            || !ipc_read_all(*fd, preview, event.trimmed_length,
+                             ipc_socket.name)) {
+            error("Subscription to %s ended.\n", ipc_socket.name);
+            XCLOSE(fd, ipc_socket.name);
+            exit(EXIT_FAILURE);
+        }
+
+        preview[event.trimmed_length] = '\0';
+        printf("%s %.*d %s", names[event.op], PRINT_DIGITS, event.id, preview);
+        fwrite64("", 1, 1, stdout);
+        fflush(stdout);
+    }
+}
+
+void
+ipc_client_write_raw(int32 *fd, int64 length) {
+    DEBUG_PRINT("%d, %lld", *fd, length)
+    char buffer[BUFSIZ];
+
+    while (length > 0) {
+        int64 r = read64(*fd, buffer, MIN(length, SIZEOF(buffer)));
+
+        if (r <= 0) {
+            error("Error reading data from %s", ipc_socket.name);
+            if (r < 0) {
+                error(": %s", strerror(errno));
+            }
+            error(".\n");
+            XCLOSE(fd, ipc_socket.name);
+            exit(EXIT_FAILURE);
+        }
+        fwrite64(buffer, 1, r, stdout);
+        length -= r;
+    }
+    XCLOSE(fd, ipc_socket.name);
+    return;
+}
+
 int32
 ipc_connect_socket(bool quiet) {
     struct sockaddr_un addr;
@@ -711,6 +1919,465 @@ main(void) {
     (void)ipc_lock_daemon;
     (void)ipc_client_speak;
     (void)ipc_daemon_listen;
+
+    {
+        /* Several requests pipelined on one connection are answered in
+         * order, each with its own length. */
+        int32 fds[2];
+        int32 commands[] = {COMMAND_STATS, COMMAND_INFO, COMMAND_PRINT,
+                            COMMAND_INFO, COMMAND_PRINT};
+        int32 ids[] = {0, 0, 0, 5, 0};
+        IpcClient *client;
+        char *text = malloc2(ENTRY_MAX_LENGTH);
+        int32 length = snprintf2(text, ENTRY_MAX_LENGTH, "  ipc   test");
+
+        magic = magic_open(MAGIC_MIME_TYPE);
+        magic_load(magic, NULL);
+        history_init();
+        history_append(text, length, ENTRY_MAX_LENGTH);
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        for (int32 i = 0; i < LENGTH(commands); i += 1) {
+            IpcRequest request = {.magic = IPC_MAGIC, .command = commands[i],
+                                  .id = ids[i], .request_id = 100 + i};
+            ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+        }
+        ASSERT_EQUAL(shutdown(fds[0], SHUT_WR), 0);
+
+        client = ipc_daemon_accept(fds[1]);
+        ASSERT(client != NULL);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(client->eof);
+
+        /* Both listings are sent from the same cached view. */
+        ASSERT_EQUAL(client->nparts, 4);
+        ASSERT(client->parts[1].view != NULL);
+        ASSERT(client->parts[1].view == client->parts[3].view);
+        ASSERT(ipc_daemon_flush(client));
+        ASSERT_EQUAL(client->output.len, 0);
+        ipc_daemon_close(client);
+        ASSERT_EQUAL(ipc_nclients, 0);
+
+        for (int32 i = 0; i < LENGTH(commands); i += 1) {
+            IpcResponse response;
+            char buffer[BUFSIZ];
+
+            ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+            ASSERT_EQUAL(response.request_id, 100 + i);
+            ASSERT_LESS(response.length, SIZEOF(buffer));
+            ASSERT(ipc_read_all(fds[0], buffer, response.length, "test"));
+
+            switch (commands[i]) {
+            case COMMAND_STATS:
+                ASSERT_EQUAL(response.status, IPC_OK);
+                ASSERT(memmem64(buffer, response.length, "entries: 1", 10));
+                break;
+            case COMMAND_INFO:
+                if (ids[i] == 0) {
+                    ASSERT_EQUAL(response.status, IPC_OK);
+                    ASSERT(!memcmp64(buffer + response.length - length,
+                                     "  ipc   test", length));
+                } else {
+                    ASSERT_EQUAL(response.status, IPC_ERROR);
+                    ASSERT_EQUAL(response.length, 0);
+                }
+                break;
+            case COMMAND_PRINT:
+                ASSERT_EQUAL(response.status, IPC_OK);
+                ASSERT(!memcmp64(buffer, "000 ipc test", 13));
+                break;
+            default:
+                break;
+            }
+        }
+        XCLOSE(&fds[0]);
+    }
+
+    {
+        /* A client that does not read its answers only fills its own
+         * output buffer, other clients are still answered. */
+        int32 slow[2];
+        int32 fast[2];
+        IpcClient *client;
+        IpcRequest request = {.magic = IPC_MAGIC, .command = COMMAND_INFO,
+                              .id = -1, .request_id = 0};
+        IpcResponse response;
+        char buffer[BUFSIZ];
+        char *big = malloc2(ENTRY_MAX_LENGTH);
+        int64 total;
+        int64 received = 0;
+
+        memset64(big, 'a', 100000);
+        history_append(big, 100000, ENTRY_MAX_LENGTH);
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, slow), 0);
+        for (int32 i = 0; i < IPC_CLIENT_REQUESTS; i += 1) {
+            ASSERT(ipc_write_all(slow[0], &request, sizeof(request), "test"));
+        }
+        client = ipc_daemon_accept(slow[1]);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(!client->eof);
+        total = client->queued;
+        ASSERT_MORE(total, IPC_CLIENT_REQUESTS*100000);
+        ASSERT(ipc_daemon_flush(client));
+        ASSERT_POSITIVE(client->queued);
+        ASSERT_LESS(client->queued, total);
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fast), 0);
+        request.command = COMMAND_STATS;
+        ASSERT(ipc_write_all(fast[0], &request, sizeof(request), "test"));
+        ASSERT_EQUAL(shutdown(fast[0], SHUT_WR), 0);
+        {
+            IpcClient *other = ipc_daemon_accept(fast[1]);
+
+            ASSERT(ipc_daemon_read(other));
+            ASSERT(ipc_daemon_flush(other));
+            ASSERT_EQUAL(other->output.len, 0);
+            ipc_daemon_close(other);
+        }
+        ASSERT(ipc_read_all(fast[0], &response, sizeof(response), "test"));
+        ASSERT_EQUAL(response.status, IPC_OK);
+        XCLOSE(&fast[0]);
+
+        while (received < total) {
+            int64 r;
+
+            ASSERT(ipc_daemon_flush(client));
+            r = read64(slow[0], buffer, SIZEOF(buffer));
+            ASSERT_MORE(r, 0);
+            received += r;
+        }
+        ASSERT_EQUAL(received, total);
+        ASSERT_EQUAL(client->output.len, 0);
+
+        /* Saves are answered by the saver thread through ipc_wake. */
+        xpipe(ipc_wake);
+        request.command = COMMAND_SAVE;
+        request.request_id = 7;
+        ASSERT(ipc_write_all(slow[0], &request, sizeof(request), "test"));
+        ASSERT(ipc_daemon_read(client));
+        ASSERT_EQUAL(client->pending_saves, 1);
+        {
+            struct pollfd wake = {.fd = ipc_wake[0], .events = POLLIN};
+            char result = 1;
+
+            ASSERT_EQUAL(poll(&wake, 1, 10000), 1);
+            ipc_daemon_deliver_saves();
+            ASSERT_EQUAL(client->pending_saves, 0);
+            ASSERT(ipc_daemon_flush(client));
+            ASSERT(ipc_read_all(slow[0], &response, sizeof(response), "test"));
+            ASSERT_EQUAL(response.request_id, 7);
+            ASSERT_EQUAL(response.length, 1);
+            ASSERT(ipc_read_all(slow[0], &result, 1, "test"));
+            /* There is no history file to save to in this test. */
+            ASSERT_EQUAL(response.status, IPC_ERROR);
+            ASSERT_EQUAL(result, 0);
+        }
+
+        ipc_daemon_close(client);
+        XCLOSE(&slow[0]);
+        ASSERT_EQUAL(ipc_nclients, 0);
+    }
+
+    {
+        /* A page is the same whether it is formatted on its own or cut
+         * from the cached listing. */
+        int32 fds[2];
+        int32 ids[] = {1, 0, 1, 10};
+        int32 limits[] = {2, 0, 2, 2};
+        char pages[LENGTH(ids)][BUFSIZ];
+        int64 lengths[LENGTH(ids)];
+        IpcClient *client;
+
+        history_init();
+        for (int32 i = 0; i < 5; i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 length = snprintf2(text, ENTRY_MAX_LENGTH, "page %d", i);
+            history_append(text, length, ENTRY_MAX_LENGTH);
+        }
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        for (int32 i = 0; i < LENGTH(ids); i += 1) {
+            IpcRequest request = {.magic = IPC_MAGIC, .command = COMMAND_PRINT,
+                                  .id = ids[i], .request_id = (uint32)i,
+                                  .limit = limits[i]};
+            ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+        }
+        ASSERT_EQUAL(shutdown(fds[0], SHUT_WR), 0);
+
+        client = ipc_daemon_accept(fds[1]);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(ipc_daemon_flush(client));
+        ipc_daemon_close(client);
+
+        for (int32 i = 0; i < LENGTH(ids); i += 1) {
+            IpcResponse response;
+
+            ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+            ASSERT_EQUAL(response.status, IPC_OK);
+            ASSERT(ipc_read_all(fds[0], pages[i], response.length, "test"));
+            lengths[i] = response.length;
+        }
+        XCLOSE(&fds[0]);
+
+        ASSERT_EQUAL(lengths[0], 2*SIZEOF("003 page 3"));
+        ASSERT(!memcmp64(pages[0], "003 page 3", SIZEOF("003 page 3")));
+        ASSERT(!memcmp64(pages[1] + SIZEOF("004 page 4"), pages[0],
+                         lengths[0]));
+        ASSERT_EQUAL(lengths[2], lengths[0]);
+        ASSERT(!memcmp64(pages[2], pages[0], lengths[0]));
+        ASSERT_EQUAL(lengths[3], 0);
+    }
+
+    {
+        /* The binary listing has the same page, with no text to parse. */
+        int32 fds[2];
+        IpcRequest request = {.magic = IPC_MAGIC, .command = COMMAND_LIST,
+                              .id = 1, .limit = 2};
+        IpcResponse response;
+        IpcClient *client;
+        char buffer[BUFSIZ];
+        int64 expected;
+        int64 offset = 0;
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+        ASSERT_EQUAL(shutdown(fds[0], SHUT_WR), 0);
+        client = ipc_daemon_accept(fds[1]);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(ipc_daemon_flush(client));
+        ipc_daemon_close(client);
+
+        ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+        ASSERT_EQUAL(response.status, IPC_OK);
+        expected = 2*(SIZEOF(IpcEntry) + strlen32("page 3"));
+        ASSERT_EQUAL(response.length, expected);
+        ASSERT(ipc_read_all(fds[0], buffer, response.length, "test"));
+        XCLOSE(&fds[0]);
+
+        for (int32 id = 3; id >= 2; id -= 1) {
+            IpcEntry header;
+            char text[16];
+            int32 n = SNPRINTF(text, "page %d", id);
+
+            memcpy64(&header, buffer + offset, sizeof(header));
+            offset += SIZEOF(header);
+            ASSERT_EQUAL(header.id, id);
+            ASSERT_EQUAL(header.kind, CLIPBOARD_TEXT);
+            ASSERT_EQUAL(header.length, n);
+            ASSERT_EQUAL(header.trimmed_length, n);
+            ASSERT_EQUAL(header.hash, hash_function(text, n));
+            ASSERT(!memcmp64(buffer + offset, text, n));
+            offset += n;
+        }
+    }
+
+    {
+        /* Searches carry their query after the request, which may arrive
+         * in pieces. */
+        int32 fds[2];
+        char *texts[] = {"apple pie", "banana", "pineapple", "APPLE"};
+        int32 limits[] = {0, 1};
+        char query[] = "apple";
+        IpcClient *client;
+
+        history_init();
+        for (int32 i = 0; i < LENGTH(texts); i += 1) {
+            char *text = malloc2(ENTRY_MAX_LENGTH);
+            int32 length = snprintf2(text, ENTRY_MAX_LENGTH, "%s", texts[i]);
+            history_append(text, length, ENTRY_MAX_LENGTH);
+        }
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        client = ipc_daemon_accept(fds[1]);
+        for (int32 i = 0; i < LENGTH(limits); i += 1) {
+            IpcRequest request = {.magic = IPC_MAGIC,
+                                  .command = COMMAND_SEARCH,
+                                  .request_id = (uint32)i,
+                                  .limit = limits[i],
+                                  .length = strlen32(query)};
+            int64 queued = client->queued;
+
+            ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+            ASSERT(ipc_write_all(fds[0], query, 2, "test"));
+            ASSERT(ipc_daemon_read(client));
+            ASSERT_EQUAL(client->queued, queued);
+            ASSERT(ipc_write_all(fds[0], query + 2, request.length - 2,
+                                 "test"));
+            ASSERT(ipc_daemon_read(client));
+            ASSERT_MORE(client->queued, queued);
+        }
+        ASSERT(ipc_daemon_flush(client));
+
+        for (int32 i = 0; i < LENGTH(limits); i += 1) {
+            IpcResponse response;
+            char buffer[BUFSIZ];
+
+            ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+            ASSERT_EQUAL(response.status, IPC_OK);
+            ASSERT(ipc_read_all(fds[0], buffer, response.length, "test"));
+            if (limits[i] == 0) {
+                ASSERT_EQUAL(response.length, SIZEOF("002 pineapple")
+                                              + SIZEOF("000 apple pie"));
+                ASSERT(!memcmp64(buffer, "002 pineapple\0" "000 apple pie",
+                                 response.length));
+            } else {
+                ASSERT_EQUAL(response.length, SIZEOF("002 pineapple"));
+            }
+        }
+
+        /* Fuzzy queries typed on the same connection narrow down the
+         * matches of the previous one. */
+        {
+            char *queries[] = {"p", "pie", "Pie"};
+            int32 expected[] = {3, 2, 0};
+
+            for (int32 i = 0; i < LENGTH(queries); i += 1) {
+                IpcRequest request = {.magic = IPC_MAGIC,
+                                      .command = COMMAND_FUZZY,
+                                      .length = strlen32(queries[i])};
+                IpcResponse response;
+                char buffer[BUFSIZ];
+
+                ASSERT(ipc_write_all(fds[0], &request, sizeof(request),
+                                     "test"));
+                ASSERT(ipc_write_all(fds[0], queries[i], request.length,
+                                     "test"));
+                ASSERT(ipc_daemon_read(client));
+                ASSERT(ipc_daemon_flush(client));
+                ASSERT_EQUAL(client->fuzzy.ncandidates, expected[i]);
+
+                ASSERT(ipc_read_all(fds[0], &response, sizeof(response),
+                                    "test"));
+                ASSERT_EQUAL(response.status, IPC_OK);
+                ASSERT(ipc_read_all(fds[0], buffer, response.length,
+                                    "test"));
+                if (expected[i] == 2) {
+                    ASSERT_EQUAL(response.length, SIZEOF("000 apple pie")
+                                                  + SIZEOF("002 pineapple"));
+                    ASSERT(!memcmp64(buffer, "000 apple pie\0" "002 pineapple",
+                                     response.length));
+                }
+            }
+        }
+
+        /* A query longer than IPC_QUERY_MAX is not waited for. */
+        {
+            IpcRequest request = {.magic = IPC_MAGIC,
+                                  .command = COMMAND_SEARCH,
+                                  .length = IPC_QUERY_MAX + 1};
+            ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+            ASSERT(!ipc_daemon_read(client));
+        }
+        ipc_daemon_close(client);
+        XCLOSE(&fds[0]);
+    }
+
+    {
+        /* The content of --info comes in a sealed memfd, answers before
+         * and after it are not disturbed. */
+        int32 fds[2];
+        int32 commands[] = {COMMAND_STATS, COMMAND_INFO, COMMAND_STATS};
+        IpcClient *client;
+
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        for (int32 i = 0; i < LENGTH(commands); i += 1) {
+            IpcRequest request = {.magic = IPC_MAGIC, .command = commands[i],
+                                  .id = 0, .request_id = (uint32)i,
+                                  .flags = IPC_FLAG_PASS_FD};
+            ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+        }
+        ASSERT_EQUAL(shutdown(fds[0], SHUT_WR), 0);
+        client = ipc_daemon_accept(fds[1]);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(ipc_daemon_flush(client));
+        ipc_daemon_close(client);
+
+        for (int32 i = 0; i < LENGTH(commands); i += 1) {
+            IpcResponse response;
+            char buffer[BUFSIZ];
+            int32 passed = -1;
+
+            ASSERT(ipc_client_read_response(fds[0], &response, &passed));
+            ASSERT_EQUAL(response.request_id, i);
+            ASSERT_EQUAL(response.status, IPC_OK);
+            ASSERT(ipc_read_all(fds[0], buffer, response.length, "test"));
+            if (commands[i] != COMMAND_INFO) {
+                ASSERT_EQUAL(passed, -1);
+                continue;
+            }
+#if IPC_MEMFD
+            ASSERT(passed >= 0);
+            ASSERT_EQUAL(fcntl(passed, F_GET_SEALS) & F_SEAL_WRITE,
+                         F_SEAL_WRITE);
+            ASSERT_EQUAL(pread(passed, buffer, SIZEOF(buffer), 0), 9);
+            ASSERT(!memcmp64(buffer, "apple pie", 9));
+            XCLOSE(&passed);
+#else
+            ASSERT_EQUAL(passed, -1);
+            ASSERT(!memcmp64(buffer + response.length - 9, "apple pie", 9));
+#endif
+        }
+        XCLOSE(&fds[0]);
+    }
+
+    {
+        /* Subscribers get every change, with the id it refers to. */
+        int32 fds[2];
+        IpcRequest request = {.magic = IPC_MAGIC,
+                              .command = COMMAND_SUBSCRIBE,
+                              .request_id = 9};
+        IpcResponse response;
+        IpcClient *client;
+        struct pollfd wake = {.fd = ipc_wake[0], .events = POLLIN};
+        int32 ops[] = {JOURNAL_APPEND, JOURNAL_REORDER, JOURNAL_REMOVE};
+        int32 ids[] = {4, 0, 0};
+        char *previews[] = {"cherry", "apple pie", "banana"};
+        char *text = malloc2(ENTRY_MAX_LENGTH);
+        int32 length = snprintf2(text, ENTRY_MAX_LENGTH, "cherry");
+        char buffer[64];
+
+        history_listener = ipc_daemon_history_event;
+        ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        ASSERT(ipc_write_all(fds[0], &request, sizeof(request), "test"));
+        ASSERT_EQUAL(shutdown(fds[0], SHUT_WR), 0);
+        client = ipc_daemon_accept(fds[1]);
+        ASSERT(ipc_daemon_read(client));
+        ASSERT(ipc_daemon_flush(client));
+        ASSERT(client->eof && client->subscribed);
+        ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+        ASSERT_EQUAL(response.request_id, 9);
+        ASSERT_EQUAL(response.length, 0);
+
+        history_append(text, length, ENTRY_MAX_LENGTH);
+        history_reorder(0);
+        history_remove(0);
+        ASSERT_EQUAL(poll(&wake, 1, 10000), 1);
+        while (read64(ipc_wake[0], buffer, SIZEOF(buffer)) == SIZEOF(buffer)) {
+        }
+        ipc_daemon_deliver_events();
+        ASSERT(ipc_daemon_flush(client));
+
+        for (int32 i = 0; i < LENGTH(ops); i += 1) {
+            IpcEvent event;
+            int32 n = strlen32(previews[i]);
+
+            ASSERT(ipc_read_all(fds[0], &response, sizeof(response), "test"));
+            ASSERT_EQUAL(response.request_id, 9);
+            ASSERT_EQUAL(response.length, SIZEOF(event) + n);
+            ASSERT(ipc_read_all(fds[0], &event, sizeof(event), "test"));
+            ASSERT_EQUAL(event.op, ops[i]);
+            ASSERT_EQUAL(event.id, ids[i]);
+            ASSERT_EQUAL(event.trimmed_length, n);
+            ASSERT(ipc_read_all(fds[0], buffer, n, "test"));
+            ASSERT(!memcmp64(buffer, previews[i], n));
+        }
+
+        ipc_daemon_close(client);
+        ASSERT_EQUAL(ipc_nsubscribers, 0);
+        history_listener = NULL;
+        XCLOSE(&fds[0]);
+    }
     return 0;
 }
 #endif
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(JOURNAL_C)
+#define JOURNAL_C
+
+#include "cbase.h"
+#include "clipsim.h"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_journal 1
+#elif !defined(TESTING_journal)
+#define TESTING_journal 0
+#endif
+
+static bool journal_open(Journal *, char *);
+static void journal_close(Journal *);
+static bool journal_append(Journal *, int32, Entry *);
+static bool journal_next(char *, int64, int64 *, JournalRecord *, char **);
+static void journal_truncate(Journal *, int64);
+static bool journal_discard_head(Journal *, int64);
+static bool journal_write_all(int32, void *, int64);
+
+bool
+journal_open(Journal *journal, char *name) {
+    struct stat journal_stat;
+
+    journal->name = name;
+    journal->size = 0;
+    if ((journal->fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                            S_IRUSR | S_IWUSR)) < 0) {
+        error("Error opening journal %s: %s.\n", name, strerror(errno));
+        return false;
+    }
+    if (fstat(journal->fd, &journal_stat) < 0) {
+        error("Error getting information on journal %s: %s.\n",
+              name, strerror(errno));
+        XCLOSE(&journal->fd, name);
+        return false;
+    }
+    journal->size = journal_stat.st_size;
+    return true;
+}
+
+void
+journal_close(Journal *journal) {
+    if (journal->fd >= 0) {
+        XCLOSE(&journal->fd, journal->name);
+    }
+    journal->size = 0;
+    return;
+}
+
+bool
+journal_write_all(int32 fd, void *data, int64 size) {
+    int64 written = 0;
+
+    while (written < size) {
+        int64 w = write64(fd, (char *)data + written, size - written);
+
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (w == 0) {
+            errno = EIO;
+            return false;
+        }
+        written += w;
+    }
+    return true;
+}
+
+bool
+journal_append(Journal *journal, int32 op, Entry *e) {
+    DEBUG_PRINT("%d, %d, %llu, %d", op, e->kind, (ullong)e->hash,
+                e->content_length)
+    JournalRecord record = {0};
+
+    if (journal->fd < 0) {
+        return false;
+    }
+
+    record.magic = JOURNAL_MAGIC;
+    record.op = op;
+    record.kind = e->kind;
+    record.length = (op == JOURNAL_APPEND) ? e->content_length : 0;
+    record.hash = e->hash;
+    record.timestamp = e->timestamp;
+
+    if (!journal_write_all(journal->fd, &record, SIZEOF(record))
+        || !journal_write_all(journal->fd, e->content, record.length)) {
+        error("Error writing to journal %s: %s.\n",
+              journal->name, strerror(errno));
+        /* Drop the partial record so that replay does not stop here. */
+        journal_truncate(journal, journal->size);
+        return false;
+    }
+
+    journal->size += SIZEOF(record) + record.length;
+    return true;
+}
+
+bool
+journal_next(char *map, int64 size, int64 *offset,
+             JournalRecord *record, char **payload) {
+    if ((size - *offset) < SIZEOF(*record)) {
+        return false;
+    }
+
+    memcpy64(record, map + *offset, SIZEOF(*record));
+    if (record->magic != JOURNAL_MAGIC) {
+        return false;
+    }
+    if ((record->op < JOURNAL_APPEND) || (record->op > JOURNAL_REMOVE)) {
+        return false;
+    }
+    if ((record->length < 0) || (record->length >= ENTRY_MAX_LENGTH)) {
+        return false;
+    }
+    if ((size - *offset - SIZEOF(*record)) < record->length) {
+        return false;
+    }
+
+    *payload = map + *offset + SIZEOF(*record);
+    *offset += SIZEOF(*record) + record->length;
+    return true;
+}
+
+void
+journal_truncate(Journal *journal, int64 size) {
+    if (journal->fd < 0) {
+        return;
+    }
+    if (ftruncate(journal->fd, size) < 0) {
+        error("Error truncating journal %s: %s.\n",
+              journal->name, strerror(errno));
+        return;
+    }
+    journal->size = size;
+    return;
+}
+
+bool
+journal_discard_head(Journal *journal, int64 upto) {
+    char tmp_name[PATH_MAX];
+    char *map;
+    int32 fd;
+    bool written;
+
+    if (journal->fd < 0) {
+        return false;
+    }
+    if (upto <= 0) {
+        return true;
+    }
+    if (upto >= journal->size) {
+        journal_truncate(journal, 0);
+        journal->generation += 1;
+        return true;
+    }
+
+    /* Records were appended while the snapshot was being written.  Only
+     * those are kept, moved to a new file that replaces the journal. */
+    SNPRINTF(tmp_name, "%s.tmp", journal->name);
+    if ((fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        error("Error opening %s: %s.\n", tmp_name, strerror(errno));
+        return false;
+    }
+
+    map = mmap(NULL, (size_t)journal->size, PROT_READ, MAP_PRIVATE,
+               journal->fd, 0);
+    if (map == MAP_FAILED) {
+        error("Error mapping journal %s: %s.\n",
+              journal->name, strerror(errno));
+        XCLOSE(&fd, tmp_name);
+        unlink(tmp_name);
+        return false;
+    }
+    written = journal_write_all(fd, map + upto, journal->size - upto);
+    munmap(map, (size_t)journal->size);
+    XCLOSE(&fd, tmp_name);
+
+    if (!written || (rename(tmp_name, journal->name) < 0)) {
+        error("Error replacing journal %s: %s.\n",
+              journal->name, strerror(errno));
+        unlink(tmp_name);
+        return false;
+    }
+
+    journal_close(journal);
+    journal->generation += 1;
+    return journal_open(journal, journal->name);
+}
+
+#if 0 == TESTING_journal
+static inline void
+journal_functions_sink(void) {
+    (void)journal_functions_sink;
+    (void)journal_open;
+    (void)journal_close;
+    (void)journal_append;
+    (void)journal_next;
+    (void)journal_truncate;
+    (void)journal_discard_head;
+}
+#endif
+
+#if TESTING_journal
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+int
+main(void) {
+    Journal journal = {.fd = -1};
+    char *name = "/tmp/clipsim_test_journal";
+    char *map;
+    int64 offset = 0;
+    JournalRecord record;
+    char *payload;
+    Entry hello = {.content = "hello", .content_length = 5,
+                   .kind = CLIPBOARD_TEXT, .hash = 42, .timestamp = 1000};
+    Entry other = {.content = "x", .content_length = 1,
+                   .kind = CLIPBOARD_TEXT, .hash = 7};
+
+    unlink(name);
+    ASSERT(journal_open(&journal, name));
+    ASSERT_EQUAL(journal.size, 0);
+
+    ASSERT(journal_append(&journal, JOURNAL_APPEND, &hello));
+    ASSERT(journal_append(&journal, JOURNAL_REORDER, &hello));
+    ASSERT(journal_append(&journal, JOURNAL_REMOVE, &hello));
+    ASSERT_EQUAL(journal.size, 3*SIZEOF(record) + 5);
+
+    /* A torn record at the end is ignored. */
+    ASSERT(journal_write_all(journal.fd, &record, 3));
+    journal_close(&journal);
+    ASSERT(journal_open(&journal, name));
+    ASSERT_EQUAL(journal.size, 3*SIZEOF(record) + 5 + 3);
+
+    map = mmap(NULL, (size_t)journal.size, PROT_READ, MAP_PRIVATE,
+               journal.fd, 0);
+    ASSERT(map != MAP_FAILED);
+
+    ASSERT(journal_next(map, journal.size, &offset, &record, &payload));
+    ASSERT_EQUAL(record.op, JOURNAL_APPEND);
+    ASSERT_EQUAL(record.length, 5);
+    ASSERT_EQUAL(record.timestamp, 1000);
+    ASSERT(!memcmp64(payload, "hello", 5));
+
+    ASSERT(journal_next(map, journal.size, &offset, &record, &payload));
+    ASSERT_EQUAL(record.op, JOURNAL_REORDER);
+    ASSERT_EQUAL(record.hash, 42);
+
+    ASSERT(journal_next(map, journal.size, &offset, &record, &payload));
+    ASSERT_EQUAL(record.op, JOURNAL_REMOVE);
+
+    ASSERT(!journal_next(map, journal.size, &offset, &record, &payload));
+    ASSERT_EQUAL(offset, 3*SIZEOF(record) + 5);
+    munmap(map, (size_t)journal.size);
+
+    journal_truncate(&journal, offset);
+    ASSERT_EQUAL(journal.size, offset);
+
+    ASSERT(journal_discard_head(&journal, SIZEOF(record) + 5));
+    ASSERT_EQUAL(journal.size, 2*SIZEOF(record));
+    map = mmap(NULL, (size_t)journal.size, PROT_READ, MAP_PRIVATE,
+               journal.fd, 0);
+    offset = 0;
+    ASSERT(journal_next(map, journal.size, &offset, &record, &payload));
+    ASSERT_EQUAL(record.op, JOURNAL_REORDER);
+    munmap(map, (size_t)journal.size);
+
+    ASSERT(journal_append(&journal, JOURNAL_REMOVE, &other));
+    ASSERT_EQUAL(journal.size, 3*SIZEOF(record));
+    journal_truncate(&journal, 0);
+    ASSERT_EQUAL(journal.size, 0);
+
+    journal_close(&journal);
+    unlink(name);
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* JOURNAL_C */
@@ -9,7 +9,11 @@
 #include "clipsim.c"
 #include "history.c"
 #include "ipc.c"
+#if CLIPSIM_XCB
+#include "clipboard_xcb.c"
+#else
 #include "clipboard.c"
+#endif
 #include "xi.c"
 
 typedef struct ClipsimCommand {
@@ -19,11 +23,16 @@ typedef struct ClipsimCommand {
 } ClipsimCommand;
 
 static ClipsimCommand commands[] = {
-    [COMMAND_PRINT]  = {"-p", "--print",  "print entire history, with trimmed whitespace"},
+    [COMMAND_PRINT]  = {"-p", "--print",  "print entire history, with trimmed whitespace, or [limit] entries after the [n] newest"},
     [COMMAND_INFO]   = {"-i", "--info",   "print entry number <n>, with original whitespace"},
     [COMMAND_COPY]   = {"-c", "--copy",   "copy entry number <n>, with original whitespace"},
     [COMMAND_REMOVE] = {"-r", "--remove", "remove entry number <n>"},
     [COMMAND_SAVE]   = {"-s", "--save",   "save history to $XDG_CACHE_HOME/clipsim/history"},
+    [COMMAND_STATS]  = {"-S", "--stats",  "print daemon memory usage"},
+    [COMMAND_SEARCH] = {"-f", "--search", "print entries containing <query>, at most [limit] of them"},
+    [COMMAND_FUZZY]  = {"-z", "--fuzzy",  "print the [limit] entries that best fuzzy match <query>"},
+    [COMMAND_LIST]   = {"-l", "--list",   "like --print, in the binary format for programs described in ipc.c"},
+    [COMMAND_SUBSCRIBE] = {"-w", "--watch",  "print changes to the history as they happen"},
     [COMMAND_DAEMON] = {"-d", "--daemon", "spawn daemon (clipboard watcher and command socket)"},
     [COMMAND_HELP]   = {"-h", "--help",   "print this help message"},
 };
@@ -38,13 +47,14 @@ int32
 main(int32 argc, char *argv[]) {
     DEBUG_PRINT("%d, %s", argc, argv[0])
     int32 id;
+    int32 limit = 0;
     bool spell_error = true;
 
     program = basename(argv[0]);
 
     signal(SIGSEGV, util_segv_handler);
 
-    if (argc <= 1 || argc >= 4) {
+    if (argc <= 1 || argc >= 5) {
         main_usage(stderr);
     }
 
@@ -54,7 +64,15 @@ main(int32 argc, char *argv[]) {
             spell_error = false;
             switch (i) {
             case COMMAND_PRINT:
-                ipc_client_speak(COMMAND_PRINT, 0);
+            case COMMAND_LIST:
+                id = 0;
+                if (((argc >= 3) && (util_string_int32(&id, argv[2]) < 0))
+                    || ((argc >= 4)
+                        && (util_string_int32(&limit, argv[3]) < 0))
+                    || (id < 0) || (limit < 0)) {
+                    main_usage(stderr);
+                }
+                ipc_client_speak(i, id, limit, NULL);
                 break;
             case COMMAND_INFO:
             case COMMAND_COPY:
@@ -62,10 +80,26 @@ main(int32 argc, char *argv[]) {
                 if ((argc != 3) || util_string_int32(&id, argv[2]) < 0) {
                     main_usage(stderr);
                 }
-                ipc_client_speak(i, id);
+                ipc_client_speak(i, id, 0, NULL);
                 break;
             case COMMAND_SAVE:
-                ipc_client_speak(COMMAND_SAVE, 0);
+                ipc_client_speak(COMMAND_SAVE, 0, 0, NULL);
+                break;
+            case COMMAND_STATS:
+                ipc_client_speak(COMMAND_STATS, 0, 0, NULL);
+                break;
+            case COMMAND_SUBSCRIBE:
+                ipc_client_speak(COMMAND_SUBSCRIBE, 0, 0, NULL);
+                break;
+            case COMMAND_SEARCH:
+            case COMMAND_FUZZY:
+                if ((argc < 3)
+                    || ((argc >= 4)
+                        && (util_string_int32(&limit, argv[3]) < 0))
+                    || (limit < 0)) {
+                    main_usage(stderr);
+                }
+                ipc_client_speak(i, 0, limit, argv[2]);
                 break;
             case COMMAND_DAEMON:
                 main_launch_daemon();
@@ -127,7 +161,7 @@ main_block_middle_mouse_paste_enabled(void) {
 void
 main_usage(FILE *stream) {
     DEBUG_PRINT("%p", (void *)stream)
-    fprintf(stream, "usage: %s COMMAND [n]\n", "clipsim");
+    fprintf(stream, "usage: %s COMMAND [n|query] [limit]\n", "clipsim");
     fprintf(stream, "Available commands:\n");
     for (int32 i = 0; i < LENGTH(commands); i += 1) {
         fprintf(stream, "%s | %-*s : %s\n", commands[i].shortname, 8,
@@ -149,13 +183,17 @@ main_launch_daemon(void) {
     main_setup_daemon_signals();
 
     block_middle_mouse_paste = main_block_middle_mouse_paste_enabled();
+#if !CLIPSIM_XCB
+    /* With the XCB watcher the thread of xi.c is the only Xlib user. */
     if (block_middle_mouse_paste && !XInitThreads()) {
         error("Error initializing Xlib thread support.\n");
         exit(EXIT_FAILURE);
     }
+#endif
 
     pthread_mutex_init(&lock, NULL);
 
+    history_init();
     history_read();
 
     reopen_magic();
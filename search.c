@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(SEARCH_C)
+#define SEARCH_C
+
+#include "cbase.h"
+#include "clipsim.h"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_search 1
+#elif !defined(TESTING_search)
+#define TESTING_search 0
+#endif
+
+/* Substring search over entry contents.  Candidates are positions where
+ * both the first and the last byte of the needle match, found 16 bytes at
+ * a time with SSE2 or 8 at a time with plain 64 bit arithmetic, and only
+ * those are compared in full.  Real text rarely has both bytes match, so
+ * most of the haystack is never looked at byte by byte. */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SEARCH_SSE2 1
+#else
+#define SEARCH_SSE2 0
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SEARCH_SWAR 1
+#else
+#define SEARCH_SWAR 0
+#endif
+
+#define SEARCH_ONES 0x0101010101010101ull
+#define SEARCH_HIGHS 0x8080808080808080ull
+
+static char *search_find(char *, int64, char *, int64);
+static char *search_find_scalar(char *, int64, char *, int64, int64);
+#if SEARCH_SSE2
+static char *search_find_sse2(char *, int64, char *, int64);
+#endif
+#if SEARCH_SWAR
+static char *search_find_swar(char *, int64, char *, int64);
+#endif
+
+char *
+search_find(char *haystack, int64 length, char *needle, int64 needle_length) {
+    if (needle_length <= 0) {
+        return haystack;
+    }
+    if (needle_length > length) {
+        return NULL;
+    }
+    if (needle_length == 1) {
+        return memchr64(haystack, needle[0], length);
+    }
+
+#if SEARCH_SSE2
+    return search_find_sse2(haystack, length, needle, needle_length);
+#elif SEARCH_SWAR
+    return search_find_swar(haystack, length, needle, needle_length);
+#else
+    return search_find_scalar(haystack, length, needle, needle_length, 0);
+#endif
+}
+
+/* Checks every position from start on, for what is left after the wide
+ * loops. */
+char *
+search_find_scalar(char *haystack, int64 length,
+                   char *needle, int64 needle_length, int64 start) {
+    for (int64 i = start; i <= (length - needle_length); i += 1) {
+        if ((haystack[i] == needle[0])
+            && (haystack[i + needle_length - 1] == needle[needle_length - 1])
+            && !memcmp64(haystack + i, needle, needle_length)) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+#if SEARCH_SSE2
+char *
+search_find_sse2(char *haystack, int64 length,
+                 char *needle, int64 needle_length) {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    int64 i = 0;
+
+    for (; (i + needle_length - 1 + 16) <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128((__m128i *)(haystack + i));
+        __m128i block_last
+            = _mm_loadu_si128((__m128i *)(haystack + i + needle_length - 1));
+        uint32 mask = (uint32)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                          _mm_cmpeq_epi8(last, block_last)));
+
+        while (mask != 0) {
+            int32 bit = __builtin_ctz(mask);
+
+            if (!memcmp64(haystack + i + bit, needle, needle_length)) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_find_scalar(haystack, length, needle, needle_length, i);
+}
+#endif
+
+#if SEARCH_SWAR
+char *
+search_find_swar(char *haystack, int64 length,
+                 char *needle, int64 needle_length) {
+    uint64 first = SEARCH_ONES*(uchar)needle[0];
+    uint64 last = SEARCH_ONES*(uchar)needle[needle_length - 1];
+    int64 i = 0;
+
+    for (; (i + needle_length - 1 + 8) <= length; i += 8) {
+        uint64 block_first;
+        uint64 block_last;
+        uint64 x;
+        uint64 y;
+        uint64 mask;
+
+        memcpy64(&block_first, haystack + i, sizeof(block_first));
+        memcpy64(&block_last, haystack + i + needle_length - 1,
+                 sizeof(block_last));
+
+        /* High bit set in every byte that is zero, and possibly in bytes
+         * after one that is, which the full compare weeds out. */
+        x = block_first ^ first;
+        y = block_last ^ last;
+        mask = ((x - SEARCH_ONES) & ~x) & ((y - SEARCH_ONES) & ~y)
+               & SEARCH_HIGHS;
+
+        for (int32 byte = 0; mask != 0; byte += 1, mask >>= 8) {
+            if ((mask & 0x80)
+                && !memcmp64(haystack + i + byte, needle, needle_length)) {
+                return haystack + i + byte;
+            }
+        }
+    }
+    return search_find_scalar(haystack, length, needle, needle_length, i);
+}
+#endif
+
+#if 0 == TESTING_search
+static inline void
+search_functions_sink(void) {
+    (void)search_functions_sink;
+    (void)search_find;
+#if SEARCH_SWAR
+    (void)search_find_swar;
+#endif
+}
+#endif
+
+#if TESTING_search
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+static char *
+search_find_naive(char *haystack, int64 length,
+                  char *needle, int64 needle_length) {
+    for (int64 i = 0; i <= (length - needle_length); i += 1) {
+        if (!memcmp64(haystack + i, needle, needle_length)) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+int
+main(void) {
+    char haystack[512];
+    char needle[48];
+
+    memcpy64(haystack, "xxabc", 5);
+    ASSERT(search_find(haystack, 5, "", 0) == haystack);
+    ASSERT(search_find(haystack, 5, "abc", 3) == haystack + 2);
+    ASSERT(search_find(haystack, 5, "c", 1) == haystack + 4);
+    ASSERT_NULL(search_find(haystack, 5, "xxabcd", 6));
+
+    /* Small alphabets make partial matches, and false candidates, common.
+     * Every length and offset is compared with the obvious loop. */
+    rand_int_seed(1);
+    for (int32 round = 0; round < 20000; round += 1) {
+        int64 length = rand_int() % LENGTH(haystack);
+        int64 needle_length = 2 + (rand_int() % (LENGTH(needle) - 2));
+        int32 alphabet = 2 + (rand_int() % 3);
+        char *expected;
+
+        for (int64 i = 0; i < length; i += 1) {
+            haystack[i] = (char)('a' + (rand_int() % alphabet));
+        }
+        if ((length >= needle_length) && (rand_int() % 2)) {
+            int64 at = rand_int() % (length - needle_length + 1);
+
+            memcpy64(needle, haystack + at, needle_length);
+        } else {
+            for (int64 i = 0; i < needle_length; i += 1) {
+                needle[i] = (char)('a' + (rand_int() % alphabet));
+            }
+        }
+
+        expected = search_find_naive(haystack, length, needle, needle_length);
+        ASSERT(search_find(haystack, length, needle, needle_length)
+               == expected);
+        ASSERT(search_find_scalar(haystack, length, needle, needle_length, 0)
+               == expected);
+#if SEARCH_SSE2
+        ASSERT(search_find_sse2(haystack, length, needle, needle_length)
+               == expected);
+#endif
+#if SEARCH_SWAR
+        ASSERT(search_find_swar(haystack, length, needle, needle_length)
+               == expected);
+#endif
+    }
+
+    /* High bytes must not be taken for matches by the borrow trick. */
+    memset64(haystack, (char)0x80, LENGTH(haystack));
+    memcpy64(haystack + 300, "\x01\x7f", 2);
+    ASSERT(search_find(haystack, LENGTH(haystack), "\x01\x7f", 2)
+           == haystack + 300);
+    ASSERT_NULL(search_find(haystack, LENGTH(haystack), "\x7f\x01", 2));
+
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* SEARCH_C */
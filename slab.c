@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(SLAB_C)
+#define SLAB_C
+
+#include "cbase.h"
+#include "clipsim.h"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_slab 1
+#elif !defined(TESTING_slab)
+#define TESTING_slab 0
+#endif
+
+static void *slab_alloc(Slabs *, int32);
+static void slab_free(Slabs *, void *, int32);
+static void slab_destroy(Slabs *);
+static int32 slab_report(Slabs *, char *, int32);
+static int32 slab_class(int32);
+static int32 slab_find(SlabClass *, void *);
+static Slab *slab_with_space(SlabClass *, int32);
+static void slab_release(SlabClass *, int32);
+
+int32
+slab_class(int32 size) {
+    int32 shift = SLAB_MIN_SHIFT;
+
+    while ((1 << shift) < size) {
+        shift += 1;
+    }
+    return shift - SLAB_MIN_SHIFT;
+}
+
+int32
+slab_find(SlabClass *class, void *p) {
+    int32 low = 0;
+    int32 high = class->nslabs - 1;
+
+    while (low <= high) {
+        int32 middle = low + (high - low)/2;
+        Arena *arena = class->slabs[middle].arena;
+
+        if ((char *)p < arena->begin) {
+            high = middle - 1;
+        } else if ((char *)p >= ((char *)arena + arena->size)) {
+            low = middle + 1;
+        } else {
+            return middle;
+        }
+    }
+    return -1;
+}
+
+Slab *
+slab_with_space(SlabClass *class, int32 class_index) {
+    Slab *slab;
+    Arena *arena;
+    int32 position;
+
+    if ((class->current >= 0) && (class->current < class->nslabs)) {
+        slab = &class->slabs[class->current];
+        if (slab->live < slab->objects) {
+            return slab;
+        }
+    }
+    for (int32 i = 0; i < class->nslabs; i += 1) {
+        slab = &class->slabs[i];
+        if (slab->live < slab->objects) {
+            class->current = i;
+            return slab;
+        }
+    }
+
+    if (class->nslabs >= class->capacity) {
+        int32 capacity = MAX(8, class->capacity*2);
+        class->slabs = realloc2(class->slabs, class->capacity, capacity,
+                                SIZEOF(*class->slabs));
+        class->capacity = capacity;
+    }
+
+    if ((arena = arena_create(SLAB_ARENA_SIZE, NULL)) == NULL) {
+        error("Error creating slab for class %d: %s.\n",
+              class_index, arena_strerror(errno));
+        fatal(EXIT_FAILURE);
+    }
+
+    /* Slabs are kept sorted by address so that slab_free can find the
+     * owner of a pointer with a binary search. */
+    position = class->nslabs;
+    while ((position > 0)
+           && ((char *)class->slabs[position - 1].arena > (char *)arena)) {
+        class->slabs[position] = class->slabs[position - 1];
+        position -= 1;
+    }
+
+    slab = &class->slabs[position];
+    slab->arena = arena;
+    slab->free_list = NULL;
+    slab->live = 0;
+    slab->objects = (int32)(arena_data_size(arena) / class->object_size);
+    class->nslabs += 1;
+    class->current = position;
+    return slab;
+}
+
+void *
+slab_alloc(Slabs *slabs, int32 size) {
+    SlabClass *class;
+    Slab *slab;
+    void *p;
+    int32 class_index;
+
+    if (size > SLAB_MAX_OBJECT) {
+        slabs->large_live += 1;
+        slabs->large_bytes += size;
+        return malloc2(size);
+    }
+
+    class_index = slab_class(size);
+    class = &slabs->classes[class_index];
+    class->object_size = 1 << (class_index + SLAB_MIN_SHIFT);
+
+    slab = slab_with_space(class, class_index);
+    if ((p = slab->free_list)) {
+        slab->free_list = *(void **)p;
+    } else {
+        p = arena_push(slab->arena, class->object_size);
+    }
+
+    slab->live += 1;
+    class->live += 1;
+    class->requested += size;
+    return p;
+}
+
+void
+slab_release(SlabClass *class, int32 index) {
+    arena_destroy(class->slabs[index].arena);
+    for (int32 i = index; i < (class->nslabs - 1); i += 1) {
+        class->slabs[i] = class->slabs[i + 1];
+    }
+    class->nslabs -= 1;
+    class->current = -1;
+    return;
+}
+
+void
+slab_free(Slabs *slabs, void *p, int32 size) {
+    SlabClass *class;
+    Slab *slab;
+    int32 index;
+
+    if (p == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX_OBJECT) {
+        slabs->large_live -= 1;
+        slabs->large_bytes -= size;
+        free2(p, size);
+        return;
+    }
+
+    class = &slabs->classes[slab_class(size)];
+    if ((index = slab_find(class, p)) < 0) {
+        error("Pointer %p of size %d is not from a slab.\n", p, size);
+        fatal(EXIT_FAILURE);
+    }
+
+    slab = &class->slabs[index];
+    slab->live -= 1;
+    class->live -= 1;
+    class->requested -= size;
+
+    if (slab->live > 0) {
+        *(void **)p = slab->free_list;
+        slab->free_list = p;
+        class->current = index;
+        return;
+    }
+
+    /* Keep one empty slab per class around, so that a single entry
+     * being copied and removed in a loop does not map and unmap. */
+    if (class->nslabs > 1) {
+        slab_release(class, index);
+    } else {
+        arena_reset(slab->arena);
+        slab->free_list = NULL;
+        class->current = index;
+    }
+    return;
+}
+
+void
+slab_destroy(Slabs *slabs) {
+    for (int32 c = 0; c < SLAB_NCLASSES; c += 1) {
+        SlabClass *class = &slabs->classes[c];
+
+        for (int32 i = 0; i < class->nslabs; i += 1) {
+            arena_destroy(class->slabs[i].arena);
+        }
+        if (class->capacity > 0) {
+            free2(class->slabs, class->capacity*SIZEOF(*class->slabs));
+        }
+    }
+    memset64(slabs, 0, sizeof(*slabs));
+    return;
+}
+
+int32
+slab_report(Slabs *slabs, char *buffer, int32 size) {
+    int32 n = 0;
+    int64 total_mapped = 0;
+    int64 total_requested = 0;
+
+    n += snprintf2(buffer + n, size - n, "%8s %6s %8s %10s %10s %6s\n",
+                   "class", "slabs", "objects", "mapped", "waste", "used");
+    for (int32 c = 0; c < SLAB_NCLASSES; c += 1) {
+        SlabClass *class = &slabs->classes[c];
+        int64 mapped = (int64)class->nslabs*SLAB_ARENA_SIZE;
+        int64 used = class->live*(1 << (c + SLAB_MIN_SHIFT));
+        int64 waste = mapped - class->requested;
+
+        if (class->nslabs <= 0) {
+            continue;
+        }
+
+        total_mapped += mapped;
+        total_requested += class->requested;
+        n += snprintf2(buffer + n, size - n,
+                       "%8d %6d %8lld %10lld %10lld %5.1f%%\n",
+                       1 << (c + SLAB_MIN_SHIFT), class->nslabs,
+                       class->live, mapped, waste,
+                       100.0*(double)used / (double)mapped);
+    }
+    n += snprintf2(buffer + n, size - n,
+                   "slabs: %lld bytes mapped, %lld requested, %lld wasted\n"
+                   "large: %lld entries, %lld bytes\n",
+                   total_mapped, total_requested,
+                   total_mapped - total_requested,
+                   slabs->large_live, slabs->large_bytes);
+    return n;
+}
+
+#if 0 == TESTING_slab
+static inline void
+slab_functions_sink(void) {
+    (void)slab_functions_sink;
+    (void)slab_destroy;
+    (void)slab_report;
+}
+#endif
+
+#if TESTING_slab
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+int
+main(void) {
+    Slabs slabs = {0};
+    char *pointers[10000];
+    char report[4096];
+
+    ASSERT_EQUAL(slab_class(1), 0);
+    ASSERT_EQUAL(slab_class(1 << SLAB_MIN_SHIFT), 0);
+    ASSERT_EQUAL(slab_class((1 << SLAB_MIN_SHIFT) + 1), 1);
+    ASSERT_EQUAL(slab_class(SLAB_MAX_OBJECT), SLAB_NCLASSES - 1);
+
+    for (int32 i = 0; i < LENGTH(pointers); i += 1) {
+        int32 size = 10 + (i % 300);
+
+        pointers[i] = slab_alloc(&slabs, size);
+        memset64(pointers[i], (char)i, size);
+    }
+    for (int32 i = 0; i < LENGTH(pointers); i += 1) {
+        int32 size = 10 + (i % 300);
+
+        ASSERT_EQUAL(pointers[i][size - 1], (char)i);
+    }
+    {
+        int64 small = 0;
+
+        for (int32 i = 0; i < LENGTH(pointers); i += 1) {
+            small += ((10 + (i % 300)) <= (1 << SLAB_MIN_SHIFT));
+        }
+        ASSERT_EQUAL(slabs.classes[0].live, small);
+    }
+
+    /* Free every other object: slabs stay mapped and reuse the holes. */
+    for (int32 i = 0; i < LENGTH(pointers); i += 2) {
+        slab_free(&slabs, pointers[i], 10 + (i % 300));
+    }
+    {
+        SlabClass *class = &slabs.classes[slab_class(300)];
+        int32 nslabs = class->nslabs;
+
+        for (int32 i = 0; i < LENGTH(pointers); i += 2) {
+            pointers[i] = slab_alloc(&slabs, 10 + (i % 300));
+        }
+        ASSERT_EQUAL(class->nslabs, nslabs);
+    }
+
+    ASSERT_POSITIVE(slab_report(&slabs, report, SIZEOF(report)));
+    ASSERT(memmem64(report, strlen32(report), "wasted", 6) != NULL);
+
+    /* Freeing everything releases all but one slab per class. */
+    for (int32 i = 0; i < LENGTH(pointers); i += 1) {
+        slab_free(&slabs, pointers[i], 10 + (i % 300));
+    }
+    for (int32 c = 0; c < SLAB_NCLASSES; c += 1) {
+        ASSERT_LESS_EQUAL(slabs.classes[c].nslabs, 1);
+        ASSERT_EQUAL(slabs.classes[c].live, 0);
+        ASSERT_EQUAL(slabs.classes[c].requested, 0);
+    }
+
+    {
+        char *large = slab_alloc(&slabs, SLAB_MAX_OBJECT + 1);
+        ASSERT_EQUAL(slabs.large_live, 1);
+        slab_free(&slabs, large, SLAB_MAX_OBJECT + 1);
+        ASSERT_EQUAL(slabs.large_live, 0);
+    }
+
+    slab_destroy(&slabs);
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* SLAB_C */
@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+#if !defined(STORE_C)
+#define STORE_C
+
+#include "cbase.h"
+#include "clipsim.h"
+
+#if defined(__INCLUDE_LEVEL__) && (__INCLUDE_LEVEL__ == 0)
+#define TESTING_store 1
+#elif !defined(TESTING_store)
+#define TESTING_store 0
+#endif
+
+#define STORE_EMPTY -1
+
+static void store_init(Store *, int32);
+static void store_destroy(Store *);
+static int32 store_slot(Store *, int32);
+static int32 store_index(Store *, int32);
+static Entry *store_get(Store *, int32);
+static int32 store_push(Store *);
+static void store_touch(Store *, int32);
+static void store_release(Store *, int32);
+static int32 store_oldest(Store *);
+static int32 store_newest(Store *);
+static int32 store_next(Store *, int32);
+static int32 store_prev(Store *, int32);
+static void store_tree_add(Store *, int32, int32);
+static void store_compact(Store *);
+
+void
+store_init(Store *store, int32 capacity) {
+    int32 timeline_size = 8;
+
+    if (capacity <= 0) {
+        capacity = HISTORY_BUFFER_SIZE;
+    }
+    if (capacity > HISTORY_MAX_SIZE) {
+        capacity = HISTORY_MAX_SIZE;
+    }
+    while (timeline_size < 2*capacity) {
+        timeline_size *= 2;
+    }
+
+    store->capacity = capacity;
+    store->length = 0;
+    store->timeline_size = timeline_size;
+    store->timeline_next = 0;
+    store->nfree = capacity;
+
+    store->entries = malloc2_zero(capacity*SIZEOF(*store->entries));
+    store->positions = malloc2(capacity*SIZEOF(*store->positions));
+    store->free_slots = malloc2(capacity*SIZEOF(*store->free_slots));
+    store->timeline = malloc2(timeline_size*SIZEOF(*store->timeline));
+    store->tree = malloc2_zero((timeline_size + 1)*SIZEOF(*store->tree));
+
+    for (int32 i = 0; i < capacity; i += 1) {
+        store->positions[i] = STORE_EMPTY;
+        store->free_slots[i] = capacity - 1 - i;
+    }
+    for (int32 i = 0; i < timeline_size; i += 1) {
+        store->timeline[i] = STORE_EMPTY;
+    }
+    return;
+}
+
+void
+store_destroy(Store *store) {
+    int32 capacity = store->capacity;
+    int32 timeline_size = store->timeline_size;
+
+    if (capacity <= 0) {
+        return;
+    }
+
+    free2(store->entries, capacity*SIZEOF(*store->entries));
+    free2(store->positions, capacity*SIZEOF(*store->positions));
+    free2(store->free_slots, capacity*SIZEOF(*store->free_slots));
+    free2(store->timeline, timeline_size*SIZEOF(*store->timeline));
+    free2(store->tree, (timeline_size + 1)*SIZEOF(*store->tree));
+    memset64(store, 0, sizeof(*store));
+    return;
+}
+
+void
+store_tree_add(Store *store, int32 position, int32 delta) {
+    for (int32 i = position + 1; i <= store->timeline_size; i += (i & -i)) {
+        store->tree[i] += delta;
+    }
+    return;
+}
+
+void
+store_compact(Store *store) {
+    int32 next = 0;
+
+    for (int32 p = 0; p < store->timeline_next; p += 1) {
+        int32 slot = store->timeline[p];
+
+        if (slot == STORE_EMPTY) {
+            continue;
+        }
+        store->timeline[p] = STORE_EMPTY;
+        store->timeline[next] = slot;
+        store->positions[slot] = next;
+        next += 1;
+    }
+    store->timeline_next = next;
+
+    /* Linear Fenwick build: the first `next` positions are occupied. */
+    memset64(store->tree, 0, (store->timeline_size + 1)*SIZEOF(*store->tree));
+    for (int32 i = 1; i <= store->timeline_size; i += 1) {
+        int32 parent = i + (i & -i);
+
+        if (i <= next) {
+            store->tree[i] += 1;
+        }
+        if (parent <= store->timeline_size) {
+            store->tree[parent] += store->tree[i];
+        }
+    }
+    return;
+}
+
+int32
+store_slot(Store *store, int32 index) {
+    int32 position = 0;
+
+    if ((index < 0) || (index >= store->length)) {
+        return STORE_EMPTY;
+    }
+
+    for (int32 step = store->timeline_size; step > 0; step /= 2) {
+        int32 next = position + step;
+
+        if ((next <= store->timeline_size) && (store->tree[next] <= index)) {
+            position = next;
+            index -= store->tree[next];
+        }
+    }
+    return store->timeline[position];
+}
+
+int32
+store_index(Store *store, int32 slot) {
+    int32 index = 0;
+
+    for (int32 i = store->positions[slot] + 1; i > 0; i -= (i & -i)) {
+        index += store->tree[i];
+    }
+    return index - 1;
+}
+
+Entry *
+store_get(Store *store, int32 index) {
+    int32 slot;
+
+    if ((slot = store_slot(store, index)) == STORE_EMPTY) {
+        return NULL;
+    }
+    return &store->entries[slot];
+}
+
+int32
+store_push(Store *store) {
+    int32 slot;
+
+    if (store->nfree <= 0) {
+        error("History store is full.\n");
+        fatal(EXIT_FAILURE);
+    }
+    if (store->timeline_next >= store->timeline_size) {
+        store_compact(store);
+    }
+
+    store->nfree -= 1;
+    slot = store->free_slots[store->nfree];
+
+    store->positions[slot] = store->timeline_next;
+    store->timeline[store->timeline_next] = slot;
+    store_tree_add(store, store->timeline_next, 1);
+    store->timeline_next += 1;
+    store->length += 1;
+    return slot;
+}
+
+void
+store_touch(Store *store, int32 slot) {
+    int32 position = store->positions[slot];
+
+    if (position == (store->timeline_next - 1)) {
+        return;
+    }
+
+    store->timeline[position] = STORE_EMPTY;
+    store_tree_add(store, position, -1);
+
+    if (store->timeline_next >= store->timeline_size) {
+        store_compact(store);
+    }
+
+    store->positions[slot] = store->timeline_next;
+    store->timeline[store->timeline_next] = slot;
+    store_tree_add(store, store->timeline_next, 1);
+    store->timeline_next += 1;
+    return;
+}
+
+void
+store_release(Store *store, int32 slot) {
+    int32 position = store->positions[slot];
+
+    store->timeline[position] = STORE_EMPTY;
+    store_tree_add(store, position, -1);
+    store->positions[slot] = STORE_EMPTY;
+    memset64(&store->entries[slot], 0, sizeof(*store->entries));
+
+    store->free_slots[store->nfree] = slot;
+    store->nfree += 1;
+    store->length -= 1;
+
+    while ((store->timeline_next > 0)
+           && (store->timeline[store->timeline_next - 1] == STORE_EMPTY)) {
+        store->timeline_next -= 1;
+    }
+    return;
+}
+
+int32
+store_oldest(Store *store) {
+    return store_slot(store, 0);
+}
+
+int32
+store_newest(Store *store) {
+    if (store->length <= 0) {
+        return STORE_EMPTY;
+    }
+    return store->timeline[store->timeline_next - 1];
+}
+
+int32
+store_next(Store *store, int32 slot) {
+    for (int32 p = store->positions[slot] + 1; p < store->timeline_next; p += 1) {
+        if (store->timeline[p] != STORE_EMPTY) {
+            return store->timeline[p];
+        }
+    }
+    return STORE_EMPTY;
+}
+
+int32
+store_prev(Store *store, int32 slot) {
+    for (int32 p = store->positions[slot] - 1; p >= 0; p -= 1) {
+        if (store->timeline[p] != STORE_EMPTY) {
+            return store->timeline[p];
+        }
+    }
+    return STORE_EMPTY;
+}
+
+#if 0 == TESTING_store
+static inline void
+store_functions_sink(void) {
+    (void)store_functions_sink;
+    (void)store_destroy;
+    (void)store_index;
+    (void)store_oldest;
+    (void)store_next;
+    (void)store_prev;
+    (void)store_newest;
+}
+#endif
+
+#if TESTING_store
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+int
+main(void) {
+    Store store = {0};
+
+    store_init(&store, 4);
+    ASSERT_EQUAL(store.capacity, 4);
+    ASSERT_EQUAL(store.length, 0);
+    ASSERT_EQUAL(store_newest(&store), STORE_EMPTY);
+    ASSERT_EQUAL(store_slot(&store, 0), STORE_EMPTY);
+
+    {
+        int32 slots[4];
+
+        for (int32 i = 0; i < 4; i += 1) {
+            slots[i] = store_push(&store);
+            store.entries[slots[i]].content_length = i;
+        }
+        ASSERT_EQUAL(store.length, 4);
+
+        for (int32 i = 0; i < 4; i += 1) {
+            ASSERT_EQUAL(store_slot(&store, i), slots[i]);
+            ASSERT_EQUAL(store_index(&store, slots[i]), i);
+            ASSERT_EQUAL(store_get(&store, i)->content_length, i);
+        }
+
+        store_touch(&store, slots[1]);
+        ASSERT_EQUAL(store_get(&store, 0)->content_length, 0);
+        ASSERT_EQUAL(store_get(&store, 1)->content_length, 2);
+        ASSERT_EQUAL(store_get(&store, 2)->content_length, 3);
+        ASSERT_EQUAL(store_get(&store, 3)->content_length, 1);
+        ASSERT_EQUAL(store_newest(&store), slots[1]);
+
+        store_release(&store, store_oldest(&store));
+        ASSERT_EQUAL(store.length, 3);
+        ASSERT_EQUAL(store_get(&store, 0)->content_length, 2);
+        ASSERT_EQUAL(store_next(&store, slots[2]), slots[3]);
+        ASSERT_EQUAL(store_prev(&store, slots[2]), STORE_EMPTY);
+        ASSERT_EQUAL(store_prev(&store, slots[1]), slots[3]);
+
+        store_release(&store, slots[1]);
+        ASSERT_EQUAL(store_newest(&store), slots[3]);
+    }
+
+    {
+        /* Enough reorders to force several timeline compactions. */
+        int32 slot;
+
+        while (store.length < store.capacity) {
+            slot = store_push(&store);
+            store.entries[slot].content_length = 100 + store.length;
+        }
+        for (int32 i = 0; i < 1000; i += 1) {
+            slot = store_slot(&store, i % store.length);
+            store_touch(&store, slot);
+            ASSERT_EQUAL(store_newest(&store), slot);
+            ASSERT_EQUAL(store_index(&store, slot), store.length - 1);
+        }
+        ASSERT_LESS_EQUAL(store.timeline_next, store.timeline_size);
+
+        for (int32 i = 0; i < store.length; i += 1) {
+            slot = store_slot(&store, i);
+            ASSERT_EQUAL(store_index(&store, slot), i);
+        }
+    }
+
+    store_destroy(&store);
+    store_init(&store, 20000);
+    for (int32 i = 0; i < 100000; i += 1) {
+        if (store.length >= store.capacity) {
+            store_release(&store, store_oldest(&store));
+        }
+        store.entries[store_push(&store)].content_length = i;
+    }
+    ASSERT_EQUAL(store.length, 20000);
+    ASSERT_EQUAL(store_get(&store, 0)->content_length, 100000 - 20000);
+    ASSERT_EQUAL(store_get(&store, 19999)->content_length, 99999);
+    store_destroy(&store);
+
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+#endif /* STORE_C */
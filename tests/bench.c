@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: AGPL
+// Copyright (c) 2026 Lucas Mior
+
+/* Startup benchmark, built and run by `./build.sh bench`.
+ *
+ * usage: bench <entries> <min_size> <max_size> <image_percent> <runs>
+ *              [clipsim binary]
+ *
+ * Generates a history of <entries> entries with sizes spread log-uniformly
+ * between <min_size> and <max_size>, <image_percent> of them images, saves
+ * it and times history_save, history_read and, when a clipsim binary is
+ * given and there is a display, the time from spawning the daemon to its
+ * first answer on the socket.  Each result is one line of key=value pairs,
+ * times in microseconds. */
+
+#include "../clipsim.h"
+
+#define CBASE_IMPLEMENT
+#include "cbase.h"
+
+#include "../ipc.c"
+
+#define BENCH_DAEMON_TIMEOUT_MS 10000
+
+typedef struct BenchConfig {
+    int32 entries;
+    int32 min_size;
+    int32 max_size;
+    int32 image_percent;
+    int32 runs;
+    int32 unused;
+} BenchConfig;
+
+static char bench_directory[PATH_MAX];
+
+static int32 bench_size(BenchConfig *);
+static void bench_generate(BenchConfig *);
+static void bench_report(BenchConfig *, char *, double *, int32);
+static double bench_daemon_first_ipc(char *);
+
+int32
+bench_size(BenchConfig *config) {
+    double low = log((double)config->min_size);
+    double high = log((double)config->max_size);
+    double r = (double)rand_int() / (double)INT32_MAX;
+
+    return (int32)exp(low + r*(high - low));
+}
+
+void
+bench_generate(BenchConfig *config) {
+    char *buffer = malloc2(config->max_size + 1);
+
+    for (int32 i = 0; i < config->entries; i += 1) {
+        int32 size = bench_size(config);
+        int32 n = SNPRINTF(buffer, "%d ", i);
+
+        for (; n < size; n += 1) {
+            int32 r = rand_int() % 64;
+            buffer[n] = (r == 0) ? '\n' : (char)(' ' + (rand_int() % 95));
+        }
+        buffer[n] = '\0';
+
+        if ((rand_int() % 100) < config->image_percent) {
+            char image[PATH_MAX];
+            int32 length = SNPRINTF(image, "%s/bench-%d.png",
+                                    tmp_directory, i);
+            int32 fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+            if (fd < 0) {
+                error("Error creating %s: %s.\n", image, strerror(errno));
+                fatal(EXIT_FAILURE);
+            }
+            write_all(fd, buffer, n);
+            XCLOSE(&fd, image);
+
+            history_insert(image, length, CLIPBOARD_IMAGE,
+                           hash_function(image, length), time(NULL));
+        } else {
+            history_insert(buffer, n, CLIPBOARD_TEXT,
+                           hash_function(buffer, n), time(NULL));
+        }
+    }
+
+    free2(buffer, config->max_size + 1);
+    return;
+}
+
+void
+bench_report(BenchConfig *config, char *name, double *times, int32 ntimes) {
+    struct stat history_stat = {0};
+
+    /* Insertion sort, ntimes is small. */
+    for (int32 i = 1; i < ntimes; i += 1) {
+        double t = times[i];
+        int32 j = i - 1;
+
+        while ((j >= 0) && (times[j] > t)) {
+            times[j + 1] = times[j];
+            j -= 1;
+        }
+        times[j + 1] = t;
+    }
+
+    stat(history.name, &history_stat);
+    printf("name=%s entries=%d min_size=%d max_size=%d image_percent=%d"
+           " file_bytes=%lld runs=%d min_us=%.0f median_us=%.0f max_us=%.0f\n",
+           name, config->entries, config->min_size, config->max_size,
+           config->image_percent, (llong)history_stat.st_size, ntimes,
+           times[0]*1e6, times[ntimes/2]*1e6, times[ntimes - 1]*1e6);
+    fflush(stdout);
+    return;
+}
+
+double
+bench_daemon_first_ipc(char *clipsim) {
+    struct timespec t0;
+    struct timespec t1;
+    double elapsed = -1.0;
+    pid_t pid;
+
+    time_monotonic_precise(&t0);
+    switch ((pid = fork())) {
+    case 0: {
+        int32 null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(clipsim, clipsim, "--daemon", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    case -1:
+        error("Error forking: %s.\n", strerror(errno));
+        return -1.0;
+    default:
+        break;
+    }
+
+    for (int32 i = 0; i < BENCH_DAEMON_TIMEOUT_MS*10; i += 1) {
+        IpcRequest request = {.magic = IPC_MAGIC, .command = COMMAND_STATS,
+                              .id = 0, .request_id = 1};
+        IpcResponse response;
+        int32 fd;
+
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            error("Daemon %s exited before answering.\n", clipsim);
+            return -1.0;
+        }
+        if ((fd = ipc_connect_socket(true)) < 0) {
+            sleep_us(100);
+            continue;
+        }
+        if (ipc_write_all(fd, &request, sizeof(request), ipc_socket.name)
+            && ipc_read_all(fd, &response, sizeof(response), ipc_socket.name)) {
+            time_monotonic_precise(&t1);
+            elapsed = timediff(t0, t1);
+        }
+        XCLOSE(&fd, ipc_socket.name);
+        if (elapsed >= 0.0) {
+            break;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+int
+main(int argc, char **argv) {
+    BenchConfig config;
+    struct timespec t0;
+    struct timespec t1;
+    double *times;
+    char *TMPDIR;
+    char buffer[PATH_MAX];
+
+    (void)ipc_lock_daemon;
+    (void)ipc_client_speak;
+    (void)ipc_daemon_listen;
+
+    if ((argc < 6)
+        || (util_string_int32(&config.entries, argv[1]) < 0)
+        || (util_string_int32(&config.min_size, argv[2]) < 0)
+        || (util_string_int32(&config.max_size, argv[3]) < 0)
+        || (util_string_int32(&config.image_percent, argv[4]) < 0)
+        || (util_string_int32(&config.runs, argv[5]) < 0)
+        || (config.entries <= 0) || (config.runs <= 0)
+        || (config.min_size <= 0) || (config.max_size < config.min_size)
+        || (config.max_size >= ENTRY_MAX_LENGTH)) {
+        error("usage: %s <entries> <min_size> <max_size> <image_percent>"
+              " <runs> [clipsim]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    GETENV(TMPDIR);
+    if ((TMPDIR == NULL) || (TMPDIR[0] == '\0')) {
+        TMPDIR = "/tmp";
+    }
+    SNPRINTF(bench_directory, "%s/clipsim-bench-%d", TMPDIR, (int32)getpid());
+    mkdir(bench_directory, 0700);
+
+    /* Everything the daemon touches lives in bench_directory. */
+    setenv("XDG_CACHE_HOME", bench_directory, 1);
+    setenv("XDG_RUNTIME_DIR", bench_directory, 1);
+    SNPRINTF(buffer, "%d", config.entries);
+    setenv("CLIPSIM_HISTORY_SIZE", buffer, 1);
+    SNPRINTF(buffer, "%s/images", bench_directory);
+    tmp_directory = xmemdup(buffer, strlen32(buffer) + 1);
+
+    magic = magic_open(MAGIC_MIME_TYPE);
+    magic_load(magic, NULL);
+    rand_int_seed(0);
+    times = malloc2(config.runs*SIZEOF(*times));
+
+    history_init();
+    history_read();
+    bench_generate(&config);
+
+    for (int32 i = 0; i < config.runs; i += 1) {
+        time_monotonic_precise(&t0);
+        if (!history_save()) {
+            error("Error saving history.\n");
+            exit(EXIT_FAILURE);
+        }
+        time_monotonic_precise(&t1);
+        times[i] = timediff(t0, t1);
+    }
+    bench_report(&config, "history_save", times, config.runs);
+
+    for (int32 i = 0; i < config.runs; i += 1) {
+        journal_close(&journal);
+        history_init();
+        time_monotonic_precise(&t0);
+        history_read();
+        time_monotonic_precise(&t1);
+        times[i] = timediff(t0, t1);
+
+        if (clipsim_entries.length != config.entries) {
+            error("Read %d entries, expected %d.\n",
+                  clipsim_entries.length, config.entries);
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_report(&config, "history_read", times, config.runs);
+    journal_close(&journal);
+
+    if ((argc > 6) && (getenv("DISPLAY") != NULL)) {
+        int32 ok = 0;
+
+        for (int32 i = 0; i < config.runs; i += 1) {
+            if ((times[ok] = bench_daemon_first_ipc(argv[6])) >= 0.0) {
+                ok += 1;
+            }
+        }
+        if (ok > 0) {
+            bench_report(&config, "daemon_first_ipc", times, ok);
+        }
+    } else {
+        printf("name=daemon_first_ipc entries=%d skipped=1\n", config.entries);
+    }
+
+    free2(times, config.runs*SIZEOF(*times));
+    exit(EXIT_SUCCESS);
+}
@@ -269,6 +269,12 @@ if [ ! -s "$XDG_CACHE_HOME/clipsim/history" ]; then
     exit 1
 fi
 
+if ! $clipsim_bin -S | grep -q "wasted"; then
+    echo "FAIL: --stats did not report slab usage."
+    exit 1
+fi
+sleep $interval
+
 $clipsim_bin -p > "$TEST_DIR/before_remove"
 sleep $interval
 $clipsim_bin -r 0